@@ -0,0 +1,190 @@
+#!/bin/sh
+#
+# Time sqlar on a synthetic corpus, and zip and tar on the same corpus
+# if they are installed.  Run by "make bench", or directly:
+#
+#     sh bench/bench.sh [SQLAR-OPTIONS...]
+#
+# Any arguments are passed to sqlar when it creates the archive, so
+# that runs with different options can be compared, for example:
+#
+#     make bench BENCH_OPT="-j 8 --solid"
+#
+# Each result is appended as one line to a CSV file, along with the date
+# and the git commit, so that regressions show up between commits.  The
+# columns are:
+#
+#     date,commit,tool,operation,seconds,bytes,options
+#
+# where bytes is the size of the archive after "create" and "delete".
+# sqlar does not VACUUM, so deleting does not shrink the archive file.
+# The sqlarfs reads are timed only if ./sqlarfs has been built and FUSE
+# is usable.  All times are with a warm cache.
+#
+# Environment variables:
+#
+#     SQLAR         The sqlar program (default ./sqlar)
+#     SQLARFS       The sqlarfs program (default ./sqlarfs)
+#     BENCH_DIR     Scratch directory (default bench.tmp).  The corpus
+#                   is kept there and reused by later runs
+#     BENCH_CSV     Append results here (default bench.csv)
+#     BENCH_SCALE   Size of the corpus (default 1.0).  See mkcorpus.c
+#
+set -e
+
+TOP=$(pwd)
+SQLAR=${SQLAR:-./sqlar}
+SQLARFS=${SQLARFS:-./sqlarfs}
+SIZEOF=
+BENCH_DIR=${BENCH_DIR:-bench.tmp}
+BENCH_CSV=${BENCH_CSV:-bench.csv}
+BENCH_SCALE=${BENCH_SCALE:-1.0}
+case $SQLAR in /*) ;; *) SQLAR=$TOP/$SQLAR ;; esac
+case $SQLARFS in /*) ;; *) SQLARFS=$TOP/$SQLARFS ;; esac
+case $BENCH_CSV in /*) ;; *) BENCH_CSV=$TOP/$BENCH_CSV ;; esac
+OPTIONS="$*"
+DATE=$(date -u +%Y-%m-%dT%H:%M:%SZ)
+COMMIT=$(git rev-parse --short HEAD 2>/dev/null || echo unknown)
+if [ -n "$(git status --porcelain --untracked-files=no 2>/dev/null)" ]; then
+  COMMIT=$COMMIT+
+fi
+
+# Current time in seconds, with nanoseconds where date(1) supports them
+if [ "$(date +%N)" = "N" ]; then
+  now() { date +%s; }
+else
+  now() { date +%s.%N; }
+fi
+
+# Record one result: tool operation seconds [bytes].  The options only
+# apply to sqlar and sqlarfs.
+record() {
+  opt=
+  case $1 in sqlar*) opt=$OPTIONS ;; esac
+  printf '%-7s %-14s %9.3f s %s\n' "$1" "$2" "$3" "$4"
+  printf '%s,%s,%s,%s,%s,%s,"%s"\n' "$DATE" "$COMMIT" "$1" "$2" "$3" "$4" \
+         "$opt" >>"$BENCH_CSV"
+}
+
+# Time a command: tool operation command...  If $SIZEOF names a file,
+# record its size after the command.
+run() {
+  tool=$1
+  op=$2
+  shift 2
+  t0=$(now)
+  if ! "$@" >/dev/null 2>"$ERR"; then
+    echo "$tool $op failed: $*" >&2
+    cat "$ERR" >&2
+    exit 1
+  fi
+  t1=$(now)
+  bytes=
+  [ -z "$SIZEOF" ] || bytes=$(wc -c <"$SIZEOF" | tr -d ' ')
+  SIZEOF=
+  record "$tool" "$op" "$(echo "$t0 $t1" | awk '{printf "%.3f", $2-$1}')" \
+         "$bytes"
+}
+
+if [ ! -x "$SQLAR" ]; then
+  echo "no sqlar program: $SQLAR" >&2
+  exit 1
+fi
+[ -f "$BENCH_CSV" ] ||
+  echo "date,commit,tool,operation,seconds,bytes,options" >"$BENCH_CSV"
+mkdir -p "$BENCH_DIR"
+cd "$BENCH_DIR"
+ERR=$(pwd)/bench.err
+
+# The corpus is only made again if the scale has changed
+if [ "$(cat corpus.scale 2>/dev/null)" != "$BENCH_SCALE" ]; then
+  rm -rf corpus corpus.scale
+  "$TOP/bench/mkcorpus" corpus "$BENCH_SCALE"
+  echo "$BENCH_SCALE" >corpus.scale
+fi
+echo "corpus: $(find corpus -type f | wc -l | tr -d ' ') files," \
+     "$(find corpus -type f -exec cat {} + | wc -c | tr -d ' ') bytes"
+
+# sqlar
+rm -f a.sqlar d.sqlar
+SIZEOF=a.sqlar
+run sqlar create "$SQLAR" "$@" a.sqlar corpus
+run sqlar list "$SQLAR" -l a.sqlar
+run sqlar list-verbose "$SQLAR" -lv a.sqlar
+rm -rf out && mkdir out && cd out
+run sqlar extract "$SQLAR" -x ../a.sqlar
+cd ..
+if ! diff -r corpus out/corpus >/dev/null; then
+  echo "sqlar extract: output differs from the corpus" >&2
+  exit 1
+fi
+rm -rf out && mkdir out && cd out
+run sqlar extract-glob "$SQLAR" -x ../a.sqlar 'corpus/src/*'
+cd ..
+cp a.sqlar d.sqlar
+SIZEOF=d.sqlar
+run sqlar delete "$SQLAR" -d d.sqlar 'corpus/tiny/*'
+
+# sqlarfs, mounted in the background
+if [ -x "$SQLARFS" ] && [ -e /dev/fuse ] && command -v fusermount >/dev/null
+then
+  rm -rf mnt && mkdir mnt
+  "$SQLARFS" "$PWD/a.sqlar" "$PWD/mnt" &
+  pid=$!
+  i=0
+  while [ ! -d mnt/corpus ] && [ $i -lt 50 ]; do sleep 0.1; i=$((i+1)); done
+  if [ -d mnt/corpus ]; then
+    run sqlarfs read-all sh -c 'find mnt/corpus -type f -exec cat {} + '
+    run sqlarfs read-random "$TOP/bench/randread" 2000 4096 \
+        mnt/corpus/blob/* mnt/corpus/log/* mnt/corpus/src/mod00/*
+  else
+    echo "sqlarfs: mount failed; skipped" >&2
+  fi
+  fusermount -u mnt 2>/dev/null || true
+  wait $pid 2>/dev/null || true
+  rmdir mnt
+else
+  echo "sqlarfs: not built or FUSE not available; skipped"
+fi
+
+# zip, at its default level like sqlar
+if command -v zip >/dev/null && command -v unzip >/dev/null; then
+  rm -f a.zip d.zip
+  SIZEOF=a.zip
+  run zip create zip -q -r a.zip corpus
+  run zip list unzip -l a.zip
+  run zip list-verbose unzip -v a.zip
+  rm -rf out && mkdir out && cd out
+  run zip extract unzip -q ../a.zip
+  cd ..
+  rm -rf out && mkdir out && cd out
+  run zip extract-glob unzip -q ../a.zip 'corpus/src/*'
+  cd ..
+  cp a.zip d.zip
+  SIZEOF=d.zip
+  run zip delete zip -q d.zip -d 'corpus/tiny/*'
+  rm -f a.zip d.zip
+fi
+
+# tar with gzip.  There is no way to delete from a compressed tarball.
+if command -v tar >/dev/null && command -v gzip >/dev/null; then
+  rm -f a.tar.gz
+  SIZEOF=a.tar.gz
+  run tar create tar -czf a.tar.gz corpus
+  run tar list tar -tzf a.tar.gz
+  run tar list-verbose tar -tvzf a.tar.gz
+  rm -rf out && mkdir out && cd out
+  run tar extract tar -xzf ../a.tar.gz
+  cd ..
+  rm -rf out && mkdir out && cd out
+  if tar --version 2>/dev/null | grep -q GNU; then
+    run tar extract-glob tar -xzf ../a.tar.gz --wildcards 'corpus/src/*'
+  else
+    run tar extract-glob tar -xzf ../a.tar.gz 'corpus/src/*'
+  fi
+  cd ..
+  rm -f a.tar.gz
+fi
+
+rm -rf out a.sqlar d.sqlar "$ERR"
+echo "results appended to $BENCH_CSV"
@@ -0,0 +1,243 @@
+/*
+** Generate the synthetic corpus used by "make bench".
+**
+**     mkcorpus DIRECTORY [SCALE]
+**
+** The corpus has four parts, each meant to stress a different path
+** through sqlar:
+**
+**     tiny/   Many files of less than 256 bytes each
+**     src/    A source tree: text files of 1K to 40K, in subdirectories
+**     blob/   Large files of random bytes that do not compress
+**     log/    Large log files that compress well
+**
+** The content comes from a fixed pseudo-random sequence, and all
+** modification times are set to the same fixed value, so the corpus is
+** the same byte for byte on every machine and every run.  SCALE, which
+** defaults to 1.0, multiplies the number of files of each part.  At
+** SCALE 1.0 the corpus is about 24000 files and 280MB.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <utime.h>
+
+/* Modification time of every file: 2020-01-01 00:00:00 UTC */
+#define CORPUS_MTIME  1577836800
+
+/* Number of files of each part at SCALE 1.0 */
+#define N_TINY   20000
+#define N_SRC     4000
+#define N_BLOB       8
+#define N_LOG        4
+
+/* Sizes of the large files */
+#define SZ_BLOB  (8*1024*1024)
+#define SZ_LOG   (32*1024*1024)
+
+/*
+** The pseudo-random sequence: splitmix64
+*/
+static unsigned long long iSeed = 0x73716c617262656eULL;
+static unsigned long long prng(void){
+  unsigned long long z = (iSeed += 0x9E3779B97F4A7C15ULL);
+  z = (z ^ (z>>30)) * 0xBF58476D1CE4E5B9ULL;
+  z = (z ^ (z>>27)) * 0x94D049BB133111EBULL;
+  return z ^ (z>>31);
+}
+
+/* Return a pseudo-random integer between 0 and n-1 */
+static int prng_int(int n){
+  return (int)(prng() % (unsigned)n);
+}
+
+/*
+** Words from which source files and log lines are made
+*/
+static const char *const azWord[] = {
+  "int", "char", "static", "const", "return", "if", "else", "while",
+  "for", "struct", "void", "sqlite3", "db", "rc", "zName", "nByte",
+  "pStmt", "iOfst", "aBuf", "errorMsg", "malloc", "free", "memcpy",
+  "strlen", "the", "of", "a", "is", "to", "file", "archive", "content",
+  "block", "chunk", "index", "page", "cache", "read", "write", "open",
+};
+#define N_WORD ((int)(sizeof(azWord)/sizeof(azWord[0])))
+
+/*
+** Panic message
+*/
+static void errorMsg(const char *zMsg, const char *zPath){
+  fprintf(stderr, "mkcorpus: %s: %s\n", zMsg, zPath);
+  exit(1);
+}
+
+/*
+** Create directory zPath if it does not already exist
+*/
+static void make_dir(const char *zPath){
+  struct stat x;
+  if( stat(zPath, &x)==0 && S_ISDIR(x.st_mode) ) return;
+  if( mkdir(zPath, 0755) ) errorMsg("cannot create directory", zPath);
+}
+
+/*
+** Set the modification time of zPath to CORPUS_MTIME
+*/
+static void set_mtime(const char *zPath){
+  struct utimbuf t;
+  t.actime = t.modtime = CORPUS_MTIME;
+  if( utime(zPath, &t) ) errorMsg("cannot set the time of", zPath);
+}
+
+/*
+** Write n bytes from a[] to the new file zPath
+*/
+static void write_file(const char *zPath, const char *a, size_t n){
+  FILE *out = fopen(zPath, "wb");
+  if( out==0 ) errorMsg("cannot open for writing", zPath);
+  if( n>0 && fwrite(a, n, 1, out)!=1 ) errorMsg("cannot write", zPath);
+  fclose(out);
+  set_mtime(zPath);
+}
+
+/*
+** Fill a[] with nMax bytes or less of text made of lines.  Each line is
+** produced by xLine().  Return the number of bytes used.
+*/
+static size_t fill_text(
+  char *a,                             /* Write text here */
+  size_t nMax,                         /* Size of a[] */
+  int (*xLine)(char*, int, long),      /* Write one line, return its size */
+  long iLine                           /* Number of the first line */
+){
+  size_t n = 0;
+  char zLine[200];
+  while( 1 ){
+    int k = xLine(zLine, sizeof(zLine), iLine++);
+    if( n+k>nMax ) break;
+    memcpy(&a[n], zLine, k);
+    n += k;
+  }
+  return n;
+}
+
+/*
+** One line of a source file
+*/
+static int src_line(char *z, int nz, long iLine){
+  int nIndent = prng_int(4)*2;
+  int nWord = prng_int(8);
+  int k = 0, i;
+  (void)iLine;
+  for(i=0; i<nIndent; i++) z[k++] = ' ';
+  for(i=0; i<nWord; i++){
+    k += snprintf(&z[k], nz-k, "%s%s", i ? " " : "",
+                  azWord[prng_int(N_WORD)]);
+  }
+  k += snprintf(&z[k], nz-k, "%s\n", nWord ? ";" : "");
+  return k;
+}
+
+/*
+** One line of a log file
+*/
+static int log_line(char *z, int nz, long iLine){
+  static const char *const azLevel[] = { "INFO", "INFO", "INFO", "WARN",
+                                          "DEBUG", "ERROR" };
+  return snprintf(z, nz, "2020-01-01T%02ld:%02ld:%02ld.%03d %-5s"
+                  " worker-%d %s %s %s id=%d\n",
+                  iLine/3600000%24, iLine/60000%60, iLine/1000%60,
+                  prng_int(1000), azLevel[prng_int(6)], prng_int(16),
+                  azWord[prng_int(N_WORD)], azWord[prng_int(N_WORD)],
+                  azWord[prng_int(N_WORD)], prng_int(100000));
+}
+
+int main(int argc, char **argv){
+  const char *zDir;
+  double scale = 1.0;
+  char zPath[1000];
+  char *a;
+  int nTiny, nSrc, nBlob, nLog;
+  int i, j;
+
+  if( argc!=2 && argc!=3 ){
+    fprintf(stderr, "Usage: %s DIRECTORY [SCALE]\n", argv[0]);
+    exit(1);
+  }
+  zDir = argv[1];
+  if( argc==3 ) scale = atof(argv[2]);
+  if( scale<=0.0 ) errorMsg("bad scale", argv[2]);
+  nTiny = (int)(N_TINY*scale + 0.5);
+  nSrc = (int)(N_SRC*scale + 0.5);
+  nBlob = (int)(N_BLOB*scale + 0.5);
+  nLog = (int)(N_LOG*scale + 0.5);
+  if( nBlob<1 ) nBlob = 1;
+  if( nLog<1 ) nLog = 1;
+  a = malloc( SZ_LOG );
+  if( a==0 ) errorMsg("out of memory", zDir);
+  make_dir(zDir);
+
+  /* Many tiny files, 100 to a directory */
+  snprintf(zPath, sizeof(zPath), "%s/tiny", zDir);
+  make_dir(zPath);
+  for(i=0; i<nTiny; i++){
+    int n = prng_int(256);
+    snprintf(zPath, sizeof(zPath), "%s/tiny/d%03d", zDir, i/100);
+    if( i%100==0 ) make_dir(zPath);
+    snprintf(zPath, sizeof(zPath), "%s/tiny/d%03d/f%05d.txt",
+             zDir, i/100, i);
+    for(j=0; j<n; j++) a[j] = "abcdefgh =\n"[prng_int(11)];
+    write_file(zPath, a, n);
+  }
+
+  /* A source tree, 50 files to a directory */
+  snprintf(zPath, sizeof(zPath), "%s/src", zDir);
+  make_dir(zPath);
+  for(i=0; i<nSrc; i++){
+    size_t n = 1024 + prng_int(39*1024);
+    snprintf(zPath, sizeof(zPath), "%s/src/mod%02d", zDir, i/50);
+    if( i%50==0 ) make_dir(zPath);
+    snprintf(zPath, sizeof(zPath), "%s/src/mod%02d/file%04d.c",
+             zDir, i/50, i);
+    write_file(zPath, a, fill_text(a, n, src_line, 0));
+  }
+
+  /* Large incompressible files */
+  snprintf(zPath, sizeof(zPath), "%s/blob", zDir);
+  make_dir(zPath);
+  for(i=0; i<nBlob; i++){
+    for(j=0; j<SZ_BLOB; j+=8){
+      unsigned long long x = prng();
+      memcpy(&a[j], &x, 8);
+    }
+    snprintf(zPath, sizeof(zPath), "%s/blob/blob%d.bin", zDir, i);
+    write_file(zPath, a, SZ_BLOB);
+  }
+
+  /* Large compressible log files */
+  snprintf(zPath, sizeof(zPath), "%s/log", zDir);
+  make_dir(zPath);
+  for(i=0; i<nLog; i++){
+    snprintf(zPath, sizeof(zPath), "%s/log/log%d.log", zDir, i);
+    write_file(zPath, a, fill_text(a, SZ_LOG, log_line, i*1000000L));
+  }
+
+  /* Directory times last, since adding files changes them */
+  for(i=0; i<nTiny; i+=100){
+    snprintf(zPath, sizeof(zPath), "%s/tiny/d%03d", zDir, i/100);
+    set_mtime(zPath);
+  }
+  for(i=0; i<nSrc; i+=50){
+    snprintf(zPath, sizeof(zPath), "%s/src/mod%02d", zDir, i/50);
+    set_mtime(zPath);
+  }
+  snprintf(zPath, sizeof(zPath), "%s/tiny", zDir);   set_mtime(zPath);
+  snprintf(zPath, sizeof(zPath), "%s/src", zDir);    set_mtime(zPath);
+  snprintf(zPath, sizeof(zPath), "%s/blob", zDir);   set_mtime(zPath);
+  snprintf(zPath, sizeof(zPath), "%s/log", zDir);    set_mtime(zPath);
+  set_mtime(zDir);
+  free(a);
+  return 0;
+}
@@ -0,0 +1,68 @@
+/*
+** Random reads for "make bench".
+**
+**     randread COUNT SIZE FILE...
+**
+** Read COUNT blocks of SIZE bytes each from the FILEs, one block at a
+** time, each from a pseudo-random file at a pseudo-random offset.  The
+** sequence is fixed, so every run reads the same blocks.  This is used
+** to time random access through sqlarfs, where each read decompresses
+** part of a file, or some or all of it.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+/*
+** The pseudo-random sequence: splitmix64
+*/
+static unsigned long long iSeed = 0x72616e6472656164ULL;
+static unsigned long long prng(void){
+  unsigned long long z = (iSeed += 0x9E3779B97F4A7C15ULL);
+  z = (z ^ (z>>30)) * 0xBF58476D1CE4E5B9ULL;
+  z = (z ^ (z>>27)) * 0x94D049BB133111EBULL;
+  return z ^ (z>>31);
+}
+
+int main(int argc, char **argv){
+  int nRead, szBlock, nFile;
+  char *a;
+  int i;
+
+  if( argc<4 ){
+    fprintf(stderr, "Usage: %s COUNT SIZE FILE...\n", argv[0]);
+    exit(1);
+  }
+  nRead = atoi(argv[1]);
+  szBlock = atoi(argv[2]);
+  nFile = argc-3;
+  if( szBlock<=0 ){
+    fprintf(stderr, "%s: bad SIZE: %s\n", argv[0], argv[2]);
+    exit(1);
+  }
+  a = malloc( szBlock );
+  if( a==0 ){
+    fprintf(stderr, "%s: out of memory\n", argv[0]);
+    exit(1);
+  }
+  for(i=0; i<nRead; i++){
+    const char *zFile = argv[3 + prng()%nFile];
+    struct stat x;
+    off_t iOfst = 0;
+    int fd = open(zFile, O_RDONLY);
+    if( fd<0 || fstat(fd, &x) ){
+      fprintf(stderr, "%s: cannot open %s\n", argv[0], zFile);
+      exit(1);
+    }
+    if( x.st_size>szBlock ) iOfst = prng()%(x.st_size - szBlock);
+    if( pread(fd, a, szBlock, iOfst)<0 ){
+      fprintf(stderr, "%s: cannot read %s\n", argv[0], zFile);
+      exit(1);
+    }
+    close(fd);
+  }
+  free(a);
+  return 0;
+}
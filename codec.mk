@@ -7,17 +7,19 @@
 #
 CC = gcc -g -I. -D_FILE_OFFSET_BITS=64 -Wall -Werror -static -Os
 ZLIB = -lz
+THREADLIB = -lpthread
+MATHLIB = -lm
 FUSELIB = -lfuse -lpthread -ldl
 SQLITE_OPT = $(OPT) -DSQLITE_THREADSAFE=0 -DSQLITE_OMIT_LOAD_EXTENSION
 SQLITE_OPT += -DSQLITE_OMIT_SHAREDCACHE
 CC += -DSQLITE_HAS_CODEC
 
-sqlar:	sqlar.c sqlite3.o
-	$(CC) -o sqlar $(OPT) sqlar.c sqlite3.o $(ZLIB)
+sqlar:	sqlar.c compress.h sqlite3.o
+	$(CC) -o sqlar $(OPT) sqlar.c sqlite3.o $(ZLIB) $(MATHLIB) $(THREADLIB)
 
 all: sqlar sqlarfs
 
-sqlarfs:	sqlarfs.c sqlite3.o
+sqlarfs:	sqlarfs.c compress.h sqlite3.o
 	$(CC) -o sqlarfs $(OPT) sqlarfs.c sqlite3.o $(ZLIB) $(FUSELIB)
 
 see-sqlite3.c: sqlite3.c $(CODEC)
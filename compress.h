@@ -0,0 +1,348 @@
+/*
+** Compression methods shared by sqlar and sqlarfs.
+**
+** Compressed content is self-describing.  Each codec writes a format
+** whose first few bytes identify it: a zlib stream header, or the frame
+** magic number of zstd or lz4.  So the codec used for each file, chunk,
+** or shared content BLOB is recognized from the BLOB itself and the
+** archive schema is the same for all codecs.  Content is compressed if
+** it is smaller than its original size, exactly as before.  Archives
+** written by older versions of sqlar always use zlib.
+**
+** The zstd and lz4 codecs are only available if sqlar is compiled with
+** -DSQLAR_ENABLE_ZSTD and -DSQLAR_ENABLE_LZ4.  Without them, content
+** compressed by those codecs is still recognized, so that a sensible
+** error can be given, but it cannot be decompressed.
+**
+** If compiled with -DSQLAR_ENABLE_LIBDEFLATE, content that is compressed
+** or decompressed as a whole buffer in the zlib format uses libdeflate
+** instead of zlib, which is much faster.  The output is a zlib stream as
+** before, though not the same bytes as zlib would write.  libdeflate has
+** no preset dictionaries and cannot stream, so content that uses the
+** --dict dictionary and large files that are compressed incrementally
+** still use zlib.
+**
+** These routines are called by worker threads.  They must not call
+** into SQLite and they allocate memory using malloc().
+*/
+#ifdef SQLAR_ENABLE_LIBDEFLATE
+# include <libdeflate.h>
+#endif
+#ifdef SQLAR_ENABLE_ZSTD
+# include <zstd.h>
+#endif
+#ifdef SQLAR_ENABLE_LZ4
+# include <lz4frame.h>
+#endif
+
+typedef struct Codec Codec;
+struct Codec {
+  const char *zName;     /* Name of the codec for the --codec option */
+  const char *zAlgo;     /* Name of the algorithm for verbose output */
+  int iMinLevel;         /* Smallest compression level */
+  int iMaxLevel;         /* Largest compression level */
+  int iDefault;          /* Default compression level */
+
+  /* Return true if a[0..n-1] is the start of content from this codec */
+  int (*xIsMine)(const unsigned char *a, size_t n);
+
+  /* Compress nIn bytes from pIn at level iLevel into a new buffer
+  ** obtained from malloc().  Return 0 on success.  NULL if the codec
+  ** is not compiled in. */
+  int (*xCompress)(const char *pIn, size_t nIn, int iLevel,
+                   char **ppOut, size_t *pnOut);
+
+  /* Decompress nIn bytes from pIn into pOut, which has room for *pnOut
+  ** bytes.  Set *pnOut to the decompressed size and return 0 on
+  ** success.  NULL if the codec is not compiled in. */
+  int (*xUncompress)(const char *pIn, size_t nIn, char *pOut, size_t *pnOut);
+};
+
+/*
+** zlib.  This is the default codec and the only one that older versions
+** of sqlar understand.
+*/
+static int zlib_is_mine(const unsigned char *a, size_t n){
+  return n>=2 && (a[0]&0x0f)==Z_DEFLATED && (a[0]>>4)<=7
+               && ((a[0]<<8) | a[1])%31==0;
+}
+
+/*
+** A preset dictionary for zlib.  Small files compress much better when
+** the compressor starts out with typical content already in its window.
+** Such content has the FDICT flag set in its zlib header, followed by
+** the Adler-32 checksum of the dictionary, so it is still recognized by
+** zlib_is_mine().  The dictionary is stored in the archive and must be
+** installed by zlib_set_dict() before the content can be decompressed.
+**
+** When a dictionary is installed, zlib content of at most ZLIB_DICT_MAX
+** bytes is compressed with it.  Larger content gains little from it.
+*/
+#define ZLIB_DICT_MAX  (8*1024)
+static const char *zlibDict = 0;     /* The dictionary, or NULL */
+static size_t nZlibDict = 0;         /* Size of zlibDict in bytes */
+static uLong zlibDictId = 0;         /* Adler-32 checksum of zlibDict */
+
+static void zlib_set_dict(const char *a, size_t n){
+  zlibDict = a;
+  nZlibDict = n;
+  zlibDictId = adler32(adler32(0, 0, 0), (const Bytef*)a, n);
+}
+
+/*
+** A zlib compressor that can be used again and again.  Setting up a
+** deflate stream costs more than compressing a small file, and loading
+** the dictionary costs about as much again, so a thread that compresses
+** many files keeps a ZlibEncoder.  The output is the same as from
+** compress2() when there is no dictionary.
+*/
+typedef struct ZlibEncoder ZlibEncoder;
+struct ZlibEncoder {
+  z_stream z;            /* The deflate stream */
+  int iLevel;            /* Compression level of z */
+  int isInit;            /* True if z has been initialized */
+#ifdef SQLAR_ENABLE_LIBDEFLATE
+  struct libdeflate_compressor *pLd;  /* libdeflate compressor, or NULL */
+  int iLdLevel;          /* Compression level of pLd */
+#endif
+};
+#ifdef SQLAR_ENABLE_LIBDEFLATE
+static int zlib_encode_libdeflate(ZlibEncoder *p, const char *pIn,
+                                  size_t nIn, int iLevel,
+                                  char **ppOut, size_t *pnOut){
+  size_t nOut;
+  char *pOut;
+  if( iLevel==Z_DEFAULT_COMPRESSION ) iLevel = 6;
+  if( p->pLd && p->iLdLevel!=iLevel ){
+    libdeflate_free_compressor(p->pLd);
+    p->pLd = 0;
+  }
+  if( p->pLd==0 ){
+    p->pLd = libdeflate_alloc_compressor(iLevel);
+    if( p->pLd==0 ) return 1;
+    p->iLdLevel = iLevel;
+  }
+  nOut = libdeflate_zlib_compress_bound(p->pLd, nIn);
+  pOut = malloc( nOut+1 );
+  if( pOut==0 ) return 1;
+  nOut = libdeflate_zlib_compress(p->pLd, pIn, nIn, pOut, nOut);
+  if( nOut==0 ){
+    free(pOut);
+    return 1;
+  }
+  *ppOut = pOut;
+  *pnOut = nOut;
+  return 0;
+}
+#endif
+static int zlib_encode(ZlibEncoder *p, const char *pIn, size_t nIn,
+                       int iLevel, char **ppOut, size_t *pnOut){
+  uLongf nOut;
+  char *pOut;
+#ifdef SQLAR_ENABLE_LIBDEFLATE
+  if( iLevel!=0 && (zlibDict==0 || nIn>ZLIB_DICT_MAX) ){
+    return zlib_encode_libdeflate(p, pIn, nIn, iLevel, ppOut, pnOut);
+  }
+#endif
+  nOut = compressBound(nIn) + 4;
+  pOut = malloc( nOut+1 );
+  if( pOut==0 ) return 1;
+  if( p->isInit && p->iLevel!=iLevel ){
+    deflateEnd(&p->z);
+    p->isInit = 0;
+  }
+  if( p->isInit ){
+    deflateReset(&p->z);
+  }else{
+    memset(&p->z, 0, sizeof(p->z));
+    if( deflateInit(&p->z, iLevel)!=Z_OK ){
+      free(pOut);
+      return 1;
+    }
+    p->iLevel = iLevel;
+    p->isInit = 1;
+  }
+  if( zlibDict && nIn<=ZLIB_DICT_MAX && iLevel!=0 ){
+    deflateSetDictionary(&p->z, (const Bytef*)zlibDict, nZlibDict);
+  }
+  p->z.next_in = (Bytef*)pIn;
+  p->z.avail_in = nIn;
+  p->z.next_out = (Bytef*)pOut;
+  p->z.avail_out = nOut;
+  if( deflate(&p->z, Z_FINISH)!=Z_STREAM_END ){
+    free(pOut);
+    return 1;
+  }
+  *ppOut = pOut;
+  *pnOut = p->z.total_out;
+  return 0;
+}
+static void zlib_encoder_free(ZlibEncoder *p){
+  if( p->isInit ) deflateEnd(&p->z);
+  p->isInit = 0;
+#ifdef SQLAR_ENABLE_LIBDEFLATE
+  if( p->pLd ) libdeflate_free_compressor(p->pLd);
+  p->pLd = 0;
+#endif
+}
+
+static int zlib_compress(const char *pIn, size_t nIn, int iLevel,
+                         char **ppOut, size_t *pnOut){
+  ZlibEncoder e;
+  int rc;
+  memset(&e, 0, sizeof(e));
+  rc = zlib_encode(&e, pIn, nIn, iLevel, ppOut, pnOut);
+  zlib_encoder_free(&e);
+  return rc;
+}
+static int zlib_uncompress(const char *pIn, size_t nIn,
+                           char *pOut, size_t *pnOut){
+  z_stream z;
+  int rc;
+#ifdef SQLAR_ENABLE_LIBDEFLATE
+  if( nIn>=2 && (pIn[1]&0x20)==0 ){
+    /* No preset dictionary (FDICT flag clear) */
+    struct libdeflate_decompressor *pLd = libdeflate_alloc_decompressor();
+    enum libdeflate_result r;
+    if( pLd==0 ) return 1;
+    r = libdeflate_zlib_decompress(pLd, pIn, nIn, pOut, *pnOut, pnOut);
+    libdeflate_free_decompressor(pLd);
+    return r!=LIBDEFLATE_SUCCESS;
+  }
+#endif
+  memset(&z, 0, sizeof(z));
+  z.next_in = (Bytef*)pIn;
+  z.avail_in = nIn;
+  z.next_out = (Bytef*)pOut;
+  z.avail_out = *pnOut;
+  if( inflateInit(&z)!=Z_OK ) return 1;
+  rc = inflate(&z, Z_FINISH);
+  if( rc==Z_NEED_DICT ){
+    if( zlibDict==0 || z.adler!=zlibDictId
+     || inflateSetDictionary(&z, (const Bytef*)zlibDict, nZlibDict)!=Z_OK
+    ){
+      rc = Z_DATA_ERROR;
+    }else{
+      rc = inflate(&z, Z_FINISH);
+    }
+  }
+  *pnOut = z.total_out;
+  inflateEnd(&z);
+  return rc!=Z_STREAM_END;
+}
+
+/*
+** zstd.  A zstd frame begins with the magic number 0xFD2FB528.
+*/
+static int zstd_is_mine(const unsigned char *a, size_t n){
+  return n>=4 && a[0]==0x28 && a[1]==0xb5 && a[2]==0x2f && a[3]==0xfd;
+}
+#ifdef SQLAR_ENABLE_ZSTD
+static int zstd_compress(const char *pIn, size_t nIn, int iLevel,
+                         char **ppOut, size_t *pnOut){
+  size_t nOut = ZSTD_compressBound(nIn);
+  char *pOut = malloc( nOut+1 );
+  if( pOut==0 ) return 1;
+  nOut = ZSTD_compress(pOut, nOut, pIn, nIn, iLevel);
+  if( ZSTD_isError(nOut) ){
+    free(pOut);
+    return 1;
+  }
+  *ppOut = pOut;
+  *pnOut = nOut;
+  return 0;
+}
+static int zstd_uncompress(const char *pIn, size_t nIn,
+                           char *pOut, size_t *pnOut){
+  size_t nOut = ZSTD_decompress(pOut, *pnOut, pIn, nIn);
+  if( ZSTD_isError(nOut) ) return 1;
+  *pnOut = nOut;
+  return 0;
+}
+#else
+# define zstd_compress 0
+# define zstd_uncompress 0
+#endif
+
+/*
+** lz4, using the lz4 frame format.  A frame begins with the magic
+** number 0x184D2204.
+*/
+static int lz4_is_mine(const unsigned char *a, size_t n){
+  return n>=4 && a[0]==0x04 && a[1]==0x22 && a[2]==0x4d && a[3]==0x18;
+}
+#ifdef SQLAR_ENABLE_LZ4
+static int lz4_compress(const char *pIn, size_t nIn, int iLevel,
+                        char **ppOut, size_t *pnOut){
+  LZ4F_preferences_t prefs;
+  size_t nOut;
+  char *pOut;
+  memset(&prefs, 0, sizeof(prefs));
+  prefs.compressionLevel = iLevel;
+  prefs.frameInfo.contentSize = nIn;
+  nOut = LZ4F_compressFrameBound(nIn, &prefs);
+  pOut = malloc( nOut+1 );
+  if( pOut==0 ) return 1;
+  nOut = LZ4F_compressFrame(pOut, nOut, pIn, nIn, &prefs);
+  if( LZ4F_isError(nOut) ){
+    free(pOut);
+    return 1;
+  }
+  *ppOut = pOut;
+  *pnOut = nOut;
+  return 0;
+}
+static int lz4_uncompress(const char *pIn, size_t nIn,
+                          char *pOut, size_t *pnOut){
+  LZ4F_dctx *pCtx;
+  size_t nOut = 0;
+  size_t rc = 1;
+  if( LZ4F_isError(LZ4F_createDecompressionContext(&pCtx, LZ4F_VERSION)) ){
+    return 1;
+  }
+  while( nIn>0 ){
+    size_t nDst = *pnOut - nOut;
+    size_t nSrc = nIn;
+    rc = LZ4F_decompress(pCtx, pOut+nOut, &nDst, pIn, &nSrc, 0);
+    if( LZ4F_isError(rc) ) break;
+    nOut += nDst;
+    pIn += nSrc;
+    nIn -= nSrc;
+    if( rc==0 || (nDst==0 && nSrc==0) ) break;
+  }
+  LZ4F_freeDecompressionContext(pCtx);
+  if( rc!=0 ) return 1;
+  *pnOut = nOut;
+  return 0;
+}
+#else
+# define lz4_compress 0
+# define lz4_uncompress 0
+#endif
+
+/*
+** All known codecs.  The first entry is the default.
+*/
+static const Codec aCodec[] = {
+  { "zlib", "deflate", 0,  9, Z_DEFAULT_COMPRESSION,
+    zlib_is_mine, zlib_compress, zlib_uncompress },
+  { "zstd", "zstd",    1, 22, 3,
+    zstd_is_mine, zstd_compress, zstd_uncompress },
+  { "lz4",  "lz4",     0, 12, 0,
+    lz4_is_mine,  lz4_compress,  lz4_uncompress },
+};
+
+/* Number of entries in aCodec[] */
+#define N_CODEC ((int)(sizeof(aCodec)/sizeof(aCodec[0])))
+
+/*
+** Return the codec that compressed the nIn bytes of content in pIn[],
+** or NULL if the content is not recognized.
+*/
+static const Codec *codec_detect(const char *pIn, size_t nIn){
+  int i;
+  for(i=0; i<N_CODEC; i++){
+    if( aCodec[i].xIsMine((const unsigned char*)pIn, nIn) ) return &aCodec[i];
+  }
+  return 0;
+}
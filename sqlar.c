@@ -22,8 +22,22 @@
 #include <unistd.h>
 #include <dirent.h>
 #include <string.h>
+#include <strings.h>
 #include <assert.h>
 #include <ctype.h>
+#include <pthread.h>
+#include <time.h>
+#include <math.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/mman.h>
+#ifdef __linux__
+# include <sys/syscall.h>
+#endif
+#ifdef SQLAR_ENABLE_URING
+# include <linux/io_uring.h>
+#endif
+#include "compress.h"
 
 /* Maximum length of a pass-phrase */
 #define MX_PASSPHRASE  120
@@ -35,12 +49,57 @@ static void showHelp(const char *argv0){
   fprintf(stderr, "Usage: %s [options] archive [files...]\n", argv0);
   fprintf(stderr,
      "Options:\n"
+     "   -0..-9  Compression level, from fastest to smallest\n"
+     "   -c SIZE Store files larger than SIZE as separately compressed chunks\n"
      "   -d      Delete files from the archive\n"
      "   -e      Prompt for passphrase.  -ee to scramble the prompt\n"
+     "   -j N    Use N threads to read and compress files, or with -x to\n"
+     "           decompress and write them\n"
      "   -l      List files in archive\n"
      "   -n      Do not compress files\n"
+     "   -u      Only add files that are new or changed.  -uu to also\n"
+     "           remove files that no longer exist\n"
      "   -x      Extract files from archive\n"
      "   -v      Verbose output\n"
+     "   --dedup Store identical content only once\n"
+     "   --cdc   Like --dedup, but cut files into chunks where the content\n"
+     "           says, so that edited copies share most chunks.  With -c,\n"
+     "           SIZE is the average chunk size (default 64K)\n"
+     "   --dict  Compress small files with a dictionary trained on them\n"
+     "   --solid[=SIZE]\n"
+     "           Pack small files into blocks of SIZE bytes (default 1M)\n"
+     "           that are compressed as a whole\n"
+     "   --codec=[GLOB=]NAME[:LEVEL]\n"
+     "           Compress using NAME (zlib, zstd, lz4 or none), either\n"
+     "           for all files or for those that match GLOB\n"
+     "   --compress-all\n"
+     "           Try to compress files even if they look incompressible\n"
+     "   --bulk  Fast mode for large ingests: WAL, no syncs until the end,\n"
+     "           and a commit every 10000 files or 256MB\n"
+     "   --commit=N\n"
+     "           Commit after every N files\n"
+     "   --commit-size=SIZE\n"
+     "           Commit after every SIZE bytes of content\n"
+     "   --resume\n"
+     "           Continue an interrupted run that committed in batches\n"
+     "   --rate=MBPS\n"
+     "           Adjust the compression level of each kind of file to\n"
+     "           ingest about MBPS megabytes per second\n"
+     "   --without-rowid\n"
+     "           Create a new archive as a WITHOUT ROWID table\n"
+     "   --io-depth=N\n"
+     "           Keep up to N reads in flight, if built with io_uring\n"
+     "           (default 32).  0 to read with pread() instead\n"
+     "   --stats[=FILE]\n"
+     "           Show the time spent in each stage, and also write it to\n"
+     "           FILE as JSON\n"
+     "   --progress\n"
+     "           Show files and bytes done, MB/s and time left on stderr\n"
+     "   --mmap[=SIZE]\n"
+     "           Read the archive through a memory map of up to SIZE bytes\n"
+     "           (default 1G)\n"
+     "   --pwrite\n"
+     "           Never write extracted files through a memory map\n"
   );
   exit(1);
 }
@@ -58,16 +117,363 @@ static const char zSchema[] =
   ");"
 ;
 
+/*
+** The same schema as a WITHOUT ROWID table, for --without-rowid.  Name
+** lookups then search one b-tree rather than the index on sqlar.name and
+** then the table.  Such a table cannot be read or written incrementally
+** with sqlite3_blob_open(), so files larger than STREAM_SIZE are always
+** stored in chunks and BLOBs are always read whole.  Older versions of
+** sqlar can list such an archive but might not be able to extract it.
+*/
+static const char zSchemaWithoutRowid[] =
+  "CREATE TABLE IF NOT EXISTS sqlar(\n"
+  "  name TEXT PRIMARY KEY,\n"
+  "  mode INT,\n"
+  "  mtime INT,\n"
+  "  sz INT,\n"
+  "  data BLOB\n"
+  ") WITHOUT ROWID;"
+;
+
+/*
+** Files that are larger than the chunk size are stored in a companion
+** table as a sequence of separately compressed chunks.  The sqlar row
+** for such a file has sqlar.data IS NULL and sqlar.sz>0.  Each chunk is
+** compressed if length(sqlar_chunk.data)<sqlar_chunk.sz, exactly like
+** ordinary sqlar content.
+**
+** With --dedup, chunk content is stored once in the sqlar_content table,
+** keyed by its SHA3-256 hash.  Such chunks have sqlar_chunk.data IS NULL
+** and sqlar_chunk.hash set.  The hash column comes before data so that
+** it can be read without walking the overflow pages of a large BLOB.
+*/
+static const char zChunkSchema[] =
+  "CREATE TABLE IF NOT EXISTS sqlar_chunk(\n"
+  "  name TEXT,\n"
+  "  off INT,\n"
+  "  sz INT,\n"
+  "  hash BLOB,\n"
+  "  data BLOB,\n"
+  "  PRIMARY KEY(name,off)\n"
+  ");\n"
+  "CREATE TABLE IF NOT EXISTS sqlar_content(\n"
+  "  hash BLOB PRIMARY KEY,\n"
+  "  sz INT,\n"
+  "  data BLOB\n"
+  ");"
+;
+
+/*
+** With --solid, small files are packed together into blocks and each
+** block is compressed as a whole, which works much better than
+** compressing each small file by itself.  The sqlar row for a member of
+** a block has sqlar.data IS NULL and sqlar.sz>0, like a file stored in
+** chunks, and its sqlar_solid row says where in which block its content
+** is.  A block is compressed if length(data)<sz, exactly like ordinary
+** sqlar content.  sqlar_solid is WITHOUT ROWID so that each name is
+** stored once more rather than twice.
+*/
+static const char zSolidSchema[] =
+  "CREATE TABLE IF NOT EXISTS sqlar_block(\n"
+  "  id INTEGER PRIMARY KEY,\n"
+  "  sz INT,\n"
+  "  data BLOB\n"
+  ");\n"
+  "CREATE TABLE IF NOT EXISTS sqlar_solid(\n"
+  "  name TEXT PRIMARY KEY,\n"
+  "  block INT,\n"
+  "  off INT\n"
+  ") WITHOUT ROWID;"
+;
+
+/* Default block size for --solid */
+#define SOLID_BLOCK   (1024*1024)
+
+/* Most entries in one block, counting directories and empty files */
+#define SOLID_MEMBERS 16384
+
+/*
+** The zlib dictionary for --dict.  The id is the Adler-32 checksum of the
+** dictionary, which zlib stores in the header of content compressed
+** with it.
+*/
+static const char zDictSchema[] =
+  "CREATE TABLE IF NOT EXISTS sqlar_dict(\n"
+  "  id INTEGER PRIMARY KEY,\n"
+  "  data BLOB\n"
+  ");"
+;
+
+/* Size of a content hash in bytes */
+#define HASH_SIZE     32
+
+/*
+** Files larger than this are always stored in chunks since they would
+** exceed the maximum size of a BLOB.
+*/
+#define MX_INLINE     1000000000
+
+/* Default chunk size */
+#define CHUNK_SIZE    (1024*1024)
+
+/* Default average chunk size for --cdc */
+#define CDC_SIZE      (64*1024)
+
+/*
+** Files and BLOBs larger than STREAM_SIZE are compressed and decompressed
+** incrementally, STREAM_WINDOW bytes at a time, rather than being held
+** in memory all at once.
+*/
+#define STREAM_SIZE   (1024*1024)
+#define STREAM_WINDOW (256*1024)
+
+/*
+** Stored (uncompressed) BLOBs larger than STREAM_SIZE are extracted by
+** copying them from sqlite3_blob_read() to pwrite() in slices of this
+** many bytes, without going through stdio.
+*/
+#define STORED_WINDOW (4*1024*1024)
+
+/*
+** Size of the memory map of the archive, for --mmap.  0 for none.
+*/
+static sqlite3_int64 mmapSize = 0;
+
+/* Default for --mmap */
+#define MMAP_SIZE     ((sqlite3_int64)1024*1024*1024)
+
+/*
+** True for --pwrite.  Extracted files are then never written through a
+** memory map.  See map_output().
+*/
+static int pwriteFlag = 0;
+
 /*
 ** Prepared statement that needs finalizing before sqlite3_close().
 */
 static sqlite3_stmt *pStmt = 0;
 
+/*
+** Prepared statements for the sqlar_chunk table.  These are prepared on
+** first use by db_stmt() and also need finalizing before sqlite3_close().
+*/
+static sqlite3_stmt *pChunkIns = 0;   /* Insert a chunk */
+static sqlite3_stmt *pChunkDel = 0;   /* Delete all chunks of a file */
+static sqlite3_stmt *pChunkRead = 0;  /* Read all chunks of a file */
+static sqlite3_stmt *pContentIns = 0; /* Insert into sqlar_content */
+static sqlite3_stmt *pProgress = 0;   /* Insert into sqlar_progress */
+static sqlite3_stmt *pBlockIns = 0;   /* Insert into sqlar_block */
+static sqlite3_stmt *pBlockRead = 0;  /* Read a block */
+static sqlite3_stmt *pSolidIns = 0;   /* Insert into sqlar_solid */
+static sqlite3_stmt *pSolidDel = 0;   /* Delete from sqlar_solid */
+static sqlite3_stmt *pSolidRead = 0;  /* Find the block of a file */
+static sqlite3_stmt *pDirUpd = 0;     /* Change a directory in place */
+
 /*
 ** Open database connection
 */
 static sqlite3 *db = 0;
 
+/*
+** True if the archive contains the sqlar_chunk and sqlar_content tables
+*/
+static int hasChunks = 0;
+
+/*
+** True if the archive contains the sqlar_block and sqlar_solid tables
+*/
+static int hasSolid = 0;
+
+/*
+** Number of rows removed from sqlar_chunk or sqlar_solid.  If non-zero,
+** some content in sqlar_content or sqlar_block might no longer be used.
+*/
+static int nChunkDeleted = 0;
+
+/*
+** True if the sqlar table is a WITHOUT ROWID table.  Set by the
+** --without-rowid option for a new archive, and by db_open() for an
+** existing one.
+*/
+static int withoutRowid = 0;
+
+/*
+** True for --bulk.  The archive is then written in WAL mode with
+** synchronous=OFF, and only the final commit is synced to disk.
+*/
+static int bulkFlag = 0;
+
+/* Default commit interval for --bulk */
+#define BATCH_FILES   10000
+#define BATCH_BYTES   (256*1024*1024)
+
+/*
+** Return the CPU time used by the calling thread, in nanoseconds.
+*/
+static sqlite3_int64 thread_ns(void){
+  struct timespec t;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t);
+  return t.tv_sec*(sqlite3_int64)1000000000 + t.tv_nsec;
+}
+
+/*
+** Return the time elapsed since some fixed point, in nanoseconds.
+*/
+static sqlite3_int64 wall_ns(void){
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec*(sqlite3_int64)1000000000 + t.tv_nsec;
+}
+
+/*
+** Instrumentation for --stats and --progress.
+**
+** With --stats, the elapsed time and the CPU time of each stage of an
+** ingest or an extraction are measured, and a summary is printed at the
+** end.  --stats=FILE also writes the numbers to FILE as JSON.  Stages
+** that run on the main thread are timed by stats_begin() and
+** stats_end().  Other threads record their times in the IngestJob or
+** WalkDir that they work on, and the main thread adds them up when it
+** gets to that job or directory, so only the main thread touches
+** stats.*.  Stages that run on several threads at once show the sum of
+** their times on all threads, which can be more than the elapsed time.
+**
+** --progress shows the files and bytes done so far, the rate and the
+** time left on stderr, twice a second.  The time left needs the total
+** amount of work.  That is known at the start of an extraction, but for
+** an ingest only once the scan threads of -j have found every file.
+*/
+#define STAGE_STAT      0   /* Listing directories and stat()ing entries */
+#define STAGE_READ      1   /* Reading files, and hashing for --dedup */
+#define STAGE_COMPRESS  2   /* Compressing content */
+#define STAGE_INSERT    3   /* Binding and stepping INSERT statements */
+#define STAGE_COMMIT    4   /* Committing transactions */
+#define STAGE_QUERY     5   /* Reading rows and BLOBs from the archive */
+#define STAGE_INFLATE   6   /* Decompressing content */
+#define STAGE_MKDIR     7   /* Creating directories */
+#define STAGE_WRITE     8   /* Creating and writing files */
+#define N_STAGE         9
+
+static const char *const azStage[N_STAGE] = {
+  "stat", "read", "compress", "insert", "commit",
+  "query", "inflate", "mkdir", "write"
+};
+
+static struct Stats {
+  int statsFlag;            /* True for --stats */
+  int progressFlag;         /* True for --progress */
+  const char *zJson;        /* Write JSON here, for --stats=FILE */
+  int isExtract;            /* True if extracting rather than adding */
+  sqlite3_int64 aWall[N_STAGE];  /* Elapsed time in each stage, ns */
+  sqlite3_int64 aCpu[N_STAGE];   /* CPU time in each stage, ns */
+  sqlite3_int64 nFile;      /* Files and directories done */
+  sqlite3_int64 nIn;        /* Bytes read from files or from the archive */
+  sqlite3_int64 nOut;       /* Bytes written to the archive or to files */
+  sqlite3_int64 nSkip;      /* Bytes of files skipped as unchanged by -u */
+  sqlite3_int64 nTotal;     /* Bytes of work in all, or -1 if unknown */
+  sqlite3_int64 tStart;     /* wall_ns() at the start */
+  sqlite3_int64 tShown;     /* wall_ns() when progress was last shown */
+} stats;
+
+typedef struct StageTimer StageTimer;
+struct StageTimer {
+  sqlite3_int64 tWall;      /* wall_ns() at the start */
+  sqlite3_int64 tCpu;       /* thread_ns() at the start */
+};
+
+/*
+** Start and stop timing a stage on the main thread
+*/
+static void stats_begin(StageTimer *p){
+  if( !stats.statsFlag ) return;
+  p->tWall = wall_ns();
+  p->tCpu = thread_ns();
+}
+static void stats_end(StageTimer *p, int eStage){
+  if( !stats.statsFlag ) return;
+  stats.aWall[eStage] += wall_ns() - p->tWall;
+  stats.aCpu[eStage] += thread_ns() - p->tCpu;
+}
+
+/*
+** Start the clock for --stats and --progress
+*/
+static void stats_start(int isExtract){
+  stats.isExtract = isExtract;
+  stats.nTotal = -1;
+  stats.tStart = stats.tShown = wall_ns();
+}
+
+/*
+** Show progress for --progress, if it has not been shown for a while
+** or if isFinal is true.  The amount of work done is measured in bytes
+** of original content: read from files by an ingest, or written to files
+** by an extraction.
+*/
+static void stats_progress(int isFinal){
+  sqlite3_int64 t;
+  sqlite3_int64 nDone;
+  double sec, mbps;
+  if( !stats.progressFlag ) return;
+  t = wall_ns();
+  if( !isFinal && t<stats.tShown+500000000 ) return;
+  stats.tShown = t;
+  nDone = (stats.isExtract ? stats.nOut : stats.nIn) + stats.nSkip;
+  sec = (t - stats.tStart)/1.0e9;
+  mbps = sec>0.0 ? nDone/1048576.0/sec : 0.0;
+  fprintf(stderr, "\r%lld files  %.1f MB  %.1f MB/s",
+          stats.nFile, nDone/1048576.0, mbps);
+  if( isFinal ){
+    fprintf(stderr, "  %.1f s         \n", sec);
+  }else if( stats.nTotal>=0 && nDone>0 && nDone<=stats.nTotal ){
+    int eta = (int)(sec*(stats.nTotal - nDone)/nDone + 0.5);
+    fprintf(stderr, "  ETA %d:%02d:%02d ", eta/3600, eta/60%60, eta%60);
+  }else{
+    fprintf(stderr, "  ETA ?       ");
+  }
+  fflush(stderr);
+}
+
+/*
+** Print the summary for --stats, and write the JSON file for --stats=FILE
+*/
+static void stats_report(void){
+  int i, iFirst, iLast;
+  double sec;
+  FILE *out;
+  stats_progress(1);
+  if( !stats.statsFlag ) return;
+  sec = (wall_ns() - stats.tStart)/1.0e9;
+  iFirst = stats.isExtract ? STAGE_QUERY : STAGE_STAT;
+  iLast = stats.isExtract ? STAGE_WRITE : STAGE_COMMIT;
+  printf("%-10s %10s %10s\n", "stage", "elapsed", "cpu");
+  for(i=iFirst; i<=iLast; i++){
+    printf("%-10s %10.3f %10.3f\n", azStage[i],
+           stats.aWall[i]/1.0e9, stats.aCpu[i]/1.0e9);
+  }
+  printf("%lld files, %lld bytes in, %lld bytes out, %.3f seconds,"
+         " %.1f MB/s\n", stats.nFile, stats.nIn, stats.nOut, sec,
+         sec>0.0 ? (stats.isExtract ? stats.nOut : stats.nIn)/1048576.0/sec
+                 : 0.0);
+  if( stats.zJson==0 ) return;
+  out = fopen(stats.zJson, "wb");
+  if( out==0 ){
+    fprintf(stderr, "cannot open for writing: %s\n", stats.zJson);
+    return;
+  }
+  fprintf(out, "{\"mode\":\"%s\",\"elapsed\":%.6f,\"files\":%lld,"
+               "\"bytes_in\":%lld,\"bytes_out\":%lld,\"stages\":{",
+          stats.isExtract ? "extract" : "ingest", sec,
+          stats.nFile, stats.nIn, stats.nOut);
+  for(i=iFirst; i<=iLast; i++){
+    fprintf(out, "%s\"%s\":{\"elapsed\":%.6f,\"cpu\":%.6f}",
+            i>iFirst ? "," : "", azStage[i],
+            stats.aWall[i]/1.0e9, stats.aCpu[i]/1.0e9);
+  }
+  fprintf(out, "}}\n");
+  fclose(out);
+}
+
 /*
 ** Close the database
 */
@@ -76,12 +482,31 @@ static void db_close(int commitFlag){
     sqlite3_finalize(pStmt);
     pStmt = 0;
   }
+  sqlite3_finalize(pChunkIns);   pChunkIns = 0;
+  sqlite3_finalize(pChunkDel);   pChunkDel = 0;
+  sqlite3_finalize(pChunkRead);  pChunkRead = 0;
+  sqlite3_finalize(pContentIns); pContentIns = 0;
+  sqlite3_finalize(pProgress);   pProgress = 0;
+  sqlite3_finalize(pBlockIns);   pBlockIns = 0;
+  sqlite3_finalize(pBlockRead);  pBlockRead = 0;
+  sqlite3_finalize(pSolidIns);   pSolidIns = 0;
+  sqlite3_finalize(pSolidDel);   pSolidDel = 0;
+  sqlite3_finalize(pSolidRead);  pSolidRead = 0;
+  sqlite3_finalize(pDirUpd);     pDirUpd = 0;
   if( db ){
     if( commitFlag ){
+      StageTimer t;
+      stats_begin(&t);
+      if( bulkFlag ) sqlite3_exec(db, "PRAGMA synchronous=FULL", 0, 0, 0);
       sqlite3_exec(db, "COMMIT", 0, 0, 0);
+      stats_end(&t, STAGE_COMMIT);
     }else{
       sqlite3_exec(db, "ROLLBACK", 0, 0, 0);
     }
+    if( bulkFlag ){
+      /* Checkpoint and go back to a single-file archive */
+      sqlite3_exec(db, "PRAGMA journal_mode=DELETE", 0, 0, 0);
+    }
     sqlite3_close(db);
     db = 0;
   }
@@ -93,6 +518,7 @@ static void db_close(int commitFlag){
 */
 static void errorMsg(const char *zFormat, ...){
   va_list ap;
+  if( stats.tShown>stats.tStart ) fprintf(stderr, "\n");  /* --progress */
   va_start(ap, zFormat);
   vfprintf(stderr, zFormat, ap);
   va_end(ap);
@@ -199,318 +625,5356 @@ static void prompt_for_passphrase(
 }
 
 /*
-** List of command-line arguments
+** Hash a filename
+*/
+static unsigned name_hash(const char *z){
+  unsigned h = 0;
+  while( z[0] ){ h = (h<<3) ^ h ^ (unsigned char)z[0]; z++; }
+  return h;
+}
+
+/*
+** The list of GLOB patterns given on the command line, compiled by
+** name_list_compile() so that the work name_on_list() does for each row
+** does not grow with the number of patterns.  There are four kinds of
+** pattern:
+**
+**    *  Names with no wildcards go into a hash table.
+**
+**    *  Patterns of the form "PREFIX*", where PREFIX has no wildcards,
+**       go into a trie of their prefixes.
+**
+**       Both compare bytes, so they only take patterns that are ASCII
+**       apart from the final "*".  See name_literal().
+**
+**    *  All other patterns are combined into one automaton.  Each is
+**       compiled into a list of GlobElem, and the position in each list
+**       is a state of an NFA that runs all of them at once.  That NFA is
+**       run as a DFA, each state of which is a set of NFA states and is
+**       built the first time it is needed.
+**
+**    *  Patterns with a "[" that is not closed, which sqlite3_strglob()
+**       is left to handle.
 */
+typedef struct NameLit NameLit;
+struct NameLit {
+  NameLit *pNext;        /* Next entry in the same hash bucket */
+  const char *zName;     /* The name */
+};
+
+typedef struct NameTrie NameTrie;
+struct NameTrie {
+  NameTrie *pChild;      /* First child of this node */
+  NameTrie *pSibling;    /* Next child of the same parent */
+  unsigned char c;       /* Byte that leads from the parent to this node */
+  unsigned char isEnd;   /* Some prefix ends here */
+};
+
+/* Values for GlobElem.eType */
+#define GLOB_CHAR   0    /* One particular character */
+#define GLOB_ANY    1    /* "?" */
+#define GLOB_STAR   2    /* "*" */
+#define GLOB_CLASS  3    /* "[...]" */
+#define GLOB_END    4    /* End of the pattern.  A match */
+
+typedef struct GlobElem GlobElem;
+struct GlobElem {
+  int eType;             /* One of the GLOB_* values */
+  unsigned c;            /* The character, for GLOB_CHAR */
+  int isNot;             /* For GLOB_CLASS, the class starts with "^" */
+  int nRange;            /* For GLOB_CLASS, pairs in aRange[] */
+  unsigned *aRange;      /* First and last character of each range */
+};
+
+typedef struct GlobState GlobState;
+struct GlobState {
+  GlobState *pNext;      /* Next state in the same hash bucket */
+  unsigned h;            /* Hash of aSet[] */
+  int isMatch;           /* Some pattern ends in this state */
+  int nSet;              /* Number of NFA states in aSet[] */
+  int *aSet;             /* NFA states, as indexes into NameList.aElem[] */
+  GlobState *aNext[128]; /* Next state for each ASCII character, if known */
+};
+
+/* Most DFA states kept at once.  All are dropped when there are more. */
+#define GLOB_MX_STATE 4096
+
 typedef struct NameList NameList;
 struct NameList {
   const char **azName;   /* List of names */
   int nName;             /* Number of names on the list */
+  NameLit **aLit;        /* Hash table of names with no wildcards */
+  unsigned nLit;         /* Number of buckets in aLit[] */
+  NameTrie *pTrie;       /* Root of the trie of prefixes, or NULL */
+  GlobElem *aElem;       /* Elements of all wildcard patterns */
+  int nElem;             /* Number of entries in aElem[] */
+  int *aStart;           /* NFA states at the start of a name */
+  int nStart;            /* Number of entries in aStart[] */
+  int *aMark;            /* Scratch space: one entry for each aElem[] */
+  int iMark;             /* Value of aMark[] for states already seen */
+  GlobState **aState;    /* Hash table of DFA states */
+  int nState;            /* Number of DFA states */
+  GlobState *pStart;     /* The DFA state at the start of a name */
+  const char **azSlow;   /* Patterns left to sqlite3_strglob() */
+  int nSlow;             /* Number of entries in azSlow[] */
 };
 
 /*
-** Inplementation of SQL function "name_on_list(X)".  Return
-** true if X is on the list of GLOB patterns given on the command-line.
+** Read one UTF-8 character from *pz and advance *pz past it, the same
+** way that sqlite3Utf8Read() does.
 */
-static void name_on_list(
-  sqlite3_context *context,
-  int argc,
-  sqlite3_value **argv
-){
-  NameList *pList = (NameList*)sqlite3_user_data(context);
-  int i;
-  int rc = 0;
-  const char *z = (const char*)sqlite3_value_text(argv[0]);
-  if( z!=0 ){
-    for(i=0; i<pList->nName; i++){
-      if( sqlite3_strglob(pList->azName[i], z)==0 ){
-        rc = 1;
-        break;
+static unsigned glob_utf8(const char **pz){
+  const unsigned char *z = (const unsigned char*)*pz;
+  unsigned c = *(z++);
+  if( c>=0xc0 ){
+    c = c>=0xfe ? 0 : c>=0xfc ? c&0x01 : c>=0xf8 ? c&0x03
+      : c>=0xf0 ? c&0x07 : c>=0xe0 ? c&0x0f : c&0x1f;
+    while( (*z & 0xc0)==0x80 ) c = (c<<6) + (*(z++) & 0x3f);
+    if( c<0x80 || (c&0xfffff800)==0xd800 || (c&0xfffffffe)==0xfffe ){
+      c = 0xfffd;
+    }
+  }
+  *pz = (const char*)z;
+  return c;
+}
+
+/*
+** Compile GLOB pattern z, with the same meaning as sqlite3_strglob(),
+** onto the end of p->aElem[].  Return non-zero if the pattern has a
+** "[" with no matching "]".
+*/
+static int glob_compile(NameList *p, const char *z){
+  int iFirst = p->nElem;
+  while( 1 ){
+    GlobElem *pE;
+    unsigned c;
+    p->aElem = sqlite3_realloc64(p->aElem, (p->nElem+1)*sizeof(GlobElem));
+    if( p->aElem==0 ) errorMsg("Out of memory\n");
+    pE = &p->aElem[p->nElem++];
+    memset(pE, 0, sizeof(*pE));
+    if( z[0]==0 ){
+      pE->eType = GLOB_END;
+      return 0;
+    }
+    c = glob_utf8(&z);
+    if( c=='*' ){
+      pE->eType = GLOB_STAR;
+    }else if( c=='?' ){
+      pE->eType = GLOB_ANY;
+    }else if( c=='[' ){
+      /* Parsed the way patternCompare() in SQLite does it */
+      unsigned cPrior = 0;
+      pE->eType = GLOB_CLASS;
+      c = glob_utf8(&z);
+      if( c=='^' ){
+        pE->isNot = 1;
+        c = glob_utf8(&z);
+      }
+      if( c==']' ){
+        cPrior = c;
+        c = glob_utf8(&z);
+      }
+      if( cPrior ){
+        pE->aRange = sqlite3_malloc( 2*sizeof(unsigned) );
+        if( pE->aRange==0 ) errorMsg("Out of memory\n");
+        pE->aRange[0] = pE->aRange[1] = ']';
+        pE->nRange = 1;
+        cPrior = 0;
+      }
+      while( c && c!=']' ){
+        unsigned cFirst = c, cLast = c;
+        if( c=='-' && z[0]!=']' && z[0]!=0 && cPrior>0 ){
+          cFirst = cPrior;
+          cLast = glob_utf8(&z);
+          cPrior = 0;
+        }else{
+          cPrior = c;
+        }
+        pE->aRange = sqlite3_realloc64(pE->aRange,
+                                       (pE->nRange+1)*2*sizeof(unsigned));
+        if( pE->aRange==0 ) errorMsg("Out of memory\n");
+        pE->aRange[pE->nRange*2] = cFirst;
+        pE->aRange[pE->nRange*2+1] = cLast;
+        pE->nRange++;
+        c = glob_utf8(&z);
+      }
+      if( c==0 ){
+        /* Not closed.  Take the pattern back out of aElem[] */
+        while( p->nElem>iFirst ) sqlite3_free(p->aElem[--p->nElem].aRange);
+        return 1;
       }
+    }else{
+      pE->eType = GLOB_CHAR;
+      pE->c = c;
     }
   }
-  sqlite3_result_int(context, rc);
 }
 
 /*
-** SQL functions that always true.  This is used in place of
-** name_on_list() when no command-line arguments are given.
+** Add NFA state i to the set aSet[] of *pnSet states, along with the
+** states that follow it without reading a character.
 */
-static void alwaysTrue(sqlite3_context *ctx, int n, sqlite3_value **v){
-  sqlite3_result_int(ctx, 1);
+static void glob_add_state(NameList *p, int *aSet, int *pnSet, int i){
+  while( p->aMark[i]!=p->iMark ){
+    p->aMark[i] = p->iMark;
+    aSet[(*pnSet)++] = i;
+    if( p->aElem[i].eType!=GLOB_STAR ) break;
+    i++;
+  }
 }
 
+/*
+** Comparison function for sorting sets of NFA states
+*/
+static int glob_state_cmp(const void *a, const void *b){
+  return *(const int*)a - *(const int*)b;
+}
 
 /*
-** Open the database.
+** Return the DFA state for the set aSet[] of nSet NFA states, building
+** it if it does not already exist.  If the cache of DFA states is full,
+** every state is freed first and *pbReset is set.
 */
-static void db_open(
-  const char *zArchive,
-  int writeFlag,
-  int seeFlag,
-  const char **azFiles,
-  int nFiles
+static GlobState *glob_state(
+  NameList *p,
+  int *aSet,
+  int nSet,
+  int *pbReset
 ){
-  int rc;
-  int fg;
-  NameList *x = 0;
-  if( writeFlag ){
-    fg = SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE;
-  }else{
-    fg = SQLITE_OPEN_READONLY;
-  }
-  rc = sqlite3_open_v2(zArchive, &db, fg, 0);
-  if( rc ) errorMsg("Cannot open archive [%s]: %s\n", zArchive,
-                    sqlite3_errmsg(db));
-  if( azFiles!=0 && nFiles>0 ){
-    x = sqlite3_malloc( sizeof(NameList) );
-    if( x==0 ) errorMsg("Out of memory");
-    x->azName = azFiles;
-    x->nName = nFiles;
-    sqlite3_create_function(db, "name_on_list", 1, SQLITE_UTF8,
-                           (char*)x, name_on_list, 0, 0);
-  }else{
-    sqlite3_create_function(db, "name_on_list", 1, SQLITE_UTF8,
-                            0, alwaysTrue, 0, 0);
+  GlobState *pS;
+  unsigned h = 0;
+  int i;
+  qsort(aSet, nSet, sizeof(int), glob_state_cmp);
+  for(i=0; i<nSet; i++) h = (h<<3) ^ h ^ (unsigned)aSet[i];
+  for(pS=p->aState[h % GLOB_MX_STATE]; pS; pS=pS->pNext){
+    if( pS->h==h && pS->nSet==nSet
+     && memcmp(pS->aSet, aSet, nSet*sizeof(int))==0
+    ){
+      return pS;
+    }
   }
-  if( seeFlag ){
-    char zPassPhrase[MX_PASSPHRASE+1];
-#ifndef SQLITE_HAS_CODEC
-    printf("WARNING:  The passphrase is a no-op because this build of\n"
-           "sqlar is compiled without encryption capabilities.\n");
-#endif
-    memset(zPassPhrase, 0, sizeof(zPassPhrase));
-    prompt_for_passphrase("passphrase: ", seeFlag>1, zPassPhrase);
-#ifdef SQLITE_HAS_CODEC
-    sqlite3_key_v2(db, "main", zPassPhrase, -1);
-#endif
+  if( p->nState>=GLOB_MX_STATE ){
+    for(i=0; i<GLOB_MX_STATE; i++){
+      while( (pS = p->aState[i])!=0 ){
+        p->aState[i] = pS->pNext;
+        sqlite3_free(pS);
+      }
+    }
+    p->nState = 0;
+    p->pStart = 0;
+    *pbReset = 1;
   }
-  sqlite3_exec(db, "BEGIN", 0, 0, 0);
-  sqlite3_exec(db, zSchema, 0, 0, 0);
-  rc = sqlite3_exec(db, "SELECT 1 FROM sqlar LIMIT 1", 0, 0, 0);
-  if( rc!=SQLITE_OK ){
-    fprintf(stderr, "File [%s] is not an SQLite archive\n", zArchive);
-    exit(1);
+  pS = sqlite3_malloc64( sizeof(*pS) + nSet*sizeof(int) );
+  if( pS==0 ) errorMsg("Out of memory\n");
+  memset(pS, 0, sizeof(*pS));
+  pS->h = h;
+  pS->nSet = nSet;
+  pS->aSet = (int*)&pS[1];
+  memcpy(pS->aSet, aSet, nSet*sizeof(int));
+  for(i=0; i<nSet; i++){
+    if( p->aElem[aSet[i]].eType==GLOB_END ) pS->isMatch = 1;
   }
+  pS->pNext = p->aState[h % GLOB_MX_STATE];
+  p->aState[h % GLOB_MX_STATE] = pS;
+  p->nState++;
+  return pS;
 }
 
 /*
-** Prepare the pStmt statement.
+** Return the DFA state that follows pS on character c
 */
-static void db_prepare(const char *zSql){
-  int rc;
-  sqlite3_finalize(pStmt);
-  rc = sqlite3_prepare_v2(db, zSql, -1, &pStmt, 0);
-  if( rc ){
-    errorMsg("Error: %s\nwhile preparing: %s\n",
-             sqlite3_errmsg(db), zSql);
+static GlobState *glob_step(NameList *p, GlobState *pS, unsigned c){
+  GlobState *pNext;
+  int *aSet;
+  int nSet = 0;
+  int bReset = 0;
+  int i, j;
+  if( c<128 && pS->aNext[c] ) return pS->aNext[c];
+  aSet = sqlite3_malloc64( p->nElem*sizeof(int) );
+  if( aSet==0 ) errorMsg("Out of memory\n");
+  p->iMark++;
+  for(i=0; i<pS->nSet; i++){
+    int iState = pS->aSet[i];
+    GlobElem *pE = &p->aElem[iState];
+    int isMatch = 0;
+    switch( pE->eType ){
+      case GLOB_STAR:
+        glob_add_state(p, aSet, &nSet, iState);
+        break;
+      case GLOB_ANY:
+        isMatch = 1;
+        break;
+      case GLOB_CHAR:
+        isMatch = pE->c==c;
+        break;
+      case GLOB_CLASS:
+        for(j=0; j<pE->nRange; j++){
+          if( c>=pE->aRange[j*2] && c<=pE->aRange[j*2+1] ) break;
+        }
+        isMatch = (j<pE->nRange) ^ pE->isNot;
+        break;
+    }
+    if( isMatch ) glob_add_state(p, aSet, &nSet, iState+1);
   }
+  pNext = glob_state(p, aSet, nSet, &bReset);
+  sqlite3_free(aSet);
+  if( c<128 && !bReset ) pS->aNext[c] = pNext;
+  return pNext;
 }
 
 /*
-** Read a file from disk into memory obtained from sqlite3_malloc().
-** Compress the file as it is read in if doing so reduces the file
-** size and if the noCompress flag is false.
-**
-** Return the original size and the compressed size of the file in
-** *pSizeOrig and *pSizeCompr, respectively.  If these two values are
-** equal, that means the file was not compressed.
+** Return true if z matches one of the patterns in the automaton
 */
-static char *read_file(
-  const char *zFilename,    /* Name of file to read */
-  int *pSizeOrig,           /* Write original file size here */
-  int *pSizeCompr,          /* Write compressed file size here */
-  int noCompress            /* Do not compress if true */
-){
-  FILE *in;
-  char *zIn;
-  long int nIn;
-  char *zCompr;
-  unsigned long int nCompr;
-  int rc;
-
-  in = fopen(zFilename, "rb");
-  if( in==0 ) errorMsg("cannot open \"%s\" for reading\n", zFilename);
-  fseek(in, 0, SEEK_END);
-  nIn = ftell(in);
-  rewind(in);
-  zIn = sqlite3_malloc( nIn+1 );
-  if( zIn==0 ) errorMsg("cannot malloc for %d bytes\n", nIn+1);
-  if( nIn>0 && fread(zIn, nIn, 1, in)!=1 ){
-    errorMsg("unable to read %d bytes of file %s\n", nIn, zFilename);
+static int glob_match(NameList *p, const char *z){
+  GlobState *pS;
+  if( p->nElem==0 ) return 0;
+  if( p->pStart==0 ){
+    int bReset = 0;
+    p->pStart = glob_state(p, p->aStart, p->nStart, &bReset);
   }
-  fclose(in);
-  if( noCompress ){
-    *pSizeOrig = *pSizeCompr = nIn;
-    return zIn;
-  }
-  nCompr = 13 + nIn + (nIn+999)/1000;
-  zCompr = sqlite3_malloc( nCompr+1 );
-  if( zCompr==0 ) errorMsg("cannot malloc for %d bytes\n", nCompr+1);
-  rc = compress((Bytef*)zCompr, &nCompr, (const Bytef*)zIn, nIn);
-  if( rc!=Z_OK ) errorMsg("Cannot compress %s\n", zFilename);
-  if( nIn>nCompr ){
-    sqlite3_free(zIn);
-    *pSizeOrig = nIn;
-    *pSizeCompr = (int)nCompr;
-    return zCompr;
-  }else{
-    sqlite3_free(zCompr);
-    *pSizeOrig = *pSizeCompr = nIn;
-    return zIn;
+  pS = p->pStart;
+  while( z[0] ){
+    pS = glob_step(p, pS, glob_utf8(&z));
+    if( pS->nSet==0 ) return 0;
   }
+  return pS->isMatch;
 }
 
 /*
-** Make sure the parent directory for zName exists.  Create it if it does
-** not exist.
+** Return the number of bytes at the start of GLOB pattern z that can
+** only match themselves: ASCII characters other than "*", "?" and "[".
+** A byte of 0x80 or more ends it because SQLite compares the characters
+** it decodes, and different byte sequences can decode the same way.
+** All invalid UTF-8, for one, reads as U+FFFD.
 */
-static void make_parent_directory(const char *zName){
-  char *zParent;
-  int i, j, rc;
-  for(i=j=0; zName[i]; i++) if( zName[i]=='/' ) j = i;
-  if( j>0 ){
-    zParent = sqlite3_mprintf("%.*s", j, zName);
-    if( zParent==0 ) errorMsg("mprintf failed\n");
-    while( j>0 && zParent[j]=='/' ) j--;
-    zParent[j] = 0;
-    if( j>0 && access(zParent,F_OK)!=0 ){
-      make_parent_directory(zParent);
-      rc = mkdir(zParent, 0777);
-      if( rc ) errorMsg("cannot create directory: %s\n", zParent);
-    }
-    sqlite3_free(zParent);
-  }
+static int name_literal(const char *z){
+  int n = 0;
+  while( z[n]!=0 && (z[n]&0x80)==0 && z[n]!='*' && z[n]!='?' && z[n]!='[' ) n++;
+  return n;
 }
 
 /*
-** Write a file or a directory.
-**
-** Create any missing directories leading up to the given file or directory.
-** Also set the access mode and the modification time.
-**
-** If sz>nCompr that means that the content is compressed and needs to be
-** decompressed before writing.
+** Return a new trie node for byte c
 */
-static void write_file(
-  const char *zFilename,   /* Store content in this file */
-  int iMode,               /* The unix-style access mode */
-  sqlite3_int64 mtime,     /* Modification time */
-  int sz,                  /* Size of file as stored on disk */
-  const char *pCompr,      /* Content (usually compressed) */
-  int nCompr               /* Size of content (prior to decompression) */
-){
-  char *pOut;
-  unsigned long int nOut;
+static NameTrie *name_trie_new(unsigned char c){
+  NameTrie *pNode = sqlite3_malloc( sizeof(*pNode) );
+  if( pNode==0 ) errorMsg("Out of memory\n");
+  memset(pNode, 0, sizeof(*pNode));
+  pNode->c = c;
+  return pNode;
+}
+
+/*
+** Compile the nName GLOB patterns of azName[] into a new NameList
+*/
+static NameList *name_list_compile(const char **azName, int nName){
+  NameList *p;
+  int i;
+  p = sqlite3_malloc( sizeof(*p) );
+  if( p==0 ) errorMsg("Out of memory\n");
+  memset(p, 0, sizeof(*p));
+  p->azName = azName;
+  p->nName = nName;
+  p->nLit = nName*2 + 1;
+  p->aLit = sqlite3_malloc64( p->nLit*sizeof(NameLit*) );
+  p->aState = sqlite3_malloc64( GLOB_MX_STATE*sizeof(GlobState*) );
+  p->azSlow = sqlite3_malloc64( nName*sizeof(const char*) );
+  p->aStart = sqlite3_malloc64( nName*sizeof(int) );
+  if( p->aLit==0 || p->aState==0 || p->azSlow==0 || p->aStart==0 ){
+    errorMsg("Out of memory\n");
+  }
+  memset(p->aLit, 0, p->nLit*sizeof(NameLit*));
+  memset(p->aState, 0, GLOB_MX_STATE*sizeof(GlobState*));
+  for(i=0; i<nName; i++){
+    const char *z = azName[i];
+    int n = name_literal(z);
+    if( z[n]==0 ){
+      unsigned h = name_hash(z) % p->nLit;
+      NameLit *pLit = sqlite3_malloc( sizeof(*pLit) );
+      if( pLit==0 ) errorMsg("Out of memory\n");
+      pLit->zName = z;
+      pLit->pNext = p->aLit[h];
+      p->aLit[h] = pLit;
+    }else if( z[n]=='*' && z[n+1]==0 ){
+      NameTrie *pNode;
+      int j;
+      if( p->pTrie==0 ) p->pTrie = name_trie_new(0);
+      pNode = p->pTrie;
+      for(j=0; j<n; j++){
+        NameTrie *pChild = pNode->pChild;
+        while( pChild && pChild->c!=(unsigned char)z[j] ){
+          pChild = pChild->pSibling;
+        }
+        if( pChild==0 ){
+          pChild = name_trie_new((unsigned char)z[j]);
+          pChild->pSibling = pNode->pChild;
+          pNode->pChild = pChild;
+        }
+        pNode = pChild;
+      }
+      pNode->isEnd = 1;
+    }else{
+      int iFirst = p->nElem;
+      if( glob_compile(p, z) ){
+        p->azSlow[p->nSlow++] = z;
+      }else{
+        p->aStart[p->nStart++] = iFirst;
+      }
+    }
+  }
+  if( p->nElem>0 ){
+    int nStart = 0;
+    int *aSet = sqlite3_malloc64( p->nElem*sizeof(int) );
+    p->aMark = sqlite3_malloc64( p->nElem*sizeof(int) );
+    if( aSet==0 || p->aMark==0 ) errorMsg("Out of memory\n");
+    memset(p->aMark, 0, p->nElem*sizeof(int));
+    p->iMark++;
+    for(i=0; i<p->nStart; i++){
+      glob_add_state(p, aSet, &nStart, p->aStart[i]);
+    }
+    sqlite3_free(p->aStart);
+    p->aStart = aSet;
+    p->nStart = nStart;
+  }
+  return p;
+}
+
+/*
+** Return true if z is matched by a pattern in the trie of prefixes
+*/
+static int name_trie_match(NameList *p, const char *z){
+  NameTrie *pNode = p->pTrie;
+  if( pNode==0 ) return 0;
+  while( 1 ){
+    if( pNode->isEnd ) return 1;
+    if( z[0]==0 ) return 0;
+    pNode = pNode->pChild;
+    while( pNode && pNode->c!=(unsigned char)z[0] ) pNode = pNode->pSibling;
+    if( pNode==0 ) return 0;
+    z++;
+  }
+}
+
+/*
+** Inplementation of SQL function "name_on_list(X)".  Return
+** true if X is on the list of GLOB patterns given on the command-line.
+*/
+static void name_on_list(
+  sqlite3_context *context,
+  int argc,
+  sqlite3_value **argv
+){
+  NameList *pList = (NameList*)sqlite3_user_data(context);
+  int i;
+  int rc = 0;
+  const char *z = (const char*)sqlite3_value_text(argv[0]);
+  if( z!=0 ){
+    NameLit *pLit = pList->aLit[name_hash(z) % pList->nLit];
+    while( pLit && strcmp(pLit->zName, z)!=0 ) pLit = pLit->pNext;
+    rc = pLit!=0 || name_trie_match(pList, z) || glob_match(pList, z);
+    for(i=0; rc==0 && i<pList->nSlow; i++){
+      rc = sqlite3_strglob(pList->azSlow[i], z)==0;
+    }
+  }
+  sqlite3_result_int(context, rc);
+}
+
+/*
+** SQL functions that always true.  This is used in place of
+** name_on_list() when no command-line arguments are given.
+*/
+static void alwaysTrue(sqlite3_context *ctx, int n, sqlite3_value **v){
+  sqlite3_result_int(ctx, 1);
+}
+
+/*
+** SQL expression that is true for the names of files selected by the
+** command-line arguments.  Set by db_open().
+*/
+static char *zNameWhere = "1";
+
+/* Most patterns with a literal prefix that name_filter() turns into
+** separate ranges.  Each is one more term of an OR. */
+#define MX_NAME_RANGE 200
+
+/*
+** Return a copy of the first n bytes of z, with the last byte that is
+** not 0xff incremented and any 0xff bytes after it removed.  That is
+** the smallest string greater than every string that begins with those
+** n bytes.  Return NULL if there is no such string.
+*/
+static char *name_prefix_end(const char *z, int n){
+  char *zEnd;
+  while( n>0 && (unsigned char)z[n-1]==0xff ) n--;
+  if( n==0 ) return 0;
+  zEnd = sqlite3_mprintf("%.*s", n, z);
+  if( zEnd==0 ) errorMsg("Out of memory\n");
+  zEnd[n-1]++;
+  return zEnd;
+}
+
+/*
+** Return an SQL expression, from sqlite3_malloc(), that is true for the
+** names that match one of the nName GLOB patterns in azName[], so that
+** SQLite can find them through the index on sqlar.name rather than
+** calling name_on_list() for every row of the archive.  ASCII patterns
+** with no wildcards go into one IN list.  A pattern that starts with
+** literal ASCII text becomes a range of names, followed by the GLOB
+** itself.  If any pattern starts with a wildcard or other character,
+** every row has to be looked at anyway and the expression is just
+** name_on_list(name).  The GLOB is applied to "+name" so that SQLite does
+** not also turn it into a range, which it works out from the bytes of
+** the pattern and which can miss names that match once decoded.
+*/
+static char *name_filter(const char **azName, int nName){
+  char **azTerm;
+  char *zOut;
+  int nIn = 0, nRange = 0, nByte = 0;
+  int i, j;
+  for(i=0; i<nName; i++){
+    int n = name_literal(azName[i]);
+    if( azName[i][n]==0 ) continue;
+    if( n==0 || ++nRange>MX_NAME_RANGE ){
+      return sqlite3_mprintf("name_on_list(name)");
+    }
+  }
+  /* IN list entries first, then the ranges */
+  azTerm = sqlite3_malloc( nName*sizeof(char*) );
+  if( azTerm==0 ) errorMsg("Out of memory\n");
+  for(i=0; i<nName; i++){
+    if( azName[i][name_literal(azName[i])]==0 ){
+      azTerm[nIn] = sqlite3_mprintf("%s%Q", nIn ? "," : "", azName[i]);
+      nIn++;
+    }
+  }
+  for(i=0, j=nIn; i<nName; i++){
+    int n = name_literal(azName[i]);
+    char *zStart, *zEnd;
+    if( azName[i][n]==0 ) continue;
+    zStart = sqlite3_mprintf("%.*s", n, azName[i]);
+    zEnd = name_prefix_end(azName[i], n);
+    if( zEnd ){
+      azTerm[j] = sqlite3_mprintf("%s(name>=%Q AND name<%Q AND +name GLOB %Q)",
+                                  j>0 ? " OR " : "", zStart, zEnd, azName[i]);
+    }else{
+      azTerm[j] = sqlite3_mprintf("%s(name>=%Q AND +name GLOB %Q)",
+                                  j>0 ? " OR " : "", zStart, azName[i]);
+    }
+    j++;
+    sqlite3_free(zStart);
+    sqlite3_free(zEnd);
+  }
+  for(i=0; i<nName; i++){
+    if( azTerm[i]==0 ) errorMsg("Out of memory\n");
+    nByte += (int)strlen(azTerm[i]);
+  }
+  zOut = sqlite3_malloc( nByte + 20 );
+  if( zOut==0 ) errorMsg("Out of memory\n");
+  nByte = 0;
+  if( nIn>0 ){
+    memcpy(zOut, "name IN(", 8);
+    nByte = 8;
+  }
+  for(i=0; i<nName; i++){
+    int n = (int)strlen(azTerm[i]);
+    memcpy(&zOut[nByte], azTerm[i], n);
+    nByte += n;
+    if( i==nIn-1 ) zOut[nByte++] = ')';
+    sqlite3_free(azTerm[i]);
+  }
+  zOut[nByte] = 0;
+  sqlite3_free(azTerm);
+  return zOut;
+}
+
+/*
+** Return SQL text from zFormat, from sqlite3_malloc(), with %s replaced
+** by the expression that selects the names given on the command line.
+*/
+static char *name_sql(const char *zFormat){
+  char *zSql = sqlite3_mprintf(zFormat, zNameWhere);
+  if( zSql==0 ) errorMsg("Out of memory\n");
+  return zSql;
+}
+
+
+/*
+** Install the zlib dictionary of the archive, if it has one.
+*/
+static void db_load_dict(void){
+  sqlite3_stmt *p = 0;
+  if( sqlite3_prepare_v2(db, "SELECT data FROM sqlar_dict", -1, &p, 0)
+        ==SQLITE_OK
+   && sqlite3_step(p)==SQLITE_ROW
+  ){
+    int n = sqlite3_column_bytes(p, 0);
+    char *a = sqlite3_malloc( n+1 );
+    if( a==0 ) errorMsg("Out of memory\n");
+    memcpy(a, sqlite3_column_blob(p, 0), n);
+    zlib_set_dict(a, n);
+  }
+  sqlite3_finalize(p);
+}
+
+/*
+** Open the database.
+*/
+static void db_open(
+  const char *zArchive,
+  int writeFlag,
+  int seeFlag,
+  const char **azFiles,
+  int nFiles
+){
+  int rc;
+  int fg;
+  NameList *x = 0;
+  if( writeFlag ){
+    fg = SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE;
+  }else{
+    fg = SQLITE_OPEN_READONLY;
+  }
+  rc = sqlite3_open_v2(zArchive, &db, fg, 0);
+  if( rc ) errorMsg("Cannot open archive [%s]: %s\n", zArchive,
+                    sqlite3_errmsg(db));
+  if( mmapSize>0 ){
+    char *zSql = sqlite3_mprintf("PRAGMA mmap_size=%lld", mmapSize);
+    sqlite3_exec(db, zSql, 0, 0, 0);
+    sqlite3_free(zSql);
+  }
+  if( azFiles!=0 && nFiles>0 ){
+    x = name_list_compile(azFiles, nFiles);
+    sqlite3_create_function(db, "name_on_list", 1, SQLITE_UTF8,
+                           (char*)x, name_on_list, 0, 0);
+    zNameWhere = name_filter(azFiles, nFiles);
+    if( zNameWhere==0 ) errorMsg("Out of memory\n");
+  }else{
+    sqlite3_create_function(db, "name_on_list", 1, SQLITE_UTF8,
+                            0, alwaysTrue, 0, 0);
+  }
+  if( seeFlag ){
+    char zPassPhrase[MX_PASSPHRASE+1];
+#ifndef SQLITE_HAS_CODEC
+    printf("WARNING:  The passphrase is a no-op because this build of\n"
+           "sqlar is compiled without encryption capabilities.\n");
+#endif
+    memset(zPassPhrase, 0, sizeof(zPassPhrase));
+    prompt_for_passphrase("passphrase: ", seeFlag>1, zPassPhrase);
+#ifdef SQLITE_HAS_CODEC
+    sqlite3_key_v2(db, "main", zPassPhrase, -1);
+#endif
+  }
+  if( bulkFlag && writeFlag ){
+    /* The page size only matters for a new archive */
+    sqlite3_exec(db,
+        "PRAGMA page_size=65536;"
+        "PRAGMA cache_size=-262144;"
+        "PRAGMA journal_mode=WAL;"
+        "PRAGMA synchronous=OFF;",
+        0, 0, 0);
+  }
+  sqlite3_exec(db, "BEGIN", 0, 0, 0);
+  sqlite3_exec(db, withoutRowid ? zSchemaWithoutRowid : zSchema, 0, 0, 0);
+  rc = sqlite3_exec(db, "SELECT 1 FROM sqlar LIMIT 1", 0, 0, 0);
+  if( rc!=SQLITE_OK ){
+    fprintf(stderr, "File [%s] is not an SQLite archive\n", zArchive);
+    exit(1);
+  }
+  withoutRowid = sqlite3_exec(db, "SELECT rowid FROM sqlar LIMIT 0",
+                              0, 0, 0)!=SQLITE_OK;
+  hasChunks = sqlite3_exec(db, "SELECT 1 FROM sqlar_chunk LIMIT 1",
+                           0, 0, 0)==SQLITE_OK;
+  hasSolid = sqlite3_exec(db, "SELECT 1 FROM sqlar_solid LIMIT 1",
+                          0, 0, 0)==SQLITE_OK;
+  db_load_dict();
+}
+
+/*
+** Commit the current transaction and start a new one.  In --bulk mode,
+** also checkpoint the WAL so that it does not keep growing.
+*/
+static void db_commit(void){
+  StageTimer t;
+  stats_begin(&t);
+  if( sqlite3_exec(db, "COMMIT", 0, 0, 0)!=SQLITE_OK ){
+    errorMsg("COMMIT failed: %s\n", sqlite3_errmsg(db));
+  }
+  if( bulkFlag ) sqlite3_exec(db, "PRAGMA wal_checkpoint(PASSIVE)", 0, 0, 0);
+  sqlite3_exec(db, "BEGIN", 0, 0, 0);
+  stats_end(&t, STAGE_COMMIT);
+}
+
+/*
+** Prepare the pStmt statement.
+*/
+static void db_prepare(const char *zSql){
+  int rc;
+  sqlite3_finalize(pStmt);
+  rc = sqlite3_prepare_v2(db, zSql, -1, &pStmt, 0);
+  if( rc ){
+    errorMsg("Error: %s\nwhile preparing: %s\n",
+             sqlite3_errmsg(db), zSql);
+  }
+}
+
+/*
+** Return the prepared statement *ppStmt, preparing it from zSql first
+** if this is the first use.
+*/
+static sqlite3_stmt *db_stmt(sqlite3_stmt **ppStmt, const char *zSql){
+  if( *ppStmt==0 && sqlite3_prepare_v2(db, zSql, -1, ppStmt, 0) ){
+    errorMsg("Error: %s\nwhile preparing: %s\n",
+             sqlite3_errmsg(db), zSql);
+  }
+  return *ppStmt;
+}
+
+/*
+** Create the sqlar_chunk and sqlar_content tables if they do not
+** already exist.
+*/
+static void db_create_chunk_table(void){
+  if( hasChunks ) return;
+  if( sqlite3_exec(db, zChunkSchema, 0, 0, 0) ){
+    errorMsg("Cannot create sqlar_chunk: %s\n", sqlite3_errmsg(db));
+  }
+  hasChunks = 1;
+}
+
+/*
+** Create the sqlar_block and sqlar_solid tables if they do not already
+** exist.
+*/
+static void db_create_solid_tables(void){
+  if( hasSolid ) return;
+  if( sqlite3_exec(db, zSolidSchema, 0, 0, 0) ){
+    errorMsg("Cannot create sqlar_solid: %s\n", sqlite3_errmsg(db));
+  }
+  hasSolid = 1;
+}
+
+/*
+** Remove content that is no longer used by any chunk, and blocks that no
+** longer have any members.
+*/
+static void db_gc_content(void){
+  if( hasChunks ){
+    sqlite3_exec(db, "DELETE FROM sqlar_content WHERE hash NOT IN"
+                     " (SELECT hash FROM sqlar_chunk WHERE hash IS NOT NULL)",
+                 0, 0, 0);
+  }
+  if( hasSolid ){
+    sqlite3_exec(db, "DELETE FROM sqlar_block WHERE id NOT IN"
+                     " (SELECT block FROM sqlar_solid)",
+                 0, 0, 0);
+  }
+  nChunkDeleted = 0;
+}
+
+/*
+** Delete all chunks of file zName, or its place in a solid block
+*/
+static void db_delete_chunks(const char *zName){
+  sqlite3_stmt *p;
+  if( hasChunks ){
+    p = db_stmt(&pChunkDel, "DELETE FROM sqlar_chunk WHERE name=?1");
+    sqlite3_bind_text(p, 1, zName, -1, SQLITE_STATIC);
+    sqlite3_step(p);
+    sqlite3_reset(p);
+    nChunkDeleted += sqlite3_changes(db);
+  }
+  if( hasSolid ){
+    p = db_stmt(&pSolidDel, "DELETE FROM sqlar_solid WHERE name=?1");
+    sqlite3_bind_text(p, 1, zName, -1, SQLITE_STATIC);
+    sqlite3_step(p);
+    sqlite3_reset(p);
+    nChunkDeleted += sqlite3_changes(db);
+  }
+}
+
+/*
+** The SHA3 implementation below is copied from shell.c.  It is used to
+** compute content hashes for --dedup.
+*/
+typedef sqlite3_uint64 u64;
+
+/******************************************************************************
+** The Hash Engine
+*/
+/*
+** Macros to determine whether the machine is big or little endian,
+** and whether or not that determination is run-time or compile-time.
+**
+** For best performance, an attempt is made to guess at the byte-order
+** using C-preprocessor macros.  If that is unsuccessful, or if
+** -DSHA3_BYTEORDER=0 is set, then byte-order is determined
+** at run-time.
+*/
+#ifndef SHA3_BYTEORDER
+# if defined(i386)     || defined(__i386__)   || defined(_M_IX86) ||    \
+     defined(__x86_64) || defined(__x86_64__) || defined(_M_X64)  ||    \
+     defined(_M_AMD64) || defined(_M_ARM)     || defined(__x86)   ||    \
+     defined(__arm__)
+#   define SHA3_BYTEORDER    1234
+# elif defined(sparc)    || defined(__ppc__)
+#   define SHA3_BYTEORDER    4321
+# else
+#   define SHA3_BYTEORDER 0
+# endif
+#endif
+
+
+/*
+** State structure for a SHA3 hash in progress
+*/
+typedef struct SHA3Context SHA3Context;
+struct SHA3Context {
+  union {
+    u64 s[25];                /* Keccak state. 5x5 lines of 64 bits each */
+    unsigned char x[1600];    /* ... or 1600 bytes */
+  } u;
+  unsigned nRate;        /* Bytes of input accepted per Keccak iteration */
+  unsigned nLoaded;      /* Input bytes loaded into u.x[] so far this cycle */
+  unsigned ixMask;       /* Insert next input into u.x[nLoaded^ixMask]. */
+};
+
+/*
+** A single step of the Keccak mixing function for a 1600-bit state
+*/
+static void KeccakF1600Step(SHA3Context *p){
+  int i;
+  u64 B0, B1, B2, B3, B4;
+  u64 C0, C1, C2, C3, C4;
+  u64 D0, D1, D2, D3, D4;
+  static const u64 RC[] = {
+    0x0000000000000001ULL,  0x0000000000008082ULL,
+    0x800000000000808aULL,  0x8000000080008000ULL,
+    0x000000000000808bULL,  0x0000000080000001ULL,
+    0x8000000080008081ULL,  0x8000000000008009ULL,
+    0x000000000000008aULL,  0x0000000000000088ULL,
+    0x0000000080008009ULL,  0x000000008000000aULL,
+    0x000000008000808bULL,  0x800000000000008bULL,
+    0x8000000000008089ULL,  0x8000000000008003ULL,
+    0x8000000000008002ULL,  0x8000000000000080ULL,
+    0x000000000000800aULL,  0x800000008000000aULL,
+    0x8000000080008081ULL,  0x8000000000008080ULL,
+    0x0000000080000001ULL,  0x8000000080008008ULL
+  };
+# define A00 (p->u.s[0])
+# define A01 (p->u.s[1])
+# define A02 (p->u.s[2])
+# define A03 (p->u.s[3])
+# define A04 (p->u.s[4])
+# define A10 (p->u.s[5])
+# define A11 (p->u.s[6])
+# define A12 (p->u.s[7])
+# define A13 (p->u.s[8])
+# define A14 (p->u.s[9])
+# define A20 (p->u.s[10])
+# define A21 (p->u.s[11])
+# define A22 (p->u.s[12])
+# define A23 (p->u.s[13])
+# define A24 (p->u.s[14])
+# define A30 (p->u.s[15])
+# define A31 (p->u.s[16])
+# define A32 (p->u.s[17])
+# define A33 (p->u.s[18])
+# define A34 (p->u.s[19])
+# define A40 (p->u.s[20])
+# define A41 (p->u.s[21])
+# define A42 (p->u.s[22])
+# define A43 (p->u.s[23])
+# define A44 (p->u.s[24])
+# define ROL64(a,x) ((a<<x)|(a>>(64-x)))
+
+  for(i=0; i<24; i+=4){
+    C0 = A00^A10^A20^A30^A40;
+    C1 = A01^A11^A21^A31^A41;
+    C2 = A02^A12^A22^A32^A42;
+    C3 = A03^A13^A23^A33^A43;
+    C4 = A04^A14^A24^A34^A44;
+    D0 = C4^ROL64(C1, 1);
+    D1 = C0^ROL64(C2, 1);
+    D2 = C1^ROL64(C3, 1);
+    D3 = C2^ROL64(C4, 1);
+    D4 = C3^ROL64(C0, 1);
+
+    B0 = (A00^D0);
+    B1 = ROL64((A11^D1), 44);
+    B2 = ROL64((A22^D2), 43);
+    B3 = ROL64((A33^D3), 21);
+    B4 = ROL64((A44^D4), 14);
+    A00 =   B0 ^((~B1)&  B2 );
+    A00 ^= RC[i];
+    A11 =   B1 ^((~B2)&  B3 );
+    A22 =   B2 ^((~B3)&  B4 );
+    A33 =   B3 ^((~B4)&  B0 );
+    A44 =   B4 ^((~B0)&  B1 );
+
+    B2 = ROL64((A20^D0), 3);
+    B3 = ROL64((A31^D1), 45);
+    B4 = ROL64((A42^D2), 61);
+    B0 = ROL64((A03^D3), 28);
+    B1 = ROL64((A14^D4), 20);
+    A20 =   B0 ^((~B1)&  B2 );
+    A31 =   B1 ^((~B2)&  B3 );
+    A42 =   B2 ^((~B3)&  B4 );
+    A03 =   B3 ^((~B4)&  B0 );
+    A14 =   B4 ^((~B0)&  B1 );
+
+    B4 = ROL64((A40^D0), 18);
+    B0 = ROL64((A01^D1), 1);
+    B1 = ROL64((A12^D2), 6);
+    B2 = ROL64((A23^D3), 25);
+    B3 = ROL64((A34^D4), 8);
+    A40 =   B0 ^((~B1)&  B2 );
+    A01 =   B1 ^((~B2)&  B3 );
+    A12 =   B2 ^((~B3)&  B4 );
+    A23 =   B3 ^((~B4)&  B0 );
+    A34 =   B4 ^((~B0)&  B1 );
+
+    B1 = ROL64((A10^D0), 36);
+    B2 = ROL64((A21^D1), 10);
+    B3 = ROL64((A32^D2), 15);
+    B4 = ROL64((A43^D3), 56);
+    B0 = ROL64((A04^D4), 27);
+    A10 =   B0 ^((~B1)&  B2 );
+    A21 =   B1 ^((~B2)&  B3 );
+    A32 =   B2 ^((~B3)&  B4 );
+    A43 =   B3 ^((~B4)&  B0 );
+    A04 =   B4 ^((~B0)&  B1 );
+
+    B3 = ROL64((A30^D0), 41);
+    B4 = ROL64((A41^D1), 2);
+    B0 = ROL64((A02^D2), 62);
+    B1 = ROL64((A13^D3), 55);
+    B2 = ROL64((A24^D4), 39);
+    A30 =   B0 ^((~B1)&  B2 );
+    A41 =   B1 ^((~B2)&  B3 );
+    A02 =   B2 ^((~B3)&  B4 );
+    A13 =   B3 ^((~B4)&  B0 );
+    A24 =   B4 ^((~B0)&  B1 );
+
+    C0 = A00^A20^A40^A10^A30;
+    C1 = A11^A31^A01^A21^A41;
+    C2 = A22^A42^A12^A32^A02;
+    C3 = A33^A03^A23^A43^A13;
+    C4 = A44^A14^A34^A04^A24;
+    D0 = C4^ROL64(C1, 1);
+    D1 = C0^ROL64(C2, 1);
+    D2 = C1^ROL64(C3, 1);
+    D3 = C2^ROL64(C4, 1);
+    D4 = C3^ROL64(C0, 1);
+
+    B0 = (A00^D0);
+    B1 = ROL64((A31^D1), 44);
+    B2 = ROL64((A12^D2), 43);
+    B3 = ROL64((A43^D3), 21);
+    B4 = ROL64((A24^D4), 14);
+    A00 =   B0 ^((~B1)&  B2 );
+    A00 ^= RC[i+1];
+    A31 =   B1 ^((~B2)&  B3 );
+    A12 =   B2 ^((~B3)&  B4 );
+    A43 =   B3 ^((~B4)&  B0 );
+    A24 =   B4 ^((~B0)&  B1 );
+
+    B2 = ROL64((A40^D0), 3);
+    B3 = ROL64((A21^D1), 45);
+    B4 = ROL64((A02^D2), 61);
+    B0 = ROL64((A33^D3), 28);
+    B1 = ROL64((A14^D4), 20);
+    A40 =   B0 ^((~B1)&  B2 );
+    A21 =   B1 ^((~B2)&  B3 );
+    A02 =   B2 ^((~B3)&  B4 );
+    A33 =   B3 ^((~B4)&  B0 );
+    A14 =   B4 ^((~B0)&  B1 );
+
+    B4 = ROL64((A30^D0), 18);
+    B0 = ROL64((A11^D1), 1);
+    B1 = ROL64((A42^D2), 6);
+    B2 = ROL64((A23^D3), 25);
+    B3 = ROL64((A04^D4), 8);
+    A30 =   B0 ^((~B1)&  B2 );
+    A11 =   B1 ^((~B2)&  B3 );
+    A42 =   B2 ^((~B3)&  B4 );
+    A23 =   B3 ^((~B4)&  B0 );
+    A04 =   B4 ^((~B0)&  B1 );
+
+    B1 = ROL64((A20^D0), 36);
+    B2 = ROL64((A01^D1), 10);
+    B3 = ROL64((A32^D2), 15);
+    B4 = ROL64((A13^D3), 56);
+    B0 = ROL64((A44^D4), 27);
+    A20 =   B0 ^((~B1)&  B2 );
+    A01 =   B1 ^((~B2)&  B3 );
+    A32 =   B2 ^((~B3)&  B4 );
+    A13 =   B3 ^((~B4)&  B0 );
+    A44 =   B4 ^((~B0)&  B1 );
+
+    B3 = ROL64((A10^D0), 41);
+    B4 = ROL64((A41^D1), 2);
+    B0 = ROL64((A22^D2), 62);
+    B1 = ROL64((A03^D3), 55);
+    B2 = ROL64((A34^D4), 39);
+    A10 =   B0 ^((~B1)&  B2 );
+    A41 =   B1 ^((~B2)&  B3 );
+    A22 =   B2 ^((~B3)&  B4 );
+    A03 =   B3 ^((~B4)&  B0 );
+    A34 =   B4 ^((~B0)&  B1 );
+
+    C0 = A00^A40^A30^A20^A10;
+    C1 = A31^A21^A11^A01^A41;
+    C2 = A12^A02^A42^A32^A22;
+    C3 = A43^A33^A23^A13^A03;
+    C4 = A24^A14^A04^A44^A34;
+    D0 = C4^ROL64(C1, 1);
+    D1 = C0^ROL64(C2, 1);
+    D2 = C1^ROL64(C3, 1);
+    D3 = C2^ROL64(C4, 1);
+    D4 = C3^ROL64(C0, 1);
+
+    B0 = (A00^D0);
+    B1 = ROL64((A21^D1), 44);
+    B2 = ROL64((A42^D2), 43);
+    B3 = ROL64((A13^D3), 21);
+    B4 = ROL64((A34^D4), 14);
+    A00 =   B0 ^((~B1)&  B2 );
+    A00 ^= RC[i+2];
+    A21 =   B1 ^((~B2)&  B3 );
+    A42 =   B2 ^((~B3)&  B4 );
+    A13 =   B3 ^((~B4)&  B0 );
+    A34 =   B4 ^((~B0)&  B1 );
+
+    B2 = ROL64((A30^D0), 3);
+    B3 = ROL64((A01^D1), 45);
+    B4 = ROL64((A22^D2), 61);
+    B0 = ROL64((A43^D3), 28);
+    B1 = ROL64((A14^D4), 20);
+    A30 =   B0 ^((~B1)&  B2 );
+    A01 =   B1 ^((~B2)&  B3 );
+    A22 =   B2 ^((~B3)&  B4 );
+    A43 =   B3 ^((~B4)&  B0 );
+    A14 =   B4 ^((~B0)&  B1 );
+
+    B4 = ROL64((A10^D0), 18);
+    B0 = ROL64((A31^D1), 1);
+    B1 = ROL64((A02^D2), 6);
+    B2 = ROL64((A23^D3), 25);
+    B3 = ROL64((A44^D4), 8);
+    A10 =   B0 ^((~B1)&  B2 );
+    A31 =   B1 ^((~B2)&  B3 );
+    A02 =   B2 ^((~B3)&  B4 );
+    A23 =   B3 ^((~B4)&  B0 );
+    A44 =   B4 ^((~B0)&  B1 );
+
+    B1 = ROL64((A40^D0), 36);
+    B2 = ROL64((A11^D1), 10);
+    B3 = ROL64((A32^D2), 15);
+    B4 = ROL64((A03^D3), 56);
+    B0 = ROL64((A24^D4), 27);
+    A40 =   B0 ^((~B1)&  B2 );
+    A11 =   B1 ^((~B2)&  B3 );
+    A32 =   B2 ^((~B3)&  B4 );
+    A03 =   B3 ^((~B4)&  B0 );
+    A24 =   B4 ^((~B0)&  B1 );
+
+    B3 = ROL64((A20^D0), 41);
+    B4 = ROL64((A41^D1), 2);
+    B0 = ROL64((A12^D2), 62);
+    B1 = ROL64((A33^D3), 55);
+    B2 = ROL64((A04^D4), 39);
+    A20 =   B0 ^((~B1)&  B2 );
+    A41 =   B1 ^((~B2)&  B3 );
+    A12 =   B2 ^((~B3)&  B4 );
+    A33 =   B3 ^((~B4)&  B0 );
+    A04 =   B4 ^((~B0)&  B1 );
+
+    C0 = A00^A30^A10^A40^A20;
+    C1 = A21^A01^A31^A11^A41;
+    C2 = A42^A22^A02^A32^A12;
+    C3 = A13^A43^A23^A03^A33;
+    C4 = A34^A14^A44^A24^A04;
+    D0 = C4^ROL64(C1, 1);
+    D1 = C0^ROL64(C2, 1);
+    D2 = C1^ROL64(C3, 1);
+    D3 = C2^ROL64(C4, 1);
+    D4 = C3^ROL64(C0, 1);
+
+    B0 = (A00^D0);
+    B1 = ROL64((A01^D1), 44);
+    B2 = ROL64((A02^D2), 43);
+    B3 = ROL64((A03^D3), 21);
+    B4 = ROL64((A04^D4), 14);
+    A00 =   B0 ^((~B1)&  B2 );
+    A00 ^= RC[i+3];
+    A01 =   B1 ^((~B2)&  B3 );
+    A02 =   B2 ^((~B3)&  B4 );
+    A03 =   B3 ^((~B4)&  B0 );
+    A04 =   B4 ^((~B0)&  B1 );
+
+    B2 = ROL64((A10^D0), 3);
+    B3 = ROL64((A11^D1), 45);
+    B4 = ROL64((A12^D2), 61);
+    B0 = ROL64((A13^D3), 28);
+    B1 = ROL64((A14^D4), 20);
+    A10 =   B0 ^((~B1)&  B2 );
+    A11 =   B1 ^((~B2)&  B3 );
+    A12 =   B2 ^((~B3)&  B4 );
+    A13 =   B3 ^((~B4)&  B0 );
+    A14 =   B4 ^((~B0)&  B1 );
+
+    B4 = ROL64((A20^D0), 18);
+    B0 = ROL64((A21^D1), 1);
+    B1 = ROL64((A22^D2), 6);
+    B2 = ROL64((A23^D3), 25);
+    B3 = ROL64((A24^D4), 8);
+    A20 =   B0 ^((~B1)&  B2 );
+    A21 =   B1 ^((~B2)&  B3 );
+    A22 =   B2 ^((~B3)&  B4 );
+    A23 =   B3 ^((~B4)&  B0 );
+    A24 =   B4 ^((~B0)&  B1 );
+
+    B1 = ROL64((A30^D0), 36);
+    B2 = ROL64((A31^D1), 10);
+    B3 = ROL64((A32^D2), 15);
+    B4 = ROL64((A33^D3), 56);
+    B0 = ROL64((A34^D4), 27);
+    A30 =   B0 ^((~B1)&  B2 );
+    A31 =   B1 ^((~B2)&  B3 );
+    A32 =   B2 ^((~B3)&  B4 );
+    A33 =   B3 ^((~B4)&  B0 );
+    A34 =   B4 ^((~B0)&  B1 );
+
+    B3 = ROL64((A40^D0), 41);
+    B4 = ROL64((A41^D1), 2);
+    B0 = ROL64((A42^D2), 62);
+    B1 = ROL64((A43^D3), 55);
+    B2 = ROL64((A44^D4), 39);
+    A40 =   B0 ^((~B1)&  B2 );
+    A41 =   B1 ^((~B2)&  B3 );
+    A42 =   B2 ^((~B3)&  B4 );
+    A43 =   B3 ^((~B4)&  B0 );
+    A44 =   B4 ^((~B0)&  B1 );
+  }
+}
+
+/*
+** Initialize a new hash.  iSize determines the size of the hash
+** in bits and should be one of 224, 256, 384, or 512.  Or iSize
+** can be zero to use the default hash size of 256 bits.
+*/
+static void SHA3Init(SHA3Context *p, int iSize){
+  memset(p, 0, sizeof(*p));
+  if( iSize>=128 && iSize<=512 ){
+    p->nRate = (1600 - ((iSize + 31)&~31)*2)/8;
+  }else{
+    p->nRate = (1600 - 2*256)/8;
+  }
+#if SHA3_BYTEORDER==1234
+  /* Known to be little-endian at compile-time. No-op */
+#elif SHA3_BYTEORDER==4321
+  p->ixMask = 7;  /* Big-endian */
+#else
+  {
+    static unsigned int one = 1;
+    if( 1==*(unsigned char*)&one ){
+      /* Little endian.  No byte swapping. */
+      p->ixMask = 0;
+    }else{
+      /* Big endian.  Byte swap. */
+      p->ixMask = 7;
+    }
+  }
+#endif
+}
+
+/*
+** Make consecutive calls to the SHA3Update function to add new content
+** to the hash
+*/
+static void SHA3Update(
+  SHA3Context *p,
+  const unsigned char *aData,
+  unsigned int nData
+){
+  unsigned int i = 0;
+#if SHA3_BYTEORDER==1234
+  if( (p->nLoaded % 8)==0 && ((aData - (const unsigned char*)0)&7)==0 ){
+    for(; i+7<nData; i+=8){
+      p->u.s[p->nLoaded/8] ^= *(u64*)&aData[i];
+      p->nLoaded += 8;
+      if( p->nLoaded>=p->nRate ){
+        KeccakF1600Step(p);
+        p->nLoaded = 0;
+      }
+    }
+  }
+#endif
+  for(; i<nData; i++){
+#if SHA3_BYTEORDER==1234
+    p->u.x[p->nLoaded] ^= aData[i];
+#elif SHA3_BYTEORDER==4321
+    p->u.x[p->nLoaded^0x07] ^= aData[i];
+#else
+    p->u.x[p->nLoaded^p->ixMask] ^= aData[i];
+#endif
+    p->nLoaded++;
+    if( p->nLoaded==p->nRate ){
+      KeccakF1600Step(p);
+      p->nLoaded = 0;
+    }
+  }
+}
+
+/*
+** After all content has been added, invoke SHA3Final() to compute
+** the final hash.  The function returns a pointer to the binary
+** hash value.
+*/
+static unsigned char *SHA3Final(SHA3Context *p){
+  unsigned int i;
+  if( p->nLoaded==p->nRate-1 ){
+    const unsigned char c1 = 0x86;
+    SHA3Update(p, &c1, 1);
+  }else{
+    const unsigned char c2 = 0x06;
+    const unsigned char c3 = 0x80;
+    SHA3Update(p, &c2, 1);
+    p->nLoaded = p->nRate - 1;
+    SHA3Update(p, &c3, 1);
+  }
+  for(i=0; i<p->nRate; i++){
+    p->u.x[i+p->nRate] = p->u.x[i^p->ixMask];
+  }
+  return &p->u.x[p->nRate];
+}
+/* End of the hashing logic
+*****************************************************************************/
+
+/*
+** A member of a --solid block
+*/
+typedef struct SolidMember SolidMember;
+struct SolidMember {
+  char *zName;           /* Name of the file.  From malloc() */
+  struct stat st;        /* Result of stat() on zName */
+  int iArg;              /* Index of the FILES argument being walked */
+  int iOfst;             /* Offset of the content within the block */
+  int sz;                /* Bytes of content actually read */
+};
+
+/*
+** A file or directory that has been found by the directory walk and
+** is waiting to be inserted into the archive.
+*/
+typedef struct IngestJob IngestJob;
+struct IngestJob {
+  char *zName;           /* Name of the file.  From malloc() */
+  struct stat st;        /* Result of stat() on zName */
+  int eType;             /* One of the JOB_FILE... values below */
+  int eState;            /* One of the JOB_NEW... values below */
+  sqlite3_int64 iOfst;   /* Offset of a JOB_CHUNK within the file */
+  sqlite3_int64 szOrig;  /* Original size of the file or chunk */
+  char *pData;           /* Content to be stored.  From malloc() */
+  FILE *pSpool;          /* Or content stored in a temporary file */
+  int szCompr;           /* Number of bytes in pData or pSpool */
+  char *zErr;            /* Error message, or NULL.  From malloc() */
+  const Codec *pCodec;   /* Compress with this codec.  NULL for none */
+  int iLevel;            /* Compression level for pCodec */
+  int isRaw;             /* Not compressed because it looked incompressible */
+  int iClass;            /* Entry in ig.aClass[] for --rate, or -1 */
+  int iArg;              /* Index of the FILES argument being walked */
+  sqlite3_int64 nsCompress;  /* CPU time spent compressing, in nanoseconds */
+  sqlite3_int64 nsCompressWall;  /* Elapsed time spent compressing */
+  sqlite3_int64 nsWork;      /* Elapsed time on the worker, for --stats */
+  sqlite3_int64 nsWorkCpu;   /* CPU time on the worker, for --stats */
+  ZlibEncoder *pEnc;     /* zlib compressor of the thread running the job */
+  SolidMember *aMember;  /* Entries of a JOB_SOLID.  From malloc() */
+  int nMember;           /* Number of entries in aMember[] */
+  int eIo;               /* IO_BUSY while the io_uring reader has the job */
+  int nIoPending;        /* Reads of this job in flight */
+  int ioFailed;          /* A read of this job by the reader failed */
+  unsigned iJob;         /* Sequence number of this job */
+  int isOwner;           /* This job stores the content for aHash[] */
+  unsigned char aHash[HASH_SIZE];  /* Hash of the content, for --dedup */
+};
+
+/* Allowed values for IngestJob.eType */
+#define JOB_FILE     0   /* A file or directory stored in the sqlar table */
+#define JOB_CHUNKED  1   /* The sqlar row for a file stored in chunks */
+#define JOB_CHUNK    2   /* One chunk of the previous JOB_CHUNKED */
+#define JOB_SOLID    3   /* A block of small files and other entries */
+
+/* Allowed values for IngestJob.eState */
+#define JOB_NEW   0      /* Waiting for a worker thread */
+#define JOB_BUSY  1      /* A worker thread is reading and compressing */
+#define JOB_DONE  2      /* Ready to be inserted by the writer */
+
+/* Allowed values for IngestJob.eIo */
+#define IO_NONE   0      /* Not read by the io_uring reader */
+#define IO_BUSY   1      /* The io_uring reader is reading the content */
+#define IO_DONE   2      /* The reader is finished with the job */
+
+/*
+** Replace *pzErr with an error message in memory from malloc().  Worker
+** threads use this, through job_error() or extract_error(), in place of
+** errorMsg().
+*/
+static void job_verror(char **pzErr, const char *zFormat, va_list ap){
+  va_list ap2;
+  int n;
+  va_copy(ap2, ap);
+  n = vsnprintf(0, 0, zFormat, ap2);
+  va_end(ap2);
+  free(*pzErr);
+  *pzErr = malloc( n+1 );
+  if( *pzErr==0 ) return;
+  vsnprintf(*pzErr, n+1, zFormat, ap);
+}
+
+/*
+** Record an error message against an ingest job
+*/
+static void job_error(IngestJob *p, const char *zFormat, ...){
+  va_list ap;
+  va_start(ap, zFormat);
+  job_verror(&p->zErr, zFormat, ap);
+  va_end(ap);
+}
+
+/*
+** Name extensions and magic numbers of file formats that are already
+** compressed.  Compressing them again costs a lot of CPU time and almost
+** never saves any space.
+*/
+static const char *const azPackedExt[] = {
+  "7z", "aac", "avif", "bz2", "docx", "flac", "gif", "gz", "heic", "jar",
+  "jpeg", "jpg", "lz4", "m4a", "mkv", "mov", "mp3", "mp4", "odt", "ogg",
+  "png", "pptx", "rar", "tgz", "webm", "webp", "xlsx", "xz", "zip", "zst",
+};
+static const struct PackedMagic {
+  int iOfst;             /* Offset of the magic number in the file */
+  int n;                 /* Size of the magic number in bytes */
+  const char *z;         /* The magic number */
+} aPackedMagic[] = {
+  { 0, 3, "\xff\xd8\xff" },               /* JPEG */
+  { 0, 8, "\x89PNG\r\n\x1a\n" },          /* PNG */
+  { 0, 4, "GIF8" },                        /* GIF */
+  { 8, 4, "WEBP" },                        /* WebP */
+  { 4, 4, "ftyp" },                        /* MP4, MOV, HEIC, AVIF */
+  { 0, 4, "\x1a\x45\xdf\xa3" },            /* Matroska, WebM */
+  { 0, 3, "ID3" },                         /* MP3 */
+  { 0, 4, "OggS" },                        /* Ogg */
+  { 0, 4, "fLaC" },                        /* FLAC */
+  { 0, 4, "PK\x03\x04" },                  /* ZIP, JAR, DOCX, ... */
+  { 0, 2, "\x1f\x8b" },                    /* gzip */
+  { 0, 3, "BZh" },                         /* bzip2 */
+  { 0, 6, "\xfd" "7zXZ\x00" },              /* xz */
+  { 0, 6, "7z\xbc\xaf\x27\x1c" },          /* 7-Zip */
+  { 0, 4, "Rar!" },                        /* RAR */
+  { 0, 4, "\x28\xb5\x2f\xfd" },            /* zstd */
+  { 0, 4, "\x04\x22\x4d\x18" },            /* lz4 */
+};
+
+/*
+** The entropy of a sample of the content is estimated from a histogram
+** of SAMPLE_SLICES slices of SAMPLE_SLICE bytes each, spread evenly over
+** the content.  Content whose byte entropy is above ENTROPY_LIMIT bits
+** per byte is not worth compressing.
+*/
+#define SAMPLE_SLICES  16
+#define SAMPLE_SLICE   4096
+#define ENTROPY_LIMIT  7.9
+
+/* True for --compress-all, which turns off looks_incompressible() */
+static int compressAll = 0;
+
+/*
+** Return the estimated entropy, in bits per byte, of the nByte bytes
+** counted in the histogram aCount[].
+*/
+static double entropy(const unsigned *aCount, int nByte){
+  double e = 0.0;
+  int i;
+  for(i=0; i<256; i++){
+    if( aCount[i] ){
+      double f = (double)aCount[i]/nByte;
+      e -= f*log2(f);
+    }
+  }
+  return e;
+}
+
+/*
+** Return true if the content of job p is probably not compressible, so
+** that compressing it would only waste time.  The content is either the
+** n bytes in pBuf[] or, if pBuf is NULL, the first n bytes of file in.
+** In the latter case the read position of the file is changed.
+**
+** The file name extension and the magic number at the start of the file
+** are checked first, then the entropy of a sample of the content.
+*/
+static int looks_incompressible(
+  IngestJob *p,            /* The job */
+  const char *pBuf,        /* Content held in memory, or NULL */
+  FILE *in,                /* Or read the content from this file */
+  sqlite3_int64 n          /* Size of the content */
+){
+  unsigned aCount[256];
+  unsigned char aSlice[SAMPLE_SLICE];
+  const char *zExt = strrchr(p->zName, '.');
+  int nSample = 0;
+  int i, j;
+
+  if( zExt && strchr(zExt, '/')==0 && p->eType!=JOB_SOLID ){
+    for(i=0; i<(int)(sizeof(azPackedExt)/sizeof(azPackedExt[0])); i++){
+      if( strcasecmp(&zExt[1], azPackedExt[i])==0 ) return 1;
+    }
+  }
+  if( n<SAMPLE_SLICE ) return 0;
+  memset(aCount, 0, sizeof(aCount));
+  for(i=0; i<SAMPLE_SLICES; i++){
+    sqlite3_int64 iOfst = i*((n - SAMPLE_SLICE)/(SAMPLE_SLICES-1));
+    const unsigned char *a = aSlice;
+    if( pBuf ){
+      a = (const unsigned char*)&pBuf[iOfst];
+    }else if( fseeko(in, iOfst, SEEK_SET)
+           || fread(aSlice, SAMPLE_SLICE, 1, in)!=1 ){
+      break;
+    }
+    if( i==0 && p->eType!=JOB_SOLID
+     && (p->eType!=JOB_CHUNK || p->iOfst==0) ){
+      for(j=0; j<(int)(sizeof(aPackedMagic)/sizeof(aPackedMagic[0])); j++){
+        const struct PackedMagic *pM = &aPackedMagic[j];
+        if( memcmp(&a[pM->iOfst], pM->z, pM->n)==0 ) return 1;
+      }
+    }
+    for(j=0; j<SAMPLE_SLICE; j++) aCount[a[j]]++;
+    nSample += SAMPLE_SLICE;
+  }
+  return nSample>0 && entropy(aCount, nSample)>ENTROPY_LIMIT;
+}
+
+/*
+** Compress nIn bytes read from file in into a temporary file, using a
+** fixed amount of memory no matter how large the input is.  The output
+** is the same zlib stream that compress2() would generate.  Only the
+** zlib codec is used this way.  Large files that use other codecs are
+** stored in chunks instead.
+**
+** If the compressed content would not be smaller than the original,
+** give up early and leave p->pSpool set to NULL.  The writer then copies
+** the original file into the archive as is.
+*/
+static void deflate_file(IngestJob *p, FILE *in, sqlite3_int64 nIn){
+  z_stream z;
+  unsigned char *aIn, *aOut;
+  sqlite3_int64 nRead = 0;
+  sqlite3_int64 nOut = 0;
+  int flush;
+  int rc;
+
+  p->szCompr = (int)nIn;
+  memset(&z, 0, sizeof(z));
+  aIn = malloc( STREAM_WINDOW );
+  aOut = malloc( STREAM_WINDOW );
+  p->pSpool = tmpfile();
+  if( aIn==0 || aOut==0 ){
+    job_error(p, "Out of memory\n");
+  }else if( p->pSpool==0 ){
+    job_error(p, "cannot create a temporary file\n");
+  }else if( deflateInit(&z, p->iLevel)!=Z_OK ){
+    job_error(p, "Cannot compress %s\n", p->zName);
+  }else{
+    do{
+      size_t n = STREAM_WINDOW;
+      if( n>nIn-nRead ) n = (size_t)(nIn-nRead);
+      n = fread(aIn, 1, n, in);
+      if( n==0 ){
+        job_error(p, "unable to read %lld bytes of file %s\n", nIn, p->zName);
+        break;
+      }
+      nRead += n;
+      flush = nRead>=nIn ? Z_FINISH : Z_NO_FLUSH;
+      z.next_in = aIn;
+      z.avail_in = (uInt)n;
+      do{
+        z.next_out = aOut;
+        z.avail_out = STREAM_WINDOW;
+        rc = deflate(&z, flush);
+        assert( rc!=Z_STREAM_ERROR );
+        n = STREAM_WINDOW - z.avail_out;
+        nOut += n;
+        if( nOut>=nIn ) break;
+        if( fwrite(aOut, 1, n, p->pSpool)!=n ){
+          job_error(p, "cannot write to a temporary file\n");
+          break;
+        }
+      }while( z.avail_out==0 );
+    }while( flush!=Z_FINISH && nOut<nIn && p->zErr==0 );
+    deflateEnd(&z);
+  }
+  free(aIn);
+  free(aOut);
+  if( p->pSpool && (nOut>=nIn || p->zErr) ){
+    fclose(p->pSpool);
+    p->pSpool = 0;
+  }
+  if( p->pSpool ){
+    p->szCompr = (int)nOut;
+    rewind(p->pSpool);
+  }
+}
+
+/*
+** Compress the content in p->pData using codec p->pCodec, if doing so
+** makes it smaller.  Content that looks incompressible is left as is
+** without trying.
+*/
+static void compress_job(IngestJob *p){
+  char *zCompr;
+  size_t nCompr;
+  sqlite3_int64 t, tWall;
+  int rc;
+  if( !compressAll && looks_incompressible(p, p->pData, 0, p->szCompr) ){
+    p->isRaw = 1;
+    return;
+  }
+  t = thread_ns();
+  tWall = wall_ns();
+  if( p->pCodec==&aCodec[0] && p->pEnc ){
+    rc = zlib_encode(p->pEnc, p->pData, p->szCompr, p->iLevel,
+                     &zCompr, &nCompr);
+  }else{
+    rc = p->pCodec->xCompress(p->pData, p->szCompr, p->iLevel,
+                              &zCompr, &nCompr);
+  }
+  if( rc ){
+    job_error(p, "Cannot compress %s\n", p->zName);
+    return;
+  }
+  p->nsCompress = thread_ns() - t;
+  p->nsCompressWall = wall_ns() - tWall;
+  if( p->szCompr>nCompr ){
+    free(p->pData);
+    p->pData = zCompr;
+    p->szCompr = (int)nCompr;
+  }else{
+    free(zCompr);
+  }
+}
+
+/*
+** Read n bytes starting at offset iOfst of open file fd into a[].
+** Return the number of bytes read, which is less than n only at the end
+** of the file or on an error.
+*/
+static sqlite3_int64 read_fully(
+  int fd,                  /* The file to read */
+  char *a,                 /* Write the content here */
+  sqlite3_int64 n,         /* Number of bytes wanted */
+  sqlite3_int64 iOfst      /* Offset of the first byte */
+){
+  sqlite3_int64 nDone = 0;
+  while( nDone<n ){
+    ssize_t got = pread(fd, a+nDone, n-nDone, iOfst+nDone);
+    if( got<0 && errno==EINTR ) continue;
+    if( got<=0 ) break;
+    nDone += got;
+  }
+  return nDone;
+}
+
+/*
+** Read a file, or for a JOB_CHUNK the p->szOrig bytes of the file that
+** start at p->iOfst, from disk into memory obtained from malloc().
+** Compress the content as it is read in if doing so reduces its size
+** and if the noCompress flag is false, unless the content looks like
+** it is not compressible.
+**
+** Files larger than STREAM_SIZE are not read into memory.  Instead
+** they are compressed into p->pSpool by deflate_file(), or copied
+** directly from disk by the writer if they are not to be compressed.
+**
+** This routine runs on worker threads, so it must not call into SQLite
+** (which is built with SQLITE_THREADSAFE=0) nor call errorMsg().  Errors
+** are recorded in p->zErr and reported later by the writer thread.
+**
+** The original size and the compressed size of the file are written
+** into p->szOrig and p->szCompr.  If these two values are equal, that
+** means the file was not compressed.
+**
+** If the content was already read by the io_uring reader, only the
+** compression is left to do.
+*/
+static void read_file(IngestJob *p, int noCompress){
+  FILE *in;
+  int fd;
+  char *zIn;
+  sqlite3_int64 nIn;
+  sqlite3_int64 iOfst = 0;
+  struct stat st;
+
+  if( p->pData || p->zErr ){
+    if( p->pData && !noCompress ) compress_job(p);
+    return;
+  }
+  fd = open(p->zName, O_RDONLY);
+  if( fd<0 ){
+    job_error(p, "cannot open \"%s\" for reading\n", p->zName);
+    return;
+  }
+  if( p->eType==JOB_CHUNK ){
+    nIn = p->szOrig;
+    iOfst = p->iOfst;
+  }else{
+    if( fstat(fd, &st) ){
+      close(fd);
+      job_error(p, "cannot stat \"%s\"\n", p->zName);
+      return;
+    }
+    nIn = st.st_size;
+    if( nIn>STREAM_SIZE ){
+      in = fdopen(fd, "rb");
+      if( in==0 ){
+        close(fd);
+        job_error(p, "cannot open \"%s\" for reading\n", p->zName);
+        return;
+      }
+      p->szOrig = nIn;
+      p->szCompr = (int)nIn;
+      assert( noCompress || p->pCodec==&aCodec[0] );
+      if( noCompress ){
+        /* Store the file as is */
+      }else if( !compressAll && looks_incompressible(p, 0, in, nIn) ){
+        p->isRaw = 1;
+      }else{
+        sqlite3_int64 t = thread_ns();
+        sqlite3_int64 tWall = wall_ns();
+        rewind(in);
+        deflate_file(p, in, nIn);
+        p->nsCompress = thread_ns() - t;
+        p->nsCompressWall = wall_ns() - tWall;
+      }
+      fclose(in);
+      return;
+    }
+  }
+  zIn = malloc( nIn+1 );
+  if( zIn==0 ){
+    close(fd);
+    job_error(p, "cannot malloc for %lld bytes\n", nIn+1);
+    return;
+  }
+  if( read_fully(fd, zIn, nIn, iOfst)!=nIn ){
+    close(fd);
+    free(zIn);
+    job_error(p, "unable to read %lld bytes of file %s\n", nIn, p->zName);
+    return;
+  }
+  close(fd);
+  p->szOrig = nIn;
+  p->szCompr = (int)nIn;
+  p->pData = zIn;
+  if( !noCompress ) compress_job(p);
+}
+
+/*
+** Dictionary training for --dict.
+**
+** The sample is up to DICT_SAMPLE bytes from files that are no larger
+** than ZLIB_DICT_MAX bytes, found among the FILES to be added.  At most
+** DICT_PER_DIR files are taken from each directory, so that the sample
+** is spread over the tree.
+**
+** The dictionary is made of DICT_SEGMENT-byte segments of the sample,
+** in the manner of the "cover" algorithm of zstd.  Each segment is
+** scored by how many sample files share each DICT_KMER-byte string in
+** it.  The best segment is taken and its strings no longer score, so
+** that the next segment adds something new.  The best segments go at
+** the end of the dictionary, where zlib reaches them with the shortest
+** distances.
+*/
+#define DICT_SIZE     (16*1024)      /* Size of the dictionary */
+#define DICT_SAMPLE   (2*1024*1024)  /* Largest sample in bytes */
+#define DICT_PER_DIR  32             /* Sample files per directory */
+#define DICT_SEGMENT  64             /* Size of a dictionary segment */
+#define DICT_KMER     8              /* Size of the strings counted */
+#define DICT_HASH     (1<<20)        /* Slots in the string count table */
+
+typedef struct DictSample DictSample;
+struct DictSample {
+  char *a;               /* Content of all sample files */
+  int n;                 /* Bytes of content in a[] */
+  int nFile;             /* Number of sample files */
+  int nAlloc;            /* Slots allocated in aEnd[] */
+  int *aEnd;             /* aEnd[i] is the offset just past file i */
+};
+
+/*
+** Add file zPath to the sample, or if it is a directory, files from the
+** directory and its subdirectories.  Only subdirectories are visited if
+** noFiles is true.  Return the number of files added directly.
+*/
+static int dict_sample(DictSample *p, const char *zPath, int noFiles){
+  struct stat x;
+  if( p->n>=DICT_SAMPLE || stat(zPath, &x) ) return 0;
+  if( S_ISREG(x.st_mode) ){
+    FILE *in;
+    int nRead = 0;
+    if( noFiles || x.st_size==0 || x.st_size>ZLIB_DICT_MAX
+     || p->n+x.st_size>DICT_SAMPLE ){
+      return 0;
+    }
+    in = fopen(zPath, "rb");
+    if( in==0 ) return 0;
+    if( fread(&p->a[p->n], x.st_size, 1, in)==1 ){
+      if( p->nFile>=p->nAlloc ){
+        p->nAlloc = p->nAlloc*2 + 64;
+        p->aEnd = sqlite3_realloc(p->aEnd, p->nAlloc*sizeof(int));
+        if( p->aEnd==0 ) errorMsg("Out of memory\n");
+      }
+      p->n += (int)x.st_size;
+      p->aEnd[p->nFile++] = p->n;
+      nRead = 1;
+    }
+    fclose(in);
+    return nRead;
+  }
+  if( S_ISDIR(x.st_mode) ){
+    DIR *d = opendir(zPath);
+    struct dirent *pEntry;
+    int nFile = 0;
+    if( d==0 ) return 0;
+    while( p->n<DICT_SAMPLE && (pEntry = readdir(d))!=0 ){
+      char *zSub;
+      if( strcmp(pEntry->d_name,".")==0 || strcmp(pEntry->d_name,"..")==0 ){
+        continue;
+      }
+      zSub = sqlite3_mprintf("%s/%s", zPath, pEntry->d_name);
+      if( zSub==0 ) errorMsg("Out of memory\n");
+      nFile += dict_sample(p, zSub, nFile>=DICT_PER_DIR);
+      sqlite3_free(zSub);
+    }
+    closedir(d);
+  }
+  return 0;
+}
+
+/*
+** Hash of the DICT_KMER bytes at a[]
+*/
+static unsigned dict_hash(const char *a){
+  sqlite3_uint64 x;
+  memcpy(&x, a, sizeof(x));
+  return (unsigned)((x*0x9E3779B97F4A7C15ULL) >> (64-20)) & (DICT_HASH-1);
+}
+
+/*
+** Score segment iSeg of the sample against the string counts aCount[].
+** Strings that occur in only one sample file do not count.
+*/
+static unsigned dict_score(DictSample *p, unsigned *aCount, int iSeg){
+  int i;
+  unsigned s = 0;
+  for(i=iSeg*DICT_SEGMENT; i<=(iSeg+1)*DICT_SEGMENT-DICT_KMER; i++){
+    unsigned c = aCount[dict_hash(&p->a[i])];
+    if( c>1 ) s += c;
+  }
+  return s;
+}
+
+/*
+** Move entry i of the max-heap aHeap[0..n-1] of segment numbers, ordered
+** by aScore[], down to its place.
+*/
+static void dict_sift(int *aHeap, int n, const unsigned *aScore, int i){
+  while( 2*i+1<n ){
+    int j = 2*i+1;
+    int t;
+    if( j+1<n && aScore[aHeap[j+1]]>aScore[aHeap[j]] ) j++;
+    if( aScore[aHeap[i]]>=aScore[aHeap[j]] ) break;
+    t = aHeap[i];
+    aHeap[i] = aHeap[j];
+    aHeap[j] = t;
+    i = j;
+  }
+}
+
+/*
+** Build a dictionary from the sample.  Return the dictionary, in memory
+** from sqlite3_malloc(), and set *pnDict to its size.  Return NULL if
+** the sample has nothing in common.
+*/
+static char *dict_train(DictSample *p, int *pnDict){
+  unsigned *aCount = sqlite3_malloc( DICT_HASH*sizeof(unsigned) );
+  int *aLast = sqlite3_malloc( DICT_HASH*sizeof(int) );
+  int nSeg = p->n/DICT_SEGMENT;
+  unsigned *aScore = sqlite3_malloc( nSeg*sizeof(unsigned) + 1 );
+  int *aHeap = sqlite3_malloc( nSeg*sizeof(int) + 1 );
+  char *aDict = sqlite3_malloc( DICT_SIZE );
+  int nHeap = 0;
+  int nDict = 0;
+  int iFile = 0;
+  int i;
+
+  if( aCount==0 || aLast==0 || aScore==0 || aHeap==0 || aDict==0 ){
+    errorMsg("Out of memory\n");
+  }
+  memset(aCount, 0, DICT_HASH*sizeof(unsigned));
+  memset(aLast, 0xff, DICT_HASH*sizeof(int));
+  for(i=0; i+DICT_KMER<=p->n; i++){
+    unsigned h;
+    while( i>=p->aEnd[iFile] ) iFile++;
+    if( i+DICT_KMER>p->aEnd[iFile] ) continue;
+    h = dict_hash(&p->a[i]);
+    if( aLast[h]!=iFile ){
+      aLast[h] = iFile;
+      aCount[h]++;
+    }
+  }
+  for(i=0; i<nSeg; i++){
+    aScore[i] = dict_score(p, aCount, i);
+    if( aScore[i]>0 ) aHeap[nHeap++] = i;
+  }
+  for(i=nHeap/2-1; i>=0; i--) dict_sift(aHeap, nHeap, aScore, i);
+  while( nHeap>0 && nDict+DICT_SEGMENT<=DICT_SIZE ){
+    int iBest = aHeap[0];
+    unsigned s;
+    /* Scores only go down, so a score that is still current is the best */
+    s = dict_score(p, aCount, iBest);
+    if( s<aScore[iBest] ){
+      aScore[iBest] = s;
+      if( s==0 ) aHeap[0] = aHeap[--nHeap];
+      dict_sift(aHeap, nHeap, aScore, 0);
+      continue;
+    }
+    aHeap[0] = aHeap[--nHeap];
+    dict_sift(aHeap, nHeap, aScore, 0);
+    nDict += DICT_SEGMENT;
+    memcpy(&aDict[DICT_SIZE-nDict], &p->a[iBest*DICT_SEGMENT], DICT_SEGMENT);
+    for(i=iBest*DICT_SEGMENT; i<=(iBest+1)*DICT_SEGMENT-DICT_KMER; i++){
+      aCount[dict_hash(&p->a[i])] = 0;
+    }
+  }
+  memmove(aDict, &aDict[DICT_SIZE-nDict], nDict);
+  sqlite3_free(aCount);
+  sqlite3_free(aLast);
+  sqlite3_free(aScore);
+  sqlite3_free(aHeap);
+  if( nDict==0 ){
+    sqlite3_free(aDict);
+    aDict = 0;
+  }
+  *pnDict = nDict;
+  return aDict;
+}
+
+/*
+** Train a zlib dictionary on a sample of the files to be added, store it
+** in the archive and install it.  Do nothing if the archive already has
+** a dictionary, since content in the archive might depend on it.
+*/
+static void dict_create(const char **azFiles, int nFiles, int verboseFlag){
+  DictSample x;
+  sqlite3_stmt *pIns = 0;
+  char *aDict;
+  int nDict;
+  int i;
+
+  if( zlibDict ) return;
+  memset(&x, 0, sizeof(x));
+  x.a = sqlite3_malloc( DICT_SAMPLE );
+  if( x.a==0 ) errorMsg("Out of memory\n");
+  for(i=0; i<nFiles; i++) dict_sample(&x, azFiles[i], 0);
+  aDict = dict_train(&x, &nDict);
+  if( verboseFlag ){
+    printf("dictionary: %d bytes from %d files (%d bytes)\n",
+           nDict, x.nFile, x.n);
+  }
+  sqlite3_free(x.a);
+  sqlite3_free(x.aEnd);
+  if( aDict==0 ) return;
+  zlib_set_dict(aDict, nDict);
+  if( sqlite3_exec(db, zDictSchema, 0, 0, 0)
+   || sqlite3_prepare_v2(db, "INSERT INTO sqlar_dict(id,data) VALUES(?1,?2)",
+                         -1, &pIns, 0)
+  ){
+    errorMsg("cannot store dictionary: %s\n", sqlite3_errmsg(db));
+  }
+  sqlite3_bind_int64(pIns, 1, zlibDictId);
+  sqlite3_bind_blob(pIns, 2, aDict, nDict, SQLITE_STATIC);
+  if( sqlite3_step(pIns)!=SQLITE_DONE ){
+    errorMsg("cannot store dictionary: %s\n", sqlite3_errmsg(db));
+  }
+  sqlite3_finalize(pIns);
+}
+
+/*
+** Directories that extraction has created or found to exist are kept in
+** a hash table, so that each one is checked only once per run, and files
+** are opened relative to a directory fd with openat() rather than by
+** their full path.  Only the DIRCACHE_NFD most recently opened fds are
+** kept.  An entry whose fd has been closed still records that the
+** directory exists, and is opened again when next needed.
+*/
+#define DIRCACHE_NFD 64
+
+typedef struct DirEntry DirEntry;
+struct DirEntry {
+  DirEntry *pNext;       /* Next entry in the same hash bucket */
+  int fd;                /* The open directory, or -1 */
+  int nName;             /* Length of zName */
+  char zName[1];         /* Path of the directory.  Extra space as needed */
+};
+static struct {
+  DirEntry **aHash;      /* Hash table of known directories */
+  unsigned nHash;        /* Number of buckets in aHash[] */
+  unsigned nEntry;       /* Number of entries in aHash[] */
+  DirEntry *aFd[DIRCACHE_NFD];  /* Entries with an open fd */
+  unsigned iFd;          /* Slot of aFd[] to reuse next */
+} dirCache;
+
+/*
+** Hash the n bytes of a directory name
+*/
+static unsigned dir_hash(const char *z, int n){
+  unsigned h = 0;
+  while( n-- > 0 ){ h = (h<<3) ^ h ^ (unsigned char)z[0]; z++; }
+  return h;
+}
+
+/*
+** Return the entry for the directory named by the n bytes at z[], adding
+** it with no open fd if it is not already known.  *pIsNew is set to true
+** if it was added.
+*/
+static DirEntry *dir_entry(const char *z, int n, int *pIsNew){
+  DirEntry *p;
+  unsigned h = dir_hash(z, n);
+  if( dirCache.nHash ){
+    for(p=dirCache.aHash[h % dirCache.nHash]; p; p=p->pNext){
+      if( p->nName==n && memcmp(p->zName, z, n)==0 ){
+        *pIsNew = 0;
+        return p;
+      }
+    }
+  }
+  if( dirCache.nEntry>=dirCache.nHash ){
+    unsigned nNew = dirCache.nHash ? dirCache.nHash*2 : 1024;
+    DirEntry **aNew = calloc(nNew, sizeof(DirEntry*));
+    unsigned i;
+    if( aNew==0 ) errorMsg("Out of memory\n");
+    for(i=0; i<dirCache.nHash; i++){
+      while( (p = dirCache.aHash[i])!=0 ){
+        unsigned k = dir_hash(p->zName, p->nName) % nNew;
+        dirCache.aHash[i] = p->pNext;
+        p->pNext = aNew[k];
+        aNew[k] = p;
+      }
+    }
+    free(dirCache.aHash);
+    dirCache.aHash = aNew;
+    dirCache.nHash = nNew;
+  }
+  p = malloc( sizeof(*p) + n );
+  if( p==0 ) errorMsg("Out of memory\n");
+  p->fd = -1;
+  p->nName = n;
+  memcpy(p->zName, z, n);
+  p->zName[n] = 0;
+  p->pNext = dirCache.aHash[h % dirCache.nHash];
+  dirCache.aHash[h % dirCache.nHash] = p;
+  dirCache.nEntry++;
+  *pIsNew = 1;
+  return p;
+}
+
+/*
+** Return the length of the parent directory of the first n bytes of
+** zPath, without trailing slashes.  Set *piLeaf to the offset of the
+** last component.  Return 0 if there is no parent, or if the parent is
+** the root directory, in which case the last component is taken to be
+** the whole of zPath.
+*/
+static int dir_parent(const char *zPath, int n, int *piLeaf){
+  int j = n, k;
+  while( j>0 && zPath[j-1]!='/' ) j--;
+  k = j;
+  while( k>0 && zPath[k-1]=='/' ) k--;
+  *piLeaf = k>0 ? j : 0;
+  return k;
+}
+
+/*
+** Return an open fd for the directory named by the first n bytes of
+** zPath, creating it and its parents if they do not exist.  The fd
+** belongs to the cache, and stays valid only until the next call.
+*/
+static int dir_open(const char *zPath, int n){
+  DirEntry *p;
+  int isNew, iLeaf, nParent, fdParent, fd;
+  p = dir_entry(zPath, n, &isNew);
+  if( p->fd>=0 ) return p->fd;
+  nParent = dir_parent(zPath, n, &iLeaf);
+  fdParent = nParent>0 ? dir_open(zPath, nParent) : AT_FDCWD;
+  if( isNew && mkdirat(fdParent, &p->zName[iLeaf], 0777) && errno!=EEXIST ){
+    errorMsg("cannot create directory: %s\n", p->zName);
+  }
+  fd = openat(fdParent, &p->zName[iLeaf], O_RDONLY|O_DIRECTORY);
+  if( fd<0 ) errorMsg("cannot create directory: %s\n", p->zName);
+  if( dirCache.aFd[dirCache.iFd] ){
+    close(dirCache.aFd[dirCache.iFd]->fd);
+    dirCache.aFd[dirCache.iFd]->fd = -1;
+  }
+  dirCache.aFd[dirCache.iFd] = p;
+  dirCache.iFd = (dirCache.iFd+1) % DIRCACHE_NFD;
+  p->fd = fd;
+  return fd;
+}
+
+/*
+** Record that directory zName has just been created
+*/
+static void dir_created(const char *zName){
+  int isNew;
+  dir_entry(zName, (int)strlen(zName), &isNew);
+}
+
+/*
+** Make sure the parent directory for zName exists.  Create it if it does
+** not exist.  Return a directory fd, valid until the next call, that the
+** name in *pzLeaf is relative to.
+*/
+static int make_parent_directory(const char *zName, const char **pzLeaf){
+  int iLeaf;
+  int n = dir_parent(zName, (int)strlen(zName), &iLeaf);
+  *pzLeaf = &zName[iLeaf];
+  return n>0 ? dir_open(zName, n) : AT_FDCWD;
+}
+
+/*
+** Decompress nCompr bytes of content from pCompr, which decompress to
+** sz bytes, into pOut[].  The codec is recognized from the content
+** itself.
+*/
+static void uncompress_into(
+  const char *zFilename,   /* Name of the file, for error messages */
+  sqlite3_int64 sz,        /* Size of the content after decompression */
+  const char *pCompr,      /* Compressed content */
+  int nCompr,              /* Size of compressed content */
+  char *pOut               /* Write sz bytes here */
+){
+  size_t nOut = sz;
+  StageTimer t;
+  const Codec *pCodec = codec_detect(pCompr, nCompr);
+  if( pCodec==0 ){
+    errorMsg("unknown compression method for %s\n", zFilename);
+  }
+  if( pCodec->xUncompress==0 ){
+    errorMsg("%s needs the %s codec, which is not compiled in\n",
+             zFilename, pCodec->zName);
+  }
+  stats_begin(&t);
+  if( pCodec->xUncompress(pCompr, nCompr, pOut, &nOut) || nOut!=sz ){
+    errorMsg("uncompress failed for %s\n", zFilename);
+  }
+  stats_end(&t, STAGE_INFLATE);
+}
+
+/*
+** Decompress nCompr bytes of content from pCompr, which decompress to
+** sz bytes, into a new buffer obtained from sqlite3_malloc64().
+*/
+static char *uncompress_content(
+  const char *zFilename,   /* Name of the file, for error messages */
+  sqlite3_int64 sz,        /* Size of the content after decompression */
+  const char *pCompr,      /* Compressed content */
+  int nCompr               /* Size of compressed content */
+){
+  char *pOut = sqlite3_malloc64( sz+1 );
+  if( pOut==0 ) errorMsg("cannot allocate %lld bytes\n", sz+1);
+  uncompress_into(zFilename, sz, pCompr, nCompr, pOut);
+  return pOut;
+}
+
+/*
+** Extend the open file fd, which must be empty and open for reading and
+** writing, to sz bytes and map it into memory, so that content can be
+** decompressed straight into the file with no copy through a heap
+** buffer.  The kernel writes the pages back after munmap().
+**
+** Return NULL, leaving the caller to write the file itself, if sz is
+** less than STREAM_SIZE, if --pwrite was used, or if the file cannot be
+** mapped.  Writes through a map are slow on some network filesystems.
+*/
+static char *map_output(int fd, sqlite3_int64 sz){
+  void *p;
+  if( pwriteFlag || sz<STREAM_SIZE || (sqlite3_uint64)sz>(size_t)-1 ){
+    return 0;
+  }
+  /* Allocate the blocks now, so that a full disk is an error here and
+  ** not a SIGBUS when the map is written */
+  if( posix_fallocate(fd, 0, sz) ) return 0;
+  p = mmap(0, sz, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  return p==MAP_FAILED ? 0 : p;
+}
+
+/*
+** Write n bytes from a[] into the open file out
+*/
+static void write_out(
+  FILE *out,               /* Write to this file */
+  const char *zFilename,   /* Name of the file, for error messages */
+  const char *a,           /* Content to write */
+  sqlite3_int64 n          /* Number of bytes in a[] */
+){
+  StageTimer t;
+  stats_begin(&t);
+  if( n>0 && fwrite(a, n, 1, out)!=1 ){
+    errorMsg("failed to write: %s\n", zFilename);
+  }
+  stats_end(&t, STAGE_WRITE);
+}
+
+/*
+** Write nCompr bytes of content from pCompr into the open file out.
+** The content decompresses to sz bytes.  If sz==nCompr that means the
+** content is not compressed.  If isWhole is true, the content is the
+** whole file and out is still empty, so it may be decompressed straight
+** into a map of the file.
+*/
+static void write_content(
+  FILE *out,               /* Write to this file */
+  const char *zFilename,   /* Name of the file, for error messages */
+  sqlite3_int64 sz,        /* Size of the content after decompression */
+  const char *pCompr,      /* Content (usually compressed) */
+  int nCompr,              /* Size of content (prior to decompression) */
+  int isWhole              /* True if this is the whole file */
+){
+  char *pOut;
+  if( sz==nCompr ){
+    write_out(out, zFilename, pCompr, sz);
+  }else if( isWhole && (pOut = map_output(fileno(out), sz))!=0 ){
+    StageTimer t;
+    uncompress_into(zFilename, sz, pCompr, nCompr, pOut);
+    stats_begin(&t);
+    munmap(pOut, sz);
+    stats_end(&t, STAGE_WRITE);
+  }else{
+    pOut = uncompress_content(zFilename, sz, pCompr, nCompr);
+    write_out(out, zFilename, pOut, sz);
+    sqlite3_free(pOut);
+  }
+}
+
+/*
+** Write n bytes from a[] at offset iOfst of the open file fd.  Return 0
+** on success.
+*/
+static int write_at(int fd, const char *a, size_t n, off_t iOfst){
+  while( n>0 ){
+    ssize_t k = pwrite(fd, a, n, iOfst);
+    if( k<0 && errno==EINTR ) continue;
+    if( k<=0 ) return 1;
+    a += k;
+    n -= k;
+    iOfst += k;
+  }
+  return 0;
+}
+
+/*
+** Copy the nByte bytes of the stored BLOB pBlob into the open file fd,
+** STORED_WINDOW bytes at a time.  Each slice goes straight from
+** sqlite3_blob_read() into a page-aligned buffer and out with pwrite().
+** With --mmap, sqlite3_blob_read() copies from the page cache rather
+** than calling read().
+*/
+static void write_stored(
+  int fd,                  /* Write to this file, from offset 0 */
+  const char *zFilename,   /* Name of the file, for error messages */
+  sqlite3_blob *pBlob,     /* The BLOB to copy */
+  int nByte                /* Size of the BLOB */
+){
+  static void *aBuf = 0;
+  int iOfst;
+  StageTimer t;
+  if( aBuf==0 && posix_memalign(&aBuf, 4096, STORED_WINDOW) ){
+    errorMsg("Out of memory\n");
+  }
+  for(iOfst=0; iOfst<nByte; iOfst+=STORED_WINDOW){
+    int n = nByte - iOfst;
+    if( n>STORED_WINDOW ) n = STORED_WINDOW;
+    stats_begin(&t);
+    if( sqlite3_blob_read(pBlob, aBuf, n, iOfst) ){
+      errorMsg("cannot read BLOB for %s: %s\n", zFilename, sqlite3_errmsg(db));
+    }
+    stats_end(&t, STAGE_QUERY);
+    stats_begin(&t);
+    if( write_at(fd, aBuf, n, iOfst) ){
+      errorMsg("failed to write: %s\n", zFilename);
+    }
+    stats_end(&t, STAGE_WRITE);
+  }
+}
+
+/*
+** Write the content of a large BLOB from row iRowid of the sqlar table
+** into the open file out.  A stored BLOB is copied by write_stored().
+** Otherwise the BLOB is read and decompressed incrementally,
+** STREAM_WINDOW bytes at a time, and inflated straight into the file
+** if map_output() can map it.  sqlar only writes large
+** BLOBs using zlib, but if some other codec was used the whole BLOB is
+** loaded into memory and handed to write_content().
+*/
+static void write_blob(
+  FILE *out,               /* Write to this file */
+  const char *zFilename,   /* Name of the file, for error messages */
+  sqlite3_int64 sz,        /* Size of the content after decompression */
+  int nCompr,              /* Size of the BLOB */
+  sqlite3_int64 iRowid     /* Row of the sqlar table that holds the BLOB */
+){
+  static char *aIn = 0;
+  static char *aOut = 0;
+  char *pMap;
+  sqlite3_blob *pBlob;
+  z_stream z;
+  sqlite3_int64 nOut = 0;
+  int iOfst, n;
+  int rc = Z_OK;
+  StageTimer t;
+  if( aIn==0 ){
+    aIn = sqlite3_malloc( STREAM_WINDOW );
+    aOut = sqlite3_malloc( STREAM_WINDOW );
+    if( aIn==0 || aOut==0 ) errorMsg("Out of memory\n");
+  }
+  stats_begin(&t);
+  if( sqlite3_blob_open(db, "main", "sqlar", "data", iRowid, 0, &pBlob) ){
+    errorMsg("cannot open BLOB for %s: %s\n", zFilename, sqlite3_errmsg(db));
+  }
+  if( sz==nCompr ){
+    stats_end(&t, STAGE_QUERY);
+    if( fflush(out) ) errorMsg("failed to write: %s\n", zFilename);
+    write_stored(fileno(out), zFilename, pBlob, nCompr);
+    sqlite3_blob_close(pBlob);
+    return;
+  }
+  n = nCompr<4 ? nCompr : 4;
+  if( sqlite3_blob_read(pBlob, aIn, n, 0) ){
+    errorMsg("cannot read BLOB for %s: %s\n", zFilename, sqlite3_errmsg(db));
+  }
+  if( codec_detect(aIn, n)!=&aCodec[0] ){
+    char *pCompr = sqlite3_malloc( nCompr );
+    if( pCompr==0 ) errorMsg("cannot allocate %d bytes\n", nCompr);
+    if( sqlite3_blob_read(pBlob, pCompr, nCompr, 0) ){
+      errorMsg("cannot read BLOB for %s: %s\n", zFilename, sqlite3_errmsg(db));
+    }
+    sqlite3_blob_close(pBlob);
+    stats_end(&t, STAGE_QUERY);
+    write_content(out, zFilename, sz, pCompr, nCompr, 1);
+    sqlite3_free(pCompr);
+    return;
+  }
+  stats_end(&t, STAGE_QUERY);
+  memset(&z, 0, sizeof(z));
+  if( inflateInit(&z)!=Z_OK ){
+    errorMsg("uncompress failed for %s\n", zFilename);
+  }
+  pMap = map_output(fileno(out), sz);
+  for(iOfst=0; iOfst<nCompr; iOfst+=STREAM_WINDOW){
+    n = nCompr - iOfst;
+    if( n>STREAM_WINDOW ) n = STREAM_WINDOW;
+    stats_begin(&t);
+    if( sqlite3_blob_read(pBlob, aIn, n, iOfst) ){
+      errorMsg("cannot read BLOB for %s: %s\n", zFilename, sqlite3_errmsg(db));
+    }
+    stats_end(&t, STAGE_QUERY);
+    z.next_in = (Bytef*)aIn;
+    z.avail_in = n;
+    do{
+      uInt nAvail = STREAM_WINDOW;
+      size_t nByte;
+      if( pMap ){
+        nAvail = sz-nOut>0x40000000 ? 0x40000000 : (uInt)(sz-nOut);
+        z.next_out = (Bytef*)&pMap[nOut];
+      }else{
+        z.next_out = (Bytef*)aOut;
+      }
+      z.avail_out = nAvail;
+      stats_begin(&t);
+      rc = inflate(&z, Z_NO_FLUSH);
+      stats_end(&t, STAGE_INFLATE);
+      if( rc==Z_BUF_ERROR && z.avail_in==0 ){
+        /* No progress without more input.  Read the next window.  This
+        ** happens when the map is full but the trailer is not yet read */
+        break;
+      }
+      if( rc!=Z_OK && rc!=Z_STREAM_END ){
+        errorMsg("uncompress failed for %s\n", zFilename);
+      }
+      nByte = nAvail - z.avail_out;
+      nOut += nByte;
+      if( nOut>sz ) errorMsg("uncompress failed for %s\n", zFilename);
+      if( pMap==0 ) write_out(out, zFilename, aOut, nByte);
+    }while( z.avail_out==0 && rc!=Z_STREAM_END
+         && (z.avail_in>0 || pMap==0) );
+  }
+  sqlite3_blob_close(pBlob);
+  if( pMap ){
+    stats_begin(&t);
+    munmap(pMap, sz);
+    stats_end(&t, STAGE_WRITE);
+  }
+  inflateEnd(&z);
+  if( rc!=Z_STREAM_END || nOut!=sz ){
+    errorMsg("uncompress failed for %s\n", zFilename);
+  }
+}
+
+/*
+** Write the content of a file that is stored in the sqlar_chunk table
+** into the open file out, one chunk at a time.
+*/
+static void write_chunks(
+  FILE *out,               /* Write to this file */
+  const char *zFilename,   /* Name of the file in the archive */
+  sqlite3_int64 sz         /* Expected size of the file */
+){
+  sqlite3_stmt *p;
+  sqlite3_int64 nOut = 0;
+  StageTimer t;
+  if( !hasChunks ) errorMsg("missing content for %s\n", zFilename);
+  p = db_stmt(&pChunkRead,
+              "SELECT c.sz, coalesce(c.data, t.data)"
+              "  FROM sqlar_chunk c LEFT JOIN sqlar_content t ON t.hash=c.hash"
+              " WHERE c.name=?1 ORDER BY c.off");
+  sqlite3_bind_text(p, 1, zFilename, -1, SQLITE_STATIC);
+  while( 1 ){
+    sqlite3_int64 szChunk;
+    int rc;
+    stats_begin(&t);
+    rc = sqlite3_step(p);
+    stats_end(&t, STAGE_QUERY);
+    if( rc!=SQLITE_ROW ) break;
+    szChunk = sqlite3_column_int64(p, 0);
+    stats.nIn += sqlite3_column_bytes(p, 1);
+    write_content(out, zFilename, szChunk,
+                  (const char*)sqlite3_column_blob(p, 1),
+                  sqlite3_column_bytes(p, 1), 0);
+    nOut += szChunk;
+  }
+  sqlite3_reset(p);
+  if( nOut!=sz ) errorMsg("missing chunks for %s\n", zFilename);
+}
+
+/*
+** The most recently used blocks of a --solid archive, decompressed.
+** Entries are extracted in name order, which is the order in which
+** they were packed, so all members of a block are usually extracted
+** one after another and each block is decompressed only once.  A few
+** blocks are kept for when names from different blocks interleave.
+*/
+#define BLOCK_CACHE 4
+static struct BlockCache {
+  sqlite3_int64 iBlock;    /* Id of the block in the sqlar_block table */
+  sqlite3_int64 sz;        /* Size of a[] in bytes */
+  char *a;                 /* Decompressed content of the block */
+  unsigned iUsed;          /* When this entry was last used */
+} aBlockCache[BLOCK_CACHE];
+static unsigned iBlockClock = 0;
+
+/*
+** Return the cache entry holding block iBlock, loading and
+** decompressing it if necessary.
+*/
+static struct BlockCache *block_load(
+  const char *zFilename,   /* Name of the member, for error messages */
+  sqlite3_int64 iBlock     /* The block wanted */
+){
+  struct BlockCache *pC = &aBlockCache[0];
+  sqlite3_stmt *p;
+  int i, n, rc;
+  StageTimer t;
+  for(i=0; i<BLOCK_CACHE; i++){
+    if( aBlockCache[i].a && aBlockCache[i].iBlock==iBlock ){
+      pC = &aBlockCache[i];
+      pC->iUsed = ++iBlockClock;
+      return pC;
+    }
+    if( aBlockCache[i].iUsed<pC->iUsed ) pC = &aBlockCache[i];
+  }
+  p = db_stmt(&pBlockRead, "SELECT sz, data FROM sqlar_block WHERE id=?1");
+  sqlite3_bind_int64(p, 1, iBlock);
+  stats_begin(&t);
+  rc = sqlite3_step(p);
+  stats_end(&t, STAGE_QUERY);
+  if( rc!=SQLITE_ROW ){
+    errorMsg("missing block %lld for %s\n", iBlock, zFilename);
+  }
+  sqlite3_free(pC->a);
+  pC->iBlock = iBlock;
+  pC->sz = sqlite3_column_int64(p, 0);
+  n = sqlite3_column_bytes(p, 1);
+  stats.nIn += n;
+  if( n==pC->sz ){
+    pC->a = sqlite3_malloc64( pC->sz+1 );
+    if( pC->a==0 ) errorMsg("cannot allocate %lld bytes\n", pC->sz+1);
+    memcpy(pC->a, sqlite3_column_blob(p, 1), n);
+  }else{
+    pC->a = uncompress_content(zFilename, pC->sz,
+                               sqlite3_column_blob(p, 1), n);
+  }
+  sqlite3_reset(p);
+  pC->iUsed = ++iBlockClock;
+  return pC;
+}
+
+/*
+** If zFilename is a member of a --solid block, write its sz bytes of
+** content into the open file out and return 1.  Return 0 if it is not.
+*/
+static int solid_write(
+  FILE *out,               /* Write to this file */
+  const char *zFilename,   /* Name of the file in the archive */
+  sqlite3_int64 sz         /* Size of the file */
+){
+  sqlite3_stmt *p;
+  struct BlockCache *pC;
+  sqlite3_int64 iOfst;
+  StageTimer t;
+  int rc;
+  if( !hasSolid ) return 0;
+  p = db_stmt(&pSolidRead,
+              "SELECT block, off FROM sqlar_solid WHERE name=?1");
+  sqlite3_bind_text(p, 1, zFilename, -1, SQLITE_STATIC);
+  stats_begin(&t);
+  rc = sqlite3_step(p);
+  stats_end(&t, STAGE_QUERY);
+  if( rc!=SQLITE_ROW ){
+    sqlite3_reset(p);
+    return 0;
+  }
+  pC = block_load(zFilename, sqlite3_column_int64(p, 0));
+  iOfst = sqlite3_column_int64(p, 1);
+  sqlite3_reset(p);
+  if( iOfst<0 || iOfst+sz>pC->sz ){
+    errorMsg("corrupt block %lld for %s\n", pC->iBlock, zFilename);
+  }
+  write_out(out, zFilename, pC->a+iOfst, sz);
+  return 1;
+}
+
+/*
+** Write a file or a directory.
+**
+** Create any missing directories leading up to the given file or directory.
+** Also set the access mode and the modification time.
+**
+** If sz>nCompr that means that the content is compressed and needs to be
+** decompressed before writing.  nCompr<0 means that sqlar.data is NULL:
+** the entry is a directory if sz==0 or else the content is stored in
+** a --solid block or in the sqlar_chunk table.  If pCompr is NULL for a
+** BLOB, the BLOB is too big to hold in memory and is read from row iRowid
+** incrementally.
+*/
+static void write_file(
+  const char *zFilename,   /* Store content in this file */
+  int iMode,               /* The unix-style access mode */
+  sqlite3_int64 mtime,     /* Modification time */
+  sqlite3_int64 sz,        /* Size of file as stored on disk */
+  const char *pCompr,      /* Content (usually compressed) */
+  int nCompr,              /* Size of content (prior to decompression) */
+  sqlite3_int64 iRowid     /* Row of the sqlar table for this file */
+){
+  int rc, fd, dirfd;
+  const char *zLeaf;
+  FILE *out = 0;
+  StageTimer t;
+  stats_begin(&t);
+  dirfd = make_parent_directory(zFilename, &zLeaf);
+  if( nCompr<0 && sz==0 ){
+    rc = mkdirat(dirfd, zLeaf, iMode);
+    if( rc && errno==EEXIST ){
+      /* Older -u runs could store a directory after its own files, so
+      ** it may already have been made as the parent of one of them. */
+      struct stat x;
+      if( fstatat(dirfd, zLeaf, &x, 0)==0 && S_ISDIR(x.st_mode) ){
+        rc = fchmodat(dirfd, zLeaf, iMode&0777, 0);
+      }
+    }
+    if( rc ) errorMsg("cannot make directory: %s\n", zFilename);
+    dir_created(zFilename);
+    stats_end(&t, STAGE_MKDIR);
+    return;
+  }
+  stats_end(&t, STAGE_MKDIR);
+  stats_begin(&t);
+  fd = openat(dirfd, zLeaf, O_RDWR|O_CREAT|O_TRUNC, 0666);
+  if( fd>=0 && (out = fdopen(fd, "wb"))==0 ) close(fd);
+  if( out==0 ) errorMsg("cannot open for writing: %s\n", zFilename);
+  stats_end(&t, STAGE_WRITE);
+  if( nCompr<0 ){
+    if( !solid_write(out, zFilename, sz) ) write_chunks(out, zFilename, sz);
+  }else if( pCompr ){
+    write_content(out, zFilename, sz, pCompr, nCompr, 1);
+  }else if( nCompr>0 ){
+    write_blob(out, zFilename, sz, nCompr, iRowid);
+  }
+  stats_begin(&t);
+  rc = fchmod(fileno(out), iMode&0777);
+  if( rc ) errorMsg("cannot change mode to %03o: %s\n", iMode, zFilename);
+  if( fclose(out) ) errorMsg("failed to write: %s\n", zFilename);
+  stats_end(&t, STAGE_WRITE);
+}
+
+/*
+** Error out if there are any issues with the given filename
+*/
+static void check_filename(const char *z){
+  if( strncmp(z, "../", 3)==0 || sqlite3_strglob("*/../*", z)==0 ){
+    errorMsg("Filename with '..' in its path: %s\n", z);
+  }
+  if( sqlite3_strglob("*\\*", z)==0 ){
+    errorMsg("Filename with '\\' in its name: %s\n", z);
+  }
+}
+
+/*
+** Parallel extraction.
+**
+** With -j N, "sqlar -x" decompresses and writes files on N worker
+** threads.  The main thread is still the only thread that talks to
+** SQLite.  It steps through the rows and makes the same checks on each
+** name as before.  It creates all directories itself, in order, so the
+** workers never race to create a parent directory.  Then it copies the
+** content of each file into an ExtractJob.  A file stored in chunks
+** becomes one job for each chunk, and each chunk is written at its own
+** offset with pwrite().  A member of a --solid block is copied out of
+** the decompressed block.  The workers decompress the content and
+** write it.
+**
+** Copies of content wait in the ring of jobs.  At most EXTRACT_BUDGET
+** bytes of them are held at once.  A BLOB of more than a quarter of
+** that is written by the main thread as before.
+**
+** Workers must not call into SQLite nor call errorMsg().  Errors are
+** recorded in the job and reported by the main thread when it retires
+** the job.
+*/
+#define EXTRACT_BUDGET  (256*1024*1024)
+
+/*
+** A file being written by one or more jobs.  The last job to finish
+** sets its mode.
+*/
+typedef struct ExtractFile ExtractFile;
+struct ExtractFile {
+  char *zName;           /* Name of the file.  From malloc() */
+  int iMode;             /* Mode to set once all content is written */
+  int isCreated;         /* The main thread has already created the file */
+  int nRef;              /* Jobs not yet finished, plus 1 for the reader */
+};
+
+typedef struct ExtractJob ExtractJob;
+struct ExtractJob {
+  ExtractFile *pFile;    /* The file to write */
+  sqlite3_int64 iOfst;   /* Offset of this content within the file */
+  sqlite3_int64 sz;      /* Size of the content after decompression */
+  char *pData;           /* Content, as stored.  From malloc() */
+  int nData;             /* Size of pData.  Same as sz if not compressed */
+  int eState;            /* JOB_NEW, JOB_BUSY or JOB_DONE */
+  char *zErr;            /* Error message, or NULL.  From malloc() */
+  sqlite3_int64 nsInflate, nsInflateCpu;  /* Times for --stats */
+  sqlite3_int64 nsWrite, nsWriteCpu;
+};
+
+static struct Extract {
+  int nWorker;              /* Number of worker threads, or 0 */
+  pthread_t *aThread;       /* The worker threads */
+  sqlite3_int64 nHeld;      /* Bytes of content in the ring.  Main only */
+  pthread_mutex_t mutex;    /* Protects all fields that follow */
+  pthread_cond_t cvWork;    /* Signaled when a new job is queued */
+  pthread_cond_t cvDone;    /* Signaled when a worker finishes a job */
+  ExtractJob *aJob;         /* Ring buffer of nJob pending jobs */
+  unsigned nJob;            /* Number of slots in aJob[] */
+  unsigned iRetire;         /* Next job to be retired.  Main thread only */
+  unsigned iTake;           /* Next job to be claimed by a worker */
+  unsigned iAdd;            /* Next job to be added */
+  int shutdown;             /* Tell the workers to exit */
+} ex;
+
+/*
+** Record an error message against an extract job
+*/
+static void extract_error(ExtractJob *p, const char *zFormat, ...){
+  va_list ap;
+  va_start(ap, zFormat);
+  job_verror(&p->zErr, zFormat, ap);
+  va_end(ap);
+}
+
+/*
+** Decompress large zlib content from p->pData into the file fd, one
+** STREAM_WINDOW at a time, so that the whole file is never in memory.
+*/
+static void extract_inflate_stream(ExtractJob *p, int fd, char *aOut){
+  const char *zName = p->pFile->zName;
+  sqlite3_int64 nOut = 0;
+  sqlite3_int64 t = 0, tCpu = 0;
+  z_stream z;
+  int rc;
+  memset(&z, 0, sizeof(z));
+  if( inflateInit(&z)!=Z_OK ){
+    extract_error(p, "uncompress failed for %s\n", zName);
+    return;
+  }
+  z.next_in = (Bytef*)p->pData;
+  z.avail_in = p->nData;
+  do{
+    size_t nByte;
+    z.next_out = (Bytef*)aOut;
+    z.avail_out = STREAM_WINDOW;
+    if( stats.statsFlag ){ t = wall_ns(); tCpu = thread_ns(); }
+    rc = inflate(&z, Z_NO_FLUSH);
+    if( stats.statsFlag ){
+      p->nsInflate += wall_ns() - t;
+      p->nsInflateCpu += thread_ns() - tCpu;
+    }
+    if( rc!=Z_OK && rc!=Z_STREAM_END ) break;
+    nByte = STREAM_WINDOW - z.avail_out;
+    if( nOut+nByte>p->sz ) break;
+    if( stats.statsFlag ){ t = wall_ns(); tCpu = thread_ns(); }
+    if( write_at(fd, aOut, nByte, p->iOfst+nOut) ){
+      extract_error(p, "failed to write: %s\n", zName);
+      break;
+    }
+    if( stats.statsFlag ){
+      p->nsWrite += wall_ns() - t;
+      p->nsWriteCpu += thread_ns() - tCpu;
+    }
+    nOut += nByte;
+  }while( rc!=Z_STREAM_END );
+  inflateEnd(&z);
+  if( p->zErr==0 && (rc!=Z_STREAM_END || nOut!=p->sz) ){
+    extract_error(p, "uncompress failed for %s\n", zName);
+  }
+}
+
+/*
+** Decompress the content of job p, if it is compressed, and write it.
+** A job for a whole file is decompressed straight into the file if
+** map_output() can map it.  aOut[] is a buffer of STREAM_WINDOW bytes
+** owned by the calling thread.
+*/
+static void extract_process(ExtractJob *p, char *aOut){
+  const char *zName = p->pFile->zName;
+  char *pOut = p->pData;
+  char *pMap = 0;
+  const Codec *pCodec = 0;
+  sqlite3_int64 t = 0, tCpu = 0;
+  int fd;
+  if( stats.statsFlag ){ t = wall_ns(); tCpu = thread_ns(); }
+  fd = open(zName, p->pFile->isCreated ? O_RDWR : O_RDWR|O_CREAT|O_TRUNC,
+            0666);
+  if( stats.statsFlag ){
+    p->nsWrite += wall_ns() - t;
+    p->nsWriteCpu += thread_ns() - tCpu;
+  }
+  if( fd<0 ){
+    extract_error(p, "cannot open for writing: %s\n", zName);
+    return;
+  }
+  if( p->sz!=p->nData ){
+    size_t nOut = p->sz;
+    pCodec = codec_detect(p->pData, p->nData);
+    if( pCodec==0 ){
+      extract_error(p, "unknown compression method for %s\n", zName);
+    }else if( pCodec->xUncompress==0 ){
+      extract_error(p, "%s needs the %s codec, which is not compiled in\n",
+                    zName, pCodec->zName);
+    }else if( !p->pFile->isCreated && (pMap = map_output(fd, p->sz))!=0 ){
+      /* This job is the whole file.  Decompress straight into it. */
+      pOut = pMap;
+    }else if( pCodec==&aCodec[0] && p->sz>STREAM_SIZE ){
+      extract_inflate_stream(p, fd, aOut);
+    }else if( (pOut = malloc( p->sz+1 ))==0 ){
+      extract_error(p, "cannot allocate %lld bytes\n", p->sz+1);
+    }
+    if( pOut!=0 && pOut!=p->pData ){
+      if( stats.statsFlag ){ t = wall_ns(); tCpu = thread_ns(); }
+      if( pCodec->xUncompress(p->pData, p->nData, pOut, &nOut)
+       || nOut!=p->sz
+      ){
+        extract_error(p, "uncompress failed for %s\n", zName);
+      }
+      if( stats.statsFlag ){
+        p->nsInflate += wall_ns() - t;
+        p->nsInflateCpu += thread_ns() - tCpu;
+      }
+    }
+  }
+  if( stats.statsFlag ){ t = wall_ns(); tCpu = thread_ns(); }
+  if( pMap ){
+    munmap(pMap, p->sz);
+  }else if( p->zErr==0 && (pCodec==0 || pOut!=p->pData) ){
+    if( write_at(fd, pOut, p->sz, p->iOfst) ){
+      extract_error(p, "failed to write: %s\n", zName);
+    }
+  }
+  if( pOut!=p->pData && pOut!=pMap ) free(pOut);
+  if( close(fd) && p->zErr==0 ){
+    extract_error(p, "failed to write: %s\n", zName);
+  }
+  if( stats.statsFlag ){
+    p->nsWrite += wall_ns() - t;
+    p->nsWriteCpu += thread_ns() - tCpu;
+  }
+}
+
+/*
+** Drop one reference to pFile, with ex.mutex held.  When the last one
+** is gone, set the mode of the file and free pFile.  p is the job that
+** held the reference, or NULL for the main thread.
+*/
+static void extract_release(ExtractFile *pFile, ExtractJob *p){
+  if( --pFile->nRef>0 ) return;
+  if( chmod(pFile->zName, pFile->iMode&0777) ){
+    if( p==0 ){
+      errorMsg("cannot change mode to %03o: %s\n", pFile->iMode,
+               pFile->zName);
+    }else if( p->zErr==0 ){
+      extract_error(p, "cannot change mode to %03o: %s\n", pFile->iMode,
+                    pFile->zName);
+    }
+  }
+  free(pFile->zName);
+  free(pFile);
+}
+
+/*
+** Main routine for extract worker threads
+*/
+static void *extract_worker(void *pArg){
+  char *aOut = malloc( STREAM_WINDOW );
+  ExtractJob *p;
+  (void)pArg;
+  pthread_mutex_lock(&ex.mutex);
+  while( 1 ){
+    while( ex.iTake==ex.iAdd && !ex.shutdown ){
+      pthread_cond_wait(&ex.cvWork, &ex.mutex);
+    }
+    if( ex.iTake==ex.iAdd ) break;
+    p = &ex.aJob[(ex.iTake++) % ex.nJob];
+    p->eState = JOB_BUSY;
+    pthread_mutex_unlock(&ex.mutex);
+    if( aOut==0 ){
+      extract_error(p, "Out of memory\n");
+    }else{
+      extract_process(p, aOut);
+    }
+    pthread_mutex_lock(&ex.mutex);
+    extract_release(p->pFile, p);
+    p->pFile = 0;
+    p->eState = JOB_DONE;
+    pthread_cond_broadcast(&ex.cvDone);
+  }
+  pthread_mutex_unlock(&ex.mutex);
+  free(aOut);
+  return 0;
+}
+
+/*
+** Start nWorker extract worker threads.  With one or none, files are
+** written by the main thread.
+*/
+static void extract_start(int nWorker){
+  int i;
+  if( nWorker<=1 ) return;
+  ex.nWorker = nWorker;
+  ex.nJob = 4*nWorker;
+  ex.aJob = calloc(ex.nJob, sizeof(ExtractJob));
+  ex.aThread = calloc(nWorker, sizeof(pthread_t));
+  if( ex.aJob==0 || ex.aThread==0 ) errorMsg("Out of memory\n");
+  pthread_mutex_init(&ex.mutex, 0);
+  pthread_cond_init(&ex.cvWork, 0);
+  pthread_cond_init(&ex.cvDone, 0);
+  for(i=0; i<nWorker; i++){
+    if( pthread_create(&ex.aThread[i], 0, extract_worker, 0) ){
+      errorMsg("cannot start worker thread\n");
+    }
+  }
+}
+
+/*
+** Wait for the oldest job to finish.  Report its error, if any, and add
+** its times to the --stats totals.
+*/
+static void extract_retire(void){
+  ExtractJob *p = &ex.aJob[ex.iRetire % ex.nJob];
+  pthread_mutex_lock(&ex.mutex);
+  while( p->eState!=JOB_DONE ){
+    pthread_cond_wait(&ex.cvDone, &ex.mutex);
+  }
+  pthread_mutex_unlock(&ex.mutex);
+  if( p->zErr ) errorMsg("%s", p->zErr);
+  stats.aWall[STAGE_INFLATE] += p->nsInflate;
+  stats.aCpu[STAGE_INFLATE] += p->nsInflateCpu;
+  stats.aWall[STAGE_WRITE] += p->nsWrite;
+  stats.aCpu[STAGE_WRITE] += p->nsWriteCpu;
+  ex.nHeld -= p->nData;
+  free(p->pData);
+  memset(p, 0, sizeof(*p));
+  ex.iRetire++;
+}
+
+/*
+** Return a copy of the n bytes at a[], in memory from malloc()
+*/
+static char *extract_copy(const void *a, int n){
+  char *p;
+  if( n<=0 ) return 0;
+  p = malloc( n );
+  if( p==0 ) errorMsg("cannot allocate %d bytes\n", n);
+  memcpy(p, a, n);
+  return p;
+}
+
+/*
+** Queue a job to write content that decompresses to sz bytes at offset
+** iOfst of pFile.  pData holds nData bytes of content, in memory from
+** malloc() that becomes the property of the job.
+*/
+static void extract_submit(
+  ExtractFile *pFile,      /* The file to write */
+  sqlite3_int64 iOfst,     /* Where the content goes in the file */
+  sqlite3_int64 sz,        /* Size of the content after decompression */
+  char *pData,             /* Content, as stored */
+  int nData                /* Size of pData */
+){
+  ExtractJob *p;
+  while( ex.iAdd - ex.iRetire>=ex.nJob
+      || (ex.iAdd!=ex.iRetire && ex.nHeld+nData>EXTRACT_BUDGET) ){
+    extract_retire();
+  }
+  ex.nHeld += nData;
+  pthread_mutex_lock(&ex.mutex);
+  p = &ex.aJob[ex.iAdd % ex.nJob];
+  p->pFile = pFile;
+  p->iOfst = iOfst;
+  p->sz = sz;
+  p->pData = pData;
+  p->nData = nData;
+  p->eState = JOB_NEW;
+  pFile->nRef++;
+  ex.iAdd++;
+  pthread_cond_signal(&ex.cvWork);
+  pthread_mutex_unlock(&ex.mutex);
+}
+
+/*
+** If pFile is a member of a --solid block, queue a job to write its sz
+** bytes of content and return 1.  Return 0 if it is not.
+*/
+static int extract_solid(ExtractFile *pFile, sqlite3_int64 sz){
+  sqlite3_stmt *p;
+  struct BlockCache *pC;
+  sqlite3_int64 iOfst;
+  StageTimer t;
+  int rc;
+  if( !hasSolid ) return 0;
+  p = db_stmt(&pSolidRead,
+              "SELECT block, off FROM sqlar_solid WHERE name=?1");
+  sqlite3_bind_text(p, 1, pFile->zName, -1, SQLITE_STATIC);
+  stats_begin(&t);
+  rc = sqlite3_step(p);
+  stats_end(&t, STAGE_QUERY);
+  if( rc!=SQLITE_ROW ){
+    sqlite3_reset(p);
+    return 0;
+  }
+  pC = block_load(pFile->zName, sqlite3_column_int64(p, 0));
+  iOfst = sqlite3_column_int64(p, 1);
+  sqlite3_reset(p);
+  if( iOfst<0 || iOfst+sz>pC->sz ){
+    errorMsg("corrupt block %lld for %s\n", pC->iBlock, pFile->zName);
+  }
+  extract_submit(pFile, 0, sz, extract_copy(pC->a+iOfst, (int)sz), (int)sz);
+  return 1;
+}
+
+/*
+** Create pFile, empty, ahead of the jobs that write it piece by piece in
+** any order.
+*/
+static void extract_create(ExtractFile *pFile){
+  StageTimer t;
+  int fd;
+  stats_begin(&t);
+  fd = open(pFile->zName, O_WRONLY|O_CREAT|O_TRUNC, 0666);
+  if( fd<0 ) errorMsg("cannot open for writing: %s\n", pFile->zName);
+  close(fd);
+  stats_end(&t, STAGE_WRITE);
+  pFile->isCreated = 1;
+}
+
+/*
+** Queue a job for each chunk of pFile, which is stored in the
+** sqlar_chunk table.
+*/
+static void extract_chunks(ExtractFile *pFile, sqlite3_int64 sz){
+  sqlite3_stmt *p;
+  sqlite3_int64 nOut = 0;
+  StageTimer t;
+  if( !hasChunks ) errorMsg("missing content for %s\n", pFile->zName);
+  extract_create(pFile);
+  p = db_stmt(&pChunkRead,
+              "SELECT c.sz, coalesce(c.data, t.data)"
+              "  FROM sqlar_chunk c LEFT JOIN sqlar_content t ON t.hash=c.hash"
+              " WHERE c.name=?1 ORDER BY c.off");
+  sqlite3_bind_text(p, 1, pFile->zName, -1, SQLITE_STATIC);
+  while( 1 ){
+    sqlite3_int64 szChunk;
+    int n, rc;
+    stats_begin(&t);
+    rc = sqlite3_step(p);
+    stats_end(&t, STAGE_QUERY);
+    if( rc!=SQLITE_ROW ) break;
+    szChunk = sqlite3_column_int64(p, 0);
+    n = sqlite3_column_bytes(p, 1);
+    stats.nIn += n;
+    extract_submit(pFile, nOut, szChunk,
+                   extract_copy(sqlite3_column_blob(p, 1), n), n);
+    nOut += szChunk;
+  }
+  sqlite3_reset(p);
+  if( nOut!=sz ) errorMsg("missing chunks for %s\n", pFile->zName);
+}
+
+/*
+** Like write_file(), but hand the decompressing and writing of the
+** content to the extract workers.  Directories, and BLOBs too large to
+** copy into a job, are still written by write_file().
+*/
+static void extract_file(
+  const char *zFilename,   /* Store content in this file */
+  int iMode,               /* The unix-style access mode */
+  sqlite3_int64 mtime,     /* Modification time */
+  sqlite3_int64 sz,        /* Size of file as stored on disk */
+  const char *pCompr,      /* Content (usually compressed) */
+  int nCompr,              /* Size of content (prior to decompression) */
+  sqlite3_int64 iRowid     /* Row of the sqlar table for this file */
+){
+  ExtractFile *pFile;
+  const char *zLeaf;
+  StageTimer t;
+  if( (nCompr<0 && sz==0)
+   || (pCompr==0 && sz!=nCompr && nCompr>EXTRACT_BUDGET/4)
+  ){
+    write_file(zFilename, iMode, mtime, sz, pCompr, nCompr, iRowid);
+    return;
+  }
+  stats_begin(&t);
+  make_parent_directory(zFilename, &zLeaf);
+  stats_end(&t, STAGE_MKDIR);
+  pFile = calloc(1, sizeof(*pFile));
+  if( pFile==0 || (pFile->zName = strdup(zFilename))==0 ){
+    errorMsg("Out of memory\n");
+  }
+  pFile->iMode = iMode;
+  pFile->nRef = 1;
+  if( nCompr<0 ){
+    if( !extract_solid(pFile, sz) ) extract_chunks(pFile, sz);
+  }else if( pCompr || nCompr==0 ){
+    extract_submit(pFile, 0, sz, extract_copy(pCompr, nCompr), nCompr);
+  }else{
+    /* A large BLOB that the query did not load.  If it is stored, it is
+    ** copied in slices of STORED_WINDOW, one job each. */
+    sqlite3_blob *pBlob;
+    int iOfst, n;
+    stats_begin(&t);
+    if( sqlite3_blob_open(db, "main", "sqlar", "data", iRowid, 0, &pBlob) ){
+      errorMsg("cannot open BLOB for %s: %s\n", zFilename, sqlite3_errmsg(db));
+    }
+    stats_end(&t, STAGE_QUERY);
+    if( sz==nCompr ) extract_create(pFile);
+    for(iOfst=0; iOfst<nCompr; iOfst+=n){
+      char *pData;
+      n = nCompr - iOfst;
+      if( sz==nCompr && n>STORED_WINDOW ) n = STORED_WINDOW;
+      pData = malloc( n );
+      if( pData==0 ) errorMsg("cannot allocate %d bytes\n", n);
+      stats_begin(&t);
+      if( sqlite3_blob_read(pBlob, pData, n, iOfst) ){
+        errorMsg("cannot read BLOB for %s: %s\n",
+                 zFilename, sqlite3_errmsg(db));
+      }
+      stats_end(&t, STAGE_QUERY);
+      extract_submit(pFile, iOfst, sz==nCompr ? n : sz, pData, n);
+    }
+    sqlite3_blob_close(pBlob);
+  }
+  pthread_mutex_lock(&ex.mutex);
+  extract_release(pFile, 0);
+  pthread_mutex_unlock(&ex.mutex);
+}
+
+/*
+** Wait for all jobs to finish and stop the extract workers
+*/
+static void extract_finish(void){
+  int i;
+  if( ex.nWorker==0 ) return;
+  while( ex.iRetire!=ex.iAdd ) extract_retire();
+  pthread_mutex_lock(&ex.mutex);
+  ex.shutdown = 1;
+  pthread_cond_broadcast(&ex.cvWork);
+  pthread_mutex_unlock(&ex.mutex);
+  for(i=0; i<ex.nWorker; i++) pthread_join(ex.aThread[i], 0);
+  free(ex.aThread);
+  free(ex.aJob);
+  ex.nWorker = 0;
+}
+
+/*
+** A rule from the --codec option that selects the codec and compression
+** level for the files whose names match zGlob.
+*/
+typedef struct CodecRule CodecRule;
+struct CodecRule {
+  char *zGlob;           /* Files that match.  NULL for the default rule */
+  const Codec *pCodec;   /* Codec to use.  NULL to not compress */
+  int iLevel;            /* Compression level for pCodec */
+};
+
+/*
+** State of the ingest pipeline.
+**
+** The directory walk runs on the main thread and appends an IngestJob
+** for each file it finds to the aJob[] ring buffer.  Worker threads
+** read and compress the content of those files in parallel.  The main
+** thread is also the only thread that talks to SQLite: it removes jobs
+** from the ring in the same order in which they were added and inserts
+** them using pStmt.  Hence the content of the archive and the -v output
+** do not depend on how many workers are used.
+**
+** When nWorker is zero there are no worker threads and each job is
+** processed inline as soon as it is submitted.  There may also be an
+** io_uring reader thread that reads content ahead of the workers.
+*/
+static struct Ingest {
+  int nWorker;              /* Number of worker threads */
+  ZlibEncoder enc;          /* zlib compressor when there are no workers */
+  int verboseFlag;          /* Show each file as it is added */
+  struct CodecRule *aRule;  /* Rules from --codec=GLOB=..., in order */
+  int nRule;                /* Number of entries in aRule[] */
+  struct CodecRule dfltRule;  /* Codec for files that match no rule */
+  int dedupFlag;            /* Store each distinct chunk only once */
+  int cdcFlag;              /* Cut chunks where the content says, for --cdc */
+  sqlite3_int64 szChunk;    /* Store files larger than this in chunks */
+  int szSolid;              /* Block size for --solid, or 0 */
+  IngestJob solid;          /* The JOB_SOLID that is being filled */
+  sqlite3_int64 nChunkCompr;  /* Compressed size of the current JOB_CHUNKED */
+  int nRaw;                 /* Files and chunks that looked incompressible */
+  sqlite3_int64 szRaw;      /* Total size of those files and chunks */
+  sqlite3_int64 szTried;    /* Bytes that were run through a compressor */
+  sqlite3_int64 nsTried;    /* CPU time used to compress szTried bytes */
+  int mxBatchFile;          /* Commit after this many files, or 0 */
+  sqlite3_int64 mxBatchByte;  /* Or after this many bytes, or 0 */
+  int iArg;                 /* FILES argument being walked */
+  int nBatchFile;           /* Files inserted since the last commit */
+  sqlite3_int64 nBatchByte; /* Bytes inserted since the last commit */
+  double mbps;              /* Target ingest rate for --rate, or 0.0 */
+  double mbpsThread;        /* Share of mbps for each compressing thread */
+  struct RateClass *aClass; /* Level controllers for --rate */
+  int nClass;               /* Number of entries in aClass[] */
+  pthread_t *aThread;       /* The worker threads */
+  int nIoDepth;             /* Most reads in flight for the io_uring reader */
+  int nIoJob;               /* Jobs read by the io_uring reader */
+  void *pReader;            /* The io_uring reader, or NULL */
+  pthread_t reader;         /* Thread of the io_uring reader */
+  pthread_mutex_t mutex;    /* Protects all fields that follow */
+  pthread_cond_t cvWork;    /* Signaled when a new job is queued */
+  pthread_cond_t cvDone;    /* Signaled when a worker finishes a job */
+  pthread_cond_t cvIo;      /* Signaled when the reader finishes a job */
+  pthread_cond_t cvRead;    /* Signaled when a new job is queued */
+  unsigned iRead;           /* Next job to be looked at by the reader */
+  IngestJob *aJob;          /* Ring buffer of nJob pending jobs */
+  unsigned nJob;            /* Number of slots in aJob[] */
+  unsigned iWrite;          /* Next job to be inserted.  Main thread only */
+  unsigned iTake;           /* Next job to be claimed by a worker */
+  unsigned iAdd;            /* Next job to be added by the directory walk */
+  int shutdown;             /* Tell the workers to exit */
+  struct ContentHash **aContent;  /* Hash table of known content */
+  unsigned nContent;        /* Number of buckets in aContent[] */
+  unsigned nContentEntry;   /* Number of entries in aContent[] */
+} ig;
+
+/*
+** With --rate=MBPS, the compression level is chosen separately for each
+** class of files, where a class is a file name extension and a codec.
+** Each class starts at the level of its --codec rule.  As files of the
+** class are compressed, the CPU time and the compression ratio are
+** measured, and once every RATE_SAMPLE bytes the level is moved by one
+** step: down if compression is slower than the share of the target rate
+** of one thread, or up if it is faster and if the next level is not
+** already known to be either too slow or no better.  Speeds are CPU
+** time, so the share of one thread assumes no more threads than CPUs.
+**
+** All of this happens on the main thread: levels are chosen when jobs
+** are queued and measurements are taken when jobs are written.
+*/
+#define RATE_SAMPLE   (4*1024*1024)
+#define MX_LEVEL      22
+
+typedef struct RateClass RateClass;
+struct RateClass {
+  char zExt[12];              /* File name extension, lower case */
+  const Codec *pCodec;        /* Codec used for this class */
+  int iLevel;                 /* Level for the next file of this class */
+  sqlite3_int64 nByte;        /* Bytes compressed at iLevel so far */
+  sqlite3_int64 nCompr;       /* Size of those bytes after compression */
+  sqlite3_int64 ns;           /* CPU time used to compress them */
+  double aSpeed[MX_LEVEL+1];  /* MB/s per thread at each level, or 0.0 */
+  double aRatio[MX_LEVEL+1];  /* Compressed/original at each level */
+};
+
+/*
+** Return the index in ig.aClass[] of the class for file zFilename, which
+** is compressed according to pRule.  Create the class if necessary.
+*/
+static int rate_class(const char *zFilename, const CodecRule *pRule){
+  const char *zExt = strrchr(zFilename, '.');
+  char zKey[12];
+  int i;
+  memset(zKey, 0, sizeof(zKey));
+  if( zExt && strchr(zExt, '/')==0 && strlen(zExt)<sizeof(zKey) ){
+    for(i=0; zExt[i]; i++) zKey[i] = tolower((unsigned char)zExt[i]);
+  }
+  for(i=0; i<ig.nClass; i++){
+    RateClass *pC = &ig.aClass[i];
+    if( pC->pCodec==pRule->pCodec && strcmp(pC->zExt, zKey)==0 ) return i;
+  }
+  ig.aClass = sqlite3_realloc64(ig.aClass, (ig.nClass+1)*sizeof(RateClass));
+  if( ig.aClass==0 ) errorMsg("Out of memory\n");
+  memset(&ig.aClass[i], 0, sizeof(RateClass));
+  memcpy(ig.aClass[i].zExt, zKey, sizeof(zKey));
+  ig.aClass[i].pCodec = pRule->pCodec;
+  ig.aClass[i].iLevel = pRule->iLevel;
+  if( ig.aClass[i].iLevel==Z_DEFAULT_COMPRESSION ) ig.aClass[i].iLevel = 6;
+  ig.nClass++;
+  return i;
+}
+
+/*
+** Record the speed and ratio of job p, which has just been written, and
+** adjust the level of its class once enough content has been measured.
+*/
+static void rate_update(IngestJob *p){
+  RateClass *pC = &ig.aClass[p->iClass];
+  int L = pC->iLevel;
+  int mn = pC->pCodec->iMinLevel;
+  int mx = pC->pCodec->iMaxLevel;
+  double target = ig.mbpsThread;
+  double speed, ratio;
+  if( p->iLevel!=L ) return;    /* Queued before the last change */
+  pC->nByte += p->szOrig;
+  pC->nCompr += p->szCompr;
+  pC->ns += p->nsCompress;
+  if( pC->nByte<RATE_SAMPLE ) return;
+  speed = pC->ns ? pC->nByte*1000.0/pC->ns : 1.0e9;
+  ratio = (double)pC->nCompr/pC->nByte;
+  if( pC->aSpeed[L]==0.0 ){
+    pC->aSpeed[L] = speed;
+    pC->aRatio[L] = ratio;
+  }else{
+    pC->aSpeed[L] = 0.75*pC->aSpeed[L] + 0.25*speed;
+    pC->aRatio[L] = 0.75*pC->aRatio[L] + 0.25*ratio;
+  }
+  pC->nByte = pC->nCompr = pC->ns = 0;
+  if( mn<1 ) mn = 1;
+  if( mx>MX_LEVEL ) mx = MX_LEVEL;
+  if( pC->aSpeed[L]<target ){
+    if( L>mn ) pC->iLevel = L-1;
+  }else if( L<mx
+         && (pC->aSpeed[L+1]==0.0 || pC->aSpeed[L+1]>=target)
+         && (pC->aRatio[L+1]==0.0 || pC->aRatio[L+1]<0.99*pC->aRatio[L])
+  ){
+    pC->iLevel = L+1;
+  }
+}
+
+/*
+** Lock and unlock ig.mutex, if there are worker threads
+*/
+static void ingest_lock(void){
+  if( ig.nWorker ) pthread_mutex_lock(&ig.mutex);
+}
+static void ingest_unlock(void){
+  if( ig.nWorker ) pthread_mutex_unlock(&ig.mutex);
+}
+
+/*
+** For --dedup, every distinct chunk of content that is either already in
+** the sqlar_content table or that will be added by a job of this run has
+** an entry in the ig.aContent hash table.  The first job to find a new
+** hash becomes its owner and is the only one that compresses it.
+*/
+typedef struct ContentHash ContentHash;
+struct ContentHash {
+  ContentHash *pNext;        /* Next entry in the same bucket */
+  unsigned iOwner;           /* IngestJob.iJob of the owner */
+  int isStored;              /* Already in the sqlar_content table */
+  unsigned char aHash[HASH_SIZE];  /* The content hash */
+};
+
+/*
+** Find the entry for hash aHash[].  Return NULL if there is none.
+** The caller must hold ig.mutex.
+*/
+static ContentHash *content_find(const unsigned char *aHash){
+  ContentHash *p;
+  unsigned h;
+  if( ig.nContent==0 ) return 0;
+  memcpy(&h, aHash, sizeof(h));
+  for(p=ig.aContent[h % ig.nContent]; p; p=p->pNext){
+    if( memcmp(p->aHash, aHash, HASH_SIZE)==0 ) return p;
+  }
+  return 0;
+}
+
+/*
+** Add a new entry to the content hash table and return a pointer to it,
+** or NULL on an OOM.  The caller must hold ig.mutex.
+*/
+static ContentHash *content_insert(const unsigned char *aHash){
+  ContentHash *p;
+  unsigned h;
+  if( ig.nContentEntry>=ig.nContent ){
+    unsigned nNew = ig.nContent ? ig.nContent*2 : 1024;
+    ContentHash **aNew = calloc(nNew, sizeof(ContentHash*));
+    unsigned i;
+    if( aNew==0 ) return 0;
+    for(i=0; i<ig.nContent; i++){
+      while( (p = ig.aContent[i])!=0 ){
+        ig.aContent[i] = p->pNext;
+        memcpy(&h, p->aHash, sizeof(h));
+        p->pNext = aNew[h % nNew];
+        aNew[h % nNew] = p;
+      }
+    }
+    free(ig.aContent);
+    ig.aContent = aNew;
+    ig.nContent = nNew;
+  }
+  p = calloc(1, sizeof(*p));
+  if( p==0 ) return 0;
+  memcpy(p->aHash, aHash, HASH_SIZE);
+  memcpy(&h, aHash, sizeof(h));
+  p->pNext = ig.aContent[h % ig.nContent];
+  ig.aContent[h % ig.nContent] = p;
+  ig.nContentEntry++;
+  return p;
+}
+
+/*
+** Load the hashes of all content that is already in the archive.
+*/
+static void content_load(void){
+  if( !hasChunks ) return;
+  db_prepare("SELECT hash FROM sqlar_content");
+  while( sqlite3_step(pStmt)==SQLITE_ROW ){
+    ContentHash *p;
+    if( sqlite3_column_bytes(pStmt, 0)!=HASH_SIZE ) continue;
+    p = content_insert(sqlite3_column_blob(pStmt, 0));
+    if( p==0 ) errorMsg("Out of memory\n");
+    p->isStored = 1;
+  }
+  sqlite3_finalize(pStmt);
+  pStmt = 0;
+}
+
+/*
+** Compute the hash of the content of a job and look it up.  Return true
+** if this job is the first to see that content and so must store it.
+*/
+static int content_claim(IngestJob *p){
+  SHA3Context ctx;
+  ContentHash *pEntry;
+  SHA3Init(&ctx, 256);
+  SHA3Update(&ctx, (const unsigned char*)p->pData, (unsigned)p->szCompr);
+  memcpy(p->aHash, SHA3Final(&ctx), HASH_SIZE);
+  ingest_lock();
+  pEntry = content_find(p->aHash);
+  if( pEntry==0 ){
+    pEntry = content_insert(p->aHash);
+    if( pEntry==0 ){
+      job_error(p, "Out of memory\n");
+    }else{
+      pEntry->iOwner = p->iJob;
+      p->isOwner = 1;
+    }
+  }
+  ingest_unlock();
+  return p->isOwner;
+}
+
+/*
+** Read the content of all members of a JOB_SOLID into one buffer.  A
+** file that has become shorter since it was found contributes only
+** what is left of it, and one that has grown only its original size.
+** Nothing is left to do if the io_uring reader has read them already.
+*/
+static void solid_read(IngestJob *p){
+  char *a;
+  int n = 0;
+  int i;
+  if( p->pData || p->zErr ) return;
+  a = malloc( p->szOrig+1 );
+  if( a==0 ){
+    job_error(p, "cannot malloc for %lld bytes\n", p->szOrig+1);
+    return;
+  }
+  for(i=0; i<p->nMember; i++){
+    SolidMember *pM = &p->aMember[i];
+    int fd;
+    pM->iOfst = n;
+    if( !S_ISREG(pM->st.st_mode) || pM->st.st_size==0 ) continue;
+    fd = open(pM->zName, O_RDONLY);
+    if( fd<0 ){
+      free(a);
+      job_error(p, "cannot open \"%s\" for reading\n", pM->zName);
+      return;
+    }
+    pM->sz = (int)read_fully(fd, &a[n], pM->st.st_size, 0);
+    close(fd);
+    n += pM->sz;
+  }
+  p->pData = a;
+  p->szOrig = n;
+  p->szCompr = n;
+}
+
+/*
+** Read and compress the content of a single job.
+*/
+static void ingest_work(IngestJob *p){
+  if( p->eType==JOB_SOLID ){
+    solid_read(p);
+    if( p->pData && p->szCompr>0 ) compress_job(p);
+  }else if( p->eType==JOB_CHUNK && ig.dedupFlag ){
+    read_file(p, 1);
+    if( p->pData==0 ) return;
+    if( content_claim(p) ){
+      if( p->pCodec ) compress_job(p);
+    }else{
+      free(p->pData);
+      p->pData = 0;
+    }
+  }else if( p->eType==JOB_CHUNK
+         || (p->eType==JOB_FILE && S_ISREG(p->st.st_mode)) ){
+    read_file(p, p->pCodec==0);
+  }
+}
+
+/*
+** Run ingest_work() on a job, using compressor pEnc, and time it for
+** --stats.
+*/
+static void ingest_process(IngestJob *p, ZlibEncoder *pEnc){
+  sqlite3_int64 tWall = 0, tCpu = 0;
+  p->pEnc = pEnc;
+  if( stats.statsFlag ){
+    tWall = wall_ns();
+    tCpu = thread_ns();
+  }
+  ingest_work(p);
+  if( stats.statsFlag ){
+    p->nsWork = wall_ns() - tWall;
+    p->nsWorkCpu = thread_ns() - tCpu;
+  }
+}
+
+/*
+** Main routine for worker threads.
+*/
+static void *ingest_worker(void *pArg){
+  IngestJob *p;
+  ZlibEncoder enc;
+  memset(&enc, 0, sizeof(enc));
+  pthread_mutex_lock(&ig.mutex);
+  while( 1 ){
+    while( ig.iTake==ig.iAdd && !ig.shutdown ){
+      pthread_cond_wait(&ig.cvWork, &ig.mutex);
+    }
+    if( ig.iTake==ig.iAdd ) break;
+    p = &ig.aJob[(ig.iTake++) % ig.nJob];
+    p->eState = JOB_BUSY;
+    while( p->eIo==IO_BUSY ) pthread_cond_wait(&ig.cvIo, &ig.mutex);
+    pthread_mutex_unlock(&ig.mutex);
+    ingest_process(p, &enc);
+    pthread_mutex_lock(&ig.mutex);
+    p->eState = JOB_DONE;
+    pthread_cond_broadcast(&ig.cvDone);
+  }
+  pthread_mutex_unlock(&ig.mutex);
+  zlib_encoder_free(&enc);
+  return 0;
+}
+
+/*
+** Reading ahead with io_uring.
+**
+** When sqlar is compiled with -DSQLAR_ENABLE_URING on Linux, one more
+** thread keeps up to ig.nIoDepth opens and reads in flight for the jobs
+** that the workers are about to take.  A worker that takes such a job
+** waits until it has been read and then only compresses it.  This keeps
+** a fast disk array or a network filesystem busy even though each file
+** is read by a blocking call on one thread at a time.
+**
+** The size of each file is already known from the directory walk, so no
+** statx() is needed.  One byte more than that is asked for, and if the
+** file turns out to have grown it is left to the worker.
+**
+** Jobs that a worker takes before the reader gets to them, files larger
+** than STREAM_SIZE, anything for which a request fails, and everything
+** if the kernel does not allow io_uring, are read by the workers using
+** pread() instead.  So error messages are always those of read_file().
+*/
+#ifdef SQLAR_ENABLE_URING
+
+/* Default for --io-depth */
+#define IO_DEPTH 32
+
+/*
+** The rings shared with the kernel.  Only the reader thread uses them.
+*/
+typedef struct Uring Uring;
+struct Uring {
+  int fd;                     /* File descriptor from io_uring_setup() */
+  char *pRing;                /* Both rings, mapped as one */
+  size_t szRing;              /* Size of pRing */
+  struct io_uring_sqe *aSqe;  /* Submission queue entries */
+  size_t szSqe;               /* Size of aSqe[] in bytes */
+  unsigned *sqTail;           /* Tail of the submission ring */
+  unsigned *sqMask;           /* Mask for indexes into the submission ring */
+  unsigned *sqArray;          /* The submission ring */
+  unsigned *cqHead;           /* Head of the completion ring */
+  unsigned *cqTail;           /* Tail of the completion ring */
+  unsigned *cqMask;           /* Mask for indexes into the completion ring */
+  struct io_uring_cqe *aCqe;  /* The completion ring */
+  unsigned iTail;             /* Next submission ring entry to fill */
+};
+
+/*
+** Set up an io_uring with room for nEntry requests.  Return 0 on
+** success or non-zero if io_uring is not available.
+*/
+static int uring_init(Uring *p, unsigned nEntry){
+  struct io_uring_params prm;
+  size_t szSq, szCq;
+  memset(p, 0, sizeof(*p));
+  memset(&prm, 0, sizeof(prm));
+  p->fd = (int)syscall(__NR_io_uring_setup, nEntry, &prm);
+  if( p->fd<0 ) return 1;
+  if( (prm.features & IORING_FEAT_SINGLE_MMAP)==0 ){
+    close(p->fd);
+    return 1;
+  }
+  szSq = prm.sq_off.array + prm.sq_entries*sizeof(unsigned);
+  szCq = prm.cq_off.cqes + prm.cq_entries*sizeof(struct io_uring_cqe);
+  p->szRing = szSq>szCq ? szSq : szCq;
+  p->pRing = mmap(0, p->szRing, PROT_READ|PROT_WRITE, MAP_SHARED,
+                  p->fd, IORING_OFF_SQ_RING);
+  if( p->pRing==MAP_FAILED ){
+    close(p->fd);
+    return 1;
+  }
+  p->szSqe = prm.sq_entries*sizeof(struct io_uring_sqe);
+  p->aSqe = mmap(0, p->szSqe, PROT_READ|PROT_WRITE, MAP_SHARED,
+                 p->fd, IORING_OFF_SQES);
+  if( p->aSqe==MAP_FAILED ){
+    munmap(p->pRing, p->szRing);
+    close(p->fd);
+    return 1;
+  }
+  p->sqTail = (unsigned*)(p->pRing + prm.sq_off.tail);
+  p->sqMask = (unsigned*)(p->pRing + prm.sq_off.ring_mask);
+  p->sqArray = (unsigned*)(p->pRing + prm.sq_off.array);
+  p->cqHead = (unsigned*)(p->pRing + prm.cq_off.head);
+  p->cqTail = (unsigned*)(p->pRing + prm.cq_off.tail);
+  p->cqMask = (unsigned*)(p->pRing + prm.cq_off.ring_mask);
+  p->aCqe = (struct io_uring_cqe*)(p->pRing + prm.cq_off.cqes);
+  p->iTail = *p->sqTail;
+  return 0;
+}
+static void uring_free(Uring *p){
+  munmap(p->aSqe, p->szSqe);
+  munmap(p->pRing, p->szRing);
+  close(p->fd);
+}
+
+/*
+** Return a cleared submission queue entry for request pReq.  The caller
+** never has more requests in flight than the ring has entries.
+*/
+static struct io_uring_sqe *uring_sqe(Uring *p, void *pReq){
+  unsigned i = p->iTail & *p->sqMask;
+  struct io_uring_sqe *pSqe = &p->aSqe[i];
+  memset(pSqe, 0, sizeof(*pSqe));
+  pSqe->user_data = (unsigned long long)(size_t)pReq;
+  p->sqArray[i] = i;
+  p->iTail++;
+  return pSqe;
+}
+
+/*
+** Submit all new requests and wait for at least one completion.
+*/
+static void uring_enter(Uring *p){
+  unsigned nNew = p->iTail - *p->sqTail;
+  __atomic_store_n(p->sqTail, p->iTail, __ATOMIC_RELEASE);
+  syscall(__NR_io_uring_enter, p->fd, nNew, 1, IORING_ENTER_GETEVENTS, 0, 0);
+}
+
+/*
+** One request of the reader: the open and read of one file, or of one
+** chunk of a file, or of one member of a JOB_SOLID.
+*/
+typedef struct IoReq IoReq;
+struct IoReq {
+  IngestJob *pJob;       /* The job being read */
+  SolidMember *pMember;  /* The member of a JOB_SOLID, or NULL */
+  int eStep;             /* IO_OPEN or IO_READ */
+  int fd;                /* The open file, or -1 */
+  char *a;               /* Read into this buffer */
+  sqlite3_int64 iOfst;   /* Offset of the content in the file */
+  sqlite3_int64 n;       /* Bytes to read */
+  IoReq *pNext;          /* Next free request */
+};
+
+/* Allowed values for IoReq.eStep */
+#define IO_OPEN   0      /* Waiting for the file to be opened */
+#define IO_READ   1      /* Waiting for the read */
+
+/*
+** State of the reader thread.  Only the reader uses this.
+*/
+typedef struct IoReader IoReader;
+struct IoReader {
+  Uring ring;            /* The io_uring */
+  IoReq *aReq;           /* All ig.nIoDepth requests */
+  IoReq *pFree;          /* Requests that are not in flight */
+  IngestJob *pCur;       /* Job whose requests are being issued, or NULL */
+  int iMember;           /* Next member of pCur to issue, for a JOB_SOLID */
+  int nBusy;             /* Requests in flight */
+  int ioBroken;          /* Set if the kernel does not know a request */
+};
+
+/*
+** Return true if the content of job p is worth reading ahead
+*/
+static int io_wanted(IngestJob *p){
+  if( p->eType==JOB_CHUNK || p->eType==JOB_SOLID ) return 1;
+  return p->eType==JOB_FILE && S_ISREG(p->st.st_mode)
+      && p->st.st_size>0 && p->st.st_size<=STREAM_SIZE;
+}
+
+/*
+** Issue the next step of request q
+*/
+static void io_issue(IoReader *pR, IoReq *q){
+  struct io_uring_sqe *pSqe = uring_sqe(&pR->ring, q);
+  const char *zName = q->pMember ? q->pMember->zName : q->pJob->zName;
+  if( q->eStep==IO_OPEN ){
+    pSqe->opcode = IORING_OP_OPENAT;
+    pSqe->fd = AT_FDCWD;
+    pSqe->addr = (unsigned long long)(size_t)zName;
+    pSqe->open_flags = O_RDONLY;
+  }else{
+    pSqe->opcode = IORING_OP_READ;
+    pSqe->fd = q->fd;
+    pSqe->addr = (unsigned long long)(size_t)q->a;
+    pSqe->len = (unsigned)q->n;
+    pSqe->off = q->iOfst;
+  }
+}
+
+/*
+** Start a request for job p, or for member pM of a JOB_SOLID
+*/
+static void io_start(IoReader *pR, IngestJob *p, SolidMember *pM){
+  IoReq *q = pR->pFree;
+  pR->pFree = q->pNext;
+  pR->nBusy++;
+  p->nIoPending++;
+  memset(q, 0, sizeof(*q));
+  q->pJob = p;
+  q->pMember = pM;
+  q->fd = -1;
+  q->a = p->pData;
+  if( pM ){
+    q->a += pM->iOfst;
+    q->n = pM->st.st_size;
+  }else if( p->eType==JOB_CHUNK ){
+    q->iOfst = p->iOfst;
+    q->n = p->szOrig;
+  }else{
+    q->n = p->st.st_size+1;
+  }
+  io_issue(pR, q);
+}
+
+/*
+** The last request of job p has finished.  Called with ig.mutex held.
+** If any request failed, the content is dropped and the worker reads
+** the job again itself.  Otherwise, for a JOB_SOLID, move the content of
+** members that came up short so that all of the content is contiguous,
+** as solid_read() would have left it.
+*/
+static void io_job_done(IngestJob *p){
+  if( p->ioFailed ){
+    free(p->pData);
+    p->pData = 0;
+  }else if( p->pData && p->eType==JOB_SOLID ){
+    int i, n = 0;
+    for(i=0; i<p->nMember; i++){
+      SolidMember *pM = &p->aMember[i];
+      if( n<pM->iOfst ) memmove(p->pData+n, p->pData+pM->iOfst, pM->sz);
+      pM->iOfst = n;
+      n += pM->sz;
+    }
+    p->szOrig = n;
+  }
+  if( p->pData ) p->szCompr = (int)p->szOrig;
+  p->eIo = IO_DONE;
+  pthread_cond_broadcast(&ig.cvIo);
+}
+
+/*
+** Called with ig.mutex held.  Claim jobs for the reader and start
+** requests for them while there are free requests.
+*/
+static void io_claim(IoReader *pR){
+  if( (int)(ig.iRead - ig.iTake)<0 ) ig.iRead = ig.iTake;
+  if( pR->ioBroken && pR->pCur ){
+    /* A JOB_SOLID with members not yet issued.  Give it back to the
+    ** worker, which reads it with pread() once nothing is in flight. */
+    IngestJob *p = pR->pCur;
+    p->ioFailed = 1;
+    pR->pCur = 0;
+    if( p->nIoPending==0 ) io_job_done(p);
+  }
+  while( pR->pFree && !pR->ioBroken ){
+    IngestJob *p = pR->pCur;
+    if( p==0 ){
+      if( ig.iRead==ig.iAdd ) return;
+      p = &ig.aJob[(ig.iRead++) % ig.nJob];
+      if( p->eState!=JOB_NEW || !io_wanted(p) ) continue;
+      p->pData = malloc( (p->eType==JOB_FILE ? p->st.st_size : p->szOrig)+1 );
+      if( p->pData==0 ) continue;
+      p->eIo = IO_BUSY;
+      ig.nIoJob++;
+      pR->pCur = p;
+      pR->iMember = 0;
+    }
+    if( p->eType!=JOB_SOLID ){
+      io_start(pR, p, 0);
+      pR->pCur = 0;
+    }else{
+      sqlite3_int64 iOfst = 0;
+      SolidMember *pM;
+      if( pR->iMember>0 ){
+        pM = &p->aMember[pR->iMember-1];
+        iOfst = pM->iOfst + (S_ISREG(pM->st.st_mode) ? pM->st.st_size : 0);
+      }
+      while( pR->iMember<p->nMember ){
+        pM = &p->aMember[pR->iMember];
+        pM->iOfst = (int)iOfst;
+        if( S_ISREG(pM->st.st_mode) && pM->st.st_size>0 ) break;
+        pR->iMember++;
+      }
+      if( pR->iMember<p->nMember ){
+        io_start(pR, p, pM);
+        pR->iMember++;
+      }else{
+        pR->pCur = 0;
+        if( p->nIoPending==0 ) io_job_done(p);
+      }
+    }
+  }
+}
+
+/*
+** Handle the completion of one step of request q, whose result is res.
+** Return true if the request is finished.  A read of a regular file only
+** comes up short at the end of the file.
+*/
+static int io_step(IoReader *pR, IoReq *q, int res){
+  IngestJob *p = q->pJob;
+  if( res==-EINTR || res==-EAGAIN ){
+    io_issue(pR, q);
+    return 0;
+  }
+  if( res==-EINVAL || res==-EOPNOTSUPP ) pR->ioBroken = 1;
+  if( res<0 || p->ioFailed ) goto failed;
+  if( q->eStep==IO_OPEN ){
+    q->fd = res;
+    q->eStep = IO_READ;
+    io_issue(pR, q);
+    return 0;
+  }
+  if( q->pMember ){
+    q->pMember->sz = res;
+  }else if( p->eType==JOB_CHUNK ){
+    if( res<q->n ) goto failed;
+  }else{
+    if( res==q->n ) goto failed;   /* The file has grown */
+    p->szOrig = res;
+  }
+  close(q->fd);
+  return 1;
+
+failed:
+  if( q->fd>=0 ) close(q->fd);
+  p->ioFailed = 1;
+  return 1;
+}
+
+/*
+** Main routine of the reader thread
+*/
+static void *ingest_reader(void *pArg){
+  IoReader *pR = (IoReader*)pArg;
+  pthread_mutex_lock(&ig.mutex);
+  while( 1 ){
+    unsigned iHead, iTail;
+    io_claim(pR);
+    if( pR->nBusy==0 ){
+      if( ig.shutdown ) break;
+      pthread_cond_wait(&ig.cvRead, &ig.mutex);
+      continue;
+    }
+    pthread_mutex_unlock(&ig.mutex);
+    uring_enter(&pR->ring);
+    iHead = *pR->ring.cqHead;
+    iTail = __atomic_load_n(pR->ring.cqTail, __ATOMIC_ACQUIRE);
+    pthread_mutex_lock(&ig.mutex);
+    for(; iHead!=iTail; iHead++){
+      struct io_uring_cqe *pCqe = &pR->ring.aCqe[iHead & *pR->ring.cqMask];
+      IoReq *q = (IoReq*)(size_t)pCqe->user_data;
+      if( io_step(pR, q, pCqe->res) ){
+        IngestJob *p = q->pJob;
+        if( --p->nIoPending==0 && p!=pR->pCur ) io_job_done(p);
+        q->pNext = pR->pFree;
+        pR->pFree = q;
+        pR->nBusy--;
+      }
+    }
+    __atomic_store_n(pR->ring.cqHead, iHead, __ATOMIC_RELEASE);
+  }
+  pthread_mutex_unlock(&ig.mutex);
+  return 0;
+}
+
+/*
+** Start the reader thread, if io_uring is available.  Called from
+** ingest_start() after the ring of jobs has been allocated.
+*/
+static void ingest_start_reader(void){
+  IoReader *pR;
+  int i;
+  if( ig.nIoDepth<=0 ) return;
+  pR = calloc(1, sizeof(IoReader));
+  if( pR==0 ) errorMsg("Out of memory\n");
+  if( uring_init(&pR->ring, ig.nIoDepth) ){
+    if( ig.verboseFlag ) printf("io_uring is not available\n");
+    free(pR);
+    return;
+  }
+  pR->aReq = calloc(ig.nIoDepth, sizeof(IoReq));
+  if( pR->aReq==0 ) errorMsg("Out of memory\n");
+  for(i=0; i<ig.nIoDepth; i++){
+    pR->aReq[i].pNext = pR->pFree;
+    pR->pFree = &pR->aReq[i];
+  }
+  pthread_cond_init(&ig.cvIo, 0);
+  pthread_cond_init(&ig.cvRead, 0);
+  ig.pReader = pR;
+  if( pthread_create(&ig.reader, 0, ingest_reader, pR) ){
+    errorMsg("cannot start reader thread\n");
+  }
+}
+
+/*
+** Stop the reader thread.  Called with the workers already stopped.
+*/
+static void ingest_finish_reader(void){
+  IoReader *pR = (IoReader*)ig.pReader;
+  if( pR==0 ) return;
+  pthread_mutex_lock(&ig.mutex);
+  pthread_cond_signal(&ig.cvRead);
+  pthread_mutex_unlock(&ig.mutex);
+  pthread_join(ig.reader, 0);
+  uring_free(&pR->ring);
+  free(pR->aReq);
+  free(pR);
+  ig.pReader = 0;
+}
+#else
+# define IO_DEPTH 0
+# define ingest_start_reader()
+# define ingest_finish_reader()
+#endif /* SQLAR_ENABLE_URING */
+
+/*
+** Start the worker threads.
+*/
+static void ingest_start(
+  int nWorker,                /* Number of worker threads */
+  int verboseFlag,            /* Show each file as it is added */
+  int noCompress,             /* Do not compress content */
+  int dedupFlag,              /* Store identical chunks only once */
+  sqlite3_int64 szChunk       /* Chunk size, or 0 for no chunks */
+){
+  int i;
+  ig.verboseFlag = verboseFlag;
+  if( noCompress ) ig.dfltRule.pCodec = 0;
+  ig.dedupFlag = dedupFlag;
+  ig.szChunk = szChunk;
+  if( dedupFlag ){
+    if( ig.szChunk==0 ) ig.szChunk = ig.cdcFlag ? CDC_SIZE : CHUNK_SIZE;
+    content_load();
+  }
+  if( ig.mbps>0.0 ){
+    long nCpu = sysconf(_SC_NPROCESSORS_ONLN);
+    int nThread = nWorker>1 ? nWorker : 1;
+    if( nCpu>0 && nCpu<nThread ) nThread = (int)nCpu;
+    ig.mbpsThread = ig.mbps/nThread;
+  }
+  if( IO_DEPTH==0 ) ig.nIoDepth = 0;   /* io_uring is not compiled in */
+  if( nWorker<=1 && ig.nIoDepth==0 ) return;
+  if( nWorker<1 ) nWorker = 1;
+  ig.nWorker = nWorker;
+  ig.nJob = 4*nWorker + ig.nIoDepth;
+  ig.aJob = calloc(ig.nJob, sizeof(IngestJob));
+  ig.aThread = calloc(nWorker, sizeof(pthread_t));
+  if( ig.aJob==0 || ig.aThread==0 ) errorMsg("Out of memory\n");
+  pthread_mutex_init(&ig.mutex, 0);
+  pthread_cond_init(&ig.cvWork, 0);
+  pthread_cond_init(&ig.cvDone, 0);
+  for(i=0; i<nWorker; i++){
+    if( pthread_create(&ig.aThread[i], 0, ingest_worker, 0) ){
+      errorMsg("cannot start worker thread\n");
+    }
+  }
+  ingest_start_reader();
+}
+
+/*
+** Show a file that has just been added, for the -v option
+*/
+static void ingest_show(const char *zName, sqlite3_int64 szOrig,
+                        sqlite3_int64 szCompr, const Codec *pCodec,
+                        int iLevel){
+  if( ig.dedupFlag && szCompr==0 && szOrig>0 ){
+    printf("  added: %s (duplicate)\n", zName);
+  }else if( szCompr<szOrig ){
+    int pct = szOrig ? (100*szCompr)/szOrig : 0;
+    if( ig.mbps>0.0 ){
+      printf("  added: %s (%s %d%%, level %d)\n",
+             zName, pCodec->zAlgo, 100-pct, iLevel);
+    }else{
+      printf("  added: %s (%s %d%%)\n", zName, pCodec->zAlgo, 100-pct);
+    }
+  }else{
+    printf("  added: %s\n", zName);
+  }
+}
+
+/*
+** Make sure the content with hash p->aHash[] is in the sqlar_content
+** table.  The content might belong to a later job that a worker thread
+** is still compressing, in which case wait for that job to finish and
+** insert its content now.
+*/
+static void ingest_write_content(IngestJob *p){
+  ContentHash *pEntry;
+  IngestJob *pOwner = p;
+  sqlite3_stmt *pIns;
+  ingest_lock();
+  pEntry = content_find(p->aHash);
+  assert( pEntry!=0 );
+  if( pEntry->isStored ){
+    ingest_unlock();
+    return;
+  }
+  if( pEntry->iOwner!=p->iJob ){
+    assert( ig.nWorker>0 );
+    pOwner = &ig.aJob[pEntry->iOwner % ig.nJob];
+    while( pOwner->eState!=JOB_DONE ){
+      pthread_cond_wait(&ig.cvDone, &ig.mutex);
+    }
+  }
+  pEntry->isStored = 1;
+  ingest_unlock();
+  if( pOwner->zErr ) errorMsg("%s", pOwner->zErr);
+  if( pOwner->pData==0 ) errorMsg("Out of memory\n");
+  pIns = db_stmt(&pContentIns,
+            "INSERT INTO sqlar_content(hash,sz,data) VALUES(?1,?2,?3)");
+  sqlite3_bind_blob(pIns, 1, pOwner->aHash, HASH_SIZE, SQLITE_STATIC);
+  sqlite3_bind_int64(pIns, 2, pOwner->szOrig);
+  sqlite3_bind_blob(pIns, 3, pOwner->pData, pOwner->szCompr, free);
+  pOwner->pData = 0;
+  if( sqlite3_step(pIns)!=SQLITE_DONE ){
+    errorMsg("Insert failed for %s: %s\n", p->zName, sqlite3_errmsg(db));
+  }
+  sqlite3_reset(pIns);
+  ig.nChunkCompr += pOwner->szCompr;
+}
+
+/*
+** Insert a single chunk of a file into the sqlar_chunk table.
+*/
+static void ingest_write_chunk(IngestJob *p, const char *zName){
+  sqlite3_stmt *pIns;
+  pIns = db_stmt(&pChunkIns,
+            "INSERT INTO sqlar_chunk(name,off,sz,hash,data)"
+            " VALUES(?1,?2,?3,?4,?5)");
+  sqlite3_bind_text(pIns, 1, zName, -1, SQLITE_STATIC);
+  sqlite3_bind_int64(pIns, 2, p->iOfst);
+  sqlite3_bind_int64(pIns, 3, p->szOrig);
+  if( ig.dedupFlag ){
+    ingest_write_content(p);
+    sqlite3_bind_blob(pIns, 4, p->aHash, HASH_SIZE, SQLITE_STATIC);
+    sqlite3_bind_null(pIns, 5);
+  }else{
+    if( p->pData==0 ) errorMsg("Out of memory\n");
+    sqlite3_bind_null(pIns, 4);
+    sqlite3_bind_blob(pIns, 5, p->pData, p->szCompr, free);
+    p->pData = 0;
+    ig.nChunkCompr += p->szCompr;
+  }
+  if( sqlite3_step(pIns)!=SQLITE_DONE ){
+    errorMsg("Insert failed for %s: %s\n", p->zName, sqlite3_errmsg(db));
+  }
+  sqlite3_reset(pIns);
+  if( ig.verboseFlag && p->iOfst+p->szOrig>=p->st.st_size ){
+    ingest_show(p->zName, p->st.st_size, ig.nChunkCompr, p->pCodec,
+                p->iLevel);
+  }
+}
+
+/*
+** Copy the content of a large file into the zeroblob() that was just
+** inserted into the sqlar table, STREAM_WINDOW bytes at a time.  The
+** content comes from p->pSpool if the file was compressed, or else
+** directly from the original file.
+*/
+static void ingest_copy_blob(IngestJob *p){
+  static char *aBuf = 0;
+  sqlite3_blob *pBlob;
+  FILE *in = p->pSpool;
+  int iOfst;
+  if( aBuf==0 ){
+    aBuf = sqlite3_malloc( STREAM_WINDOW );
+    if( aBuf==0 ) errorMsg("Out of memory\n");
+  }
+  if( in==0 ){
+    in = fopen(p->zName, "rb");
+    if( in==0 ) errorMsg("cannot open \"%s\" for reading\n", p->zName);
+  }
+  if( sqlite3_blob_open(db, "main", "sqlar", "data",
+                        sqlite3_last_insert_rowid(db), 1, &pBlob) ){
+    errorMsg("cannot open BLOB for %s: %s\n", p->zName, sqlite3_errmsg(db));
+  }
+  for(iOfst=0; iOfst<p->szCompr; iOfst+=STREAM_WINDOW){
+    int n = p->szCompr - iOfst;
+    if( n>STREAM_WINDOW ) n = STREAM_WINDOW;
+    if( fread(aBuf, n, 1, in)!=1 ){
+      errorMsg("unable to read %d bytes of file %s\n", n, p->zName);
+    }
+    if( sqlite3_blob_write(pBlob, aBuf, n, iOfst) ){
+      errorMsg("Insert failed for %s: %s\n", p->zName, sqlite3_errmsg(db));
+    }
+  }
+  sqlite3_blob_close(pBlob);
+  fclose(in);
+  p->pSpool = 0;
+}
+
+/*
+** Checkpointed ingest.  When files are committed in batches, each commit
+** also records in the sqlar_progress table how far the directory walk
+** had got: the index of the FILES argument being walked and the name of
+** the last file committed.  The directory walk adds files in the order
+** of their names (see walk_order()), so a later run with --resume and
+** the same FILES arguments can skip everything up to that point without
+** reading it again.  The table is dropped when a run completes.
+*/
+static const char zProgressSchema[] =
+  "CREATE TABLE IF NOT EXISTS sqlar_progress(\n"
+  "  args TEXT,\n"
+  "  iarg INT,\n"
+  "  name TEXT\n"
+  ");"
+;
+static struct {
+  char *zArgs;           /* The FILES arguments, separated by newlines */
+  int iArg;              /* FILES argument of the last file committed */
+  char *zName;           /* Name of the last file committed, or NULL */
+} resume;
+
+/* Return values from resume_check() */
+#define RESUME_ADD      0   /* Not yet in the archive */
+#define RESUME_DESCEND  1   /* Directory already added, but not all of it */
+#define RESUME_SKIP     2   /* Already in the archive, with all content */
+
+/*
+** Decide what to do with file zName of FILES argument iArg when resuming
+** an interrupted run.  The directory scan threads call this too, so it
+** must not change any state.
+*/
+static int resume_check(int iArg, const char *zName){
+  int c;
+  int n;
+  if( resume.zName==0 || iArg>resume.iArg ) return RESUME_ADD;
+  if( iArg<resume.iArg ) return RESUME_SKIP;
+  c = strcmp(zName, resume.zName);
+  if( c>0 ) return RESUME_ADD;
+  /* The content of a directory is visited after all names that begin
+  ** with the name of the directory followed by a byte less than '/' */
+  n = (int)strlen(zName);
+  while( n>0 && zName[n-1]=='/' ) n--;
+  if( c==0 || (strncmp(zName, resume.zName, n)==0
+               && (unsigned char)resume.zName[n]<='/') ){
+    return RESUME_DESCEND;
+  }
+  return RESUME_SKIP;
+}
+
+/*
+** Return true if file zName of FILES argument iArg was skipped because
+** an interrupted run had already added it.  zName has no leading "/".
+*/
+static int resume_skipped(int iArg, const char *zName){
+  const char *zPos = resume.zName;
+  if( zPos==0 || iArg>resume.iArg ) return 0;
+  if( iArg<resume.iArg ) return 1;
+  while( zPos[0]=='/' ) zPos++;
+  return strcmp(zName, zPos)<=0;
+}
+
+/*
+** Remember the FILES arguments of this run and, for --resume, load the
+** position of an interrupted run with the same arguments.
+*/
+static void resume_load(const char **azFiles, int nFiles, int resumeFlag){
+  int i;
+  for(i=0; i<nFiles; i++){
+    resume.zArgs = sqlite3_mprintf("%z%s%s", resume.zArgs,
+                                   i ? "\n" : "", azFiles[i]);
+    if( resume.zArgs==0 ) errorMsg("Out of memory\n");
+  }
+  if( !resumeFlag ) return;
+  if( sqlite3_exec(db, "SELECT 1 FROM sqlar_progress", 0, 0, 0)!=SQLITE_OK ){
+    return;
+  }
+  db_prepare("SELECT args, iarg, name FROM sqlar_progress");
+  if( sqlite3_step(pStmt)==SQLITE_ROW ){
+    const char *zArgs = (const char*)sqlite3_column_text(pStmt, 0);
+    if( zArgs==0 || strcmp(zArgs, resume.zArgs)!=0 ){
+      errorMsg("cannot resume: the files to add differ from the"
+               " interrupted run\n");
+    }
+    resume.iArg = sqlite3_column_int(pStmt, 1);
+    resume.zName = sqlite3_mprintf("%s", sqlite3_column_text(pStmt, 2));
+    if( resume.zName==0 ) errorMsg("Out of memory\n");
+    if( ig.verboseFlag ) printf("resuming after: %s\n", resume.zName);
+  }
+  sqlite3_finalize(pStmt);
+  pStmt = 0;
+}
+
+/*
+** Record file zName of FILES argument iArg as the last file of the batch
+** that is about to be committed.
+*/
+static void resume_save(int iArg, const char *zName){
+  sqlite3_stmt *p;
+  if( pProgress==0 ) sqlite3_exec(db, zProgressSchema, 0, 0, 0);
+  sqlite3_exec(db, "DELETE FROM sqlar_progress", 0, 0, 0);
+  p = db_stmt(&pProgress, "INSERT INTO sqlar_progress(args,iarg,name)"
+                          " VALUES(?1,?2,?3)");
+  sqlite3_bind_text(p, 1, resume.zArgs, -1, SQLITE_STATIC);
+  sqlite3_bind_int(p, 2, iArg);
+  sqlite3_bind_text(p, 3, zName, -1, SQLITE_STATIC);
+  if( sqlite3_step(p)!=SQLITE_DONE ){
+    errorMsg("cannot save progress: %s\n", sqlite3_errmsg(db));
+  }
+  sqlite3_reset(p);
+}
+
+/*
+** The run has completed.  Forget any saved position.
+*/
+static void resume_done(void){
+  sqlite3_finalize(pProgress);
+  pProgress = 0;
+  sqlite3_exec(db, "DROP TABLE IF EXISTS sqlar_progress", 0, 0, 0);
+  sqlite3_free(resume.zArgs);
+  sqlite3_free(resume.zName);
+  memset(&resume, 0, sizeof(resume));
+}
+
+/*
+** Called once all rows for file zName of FILES argument iArg have been
+** inserted.  Commit and start
+** a new transaction if the current one is big enough, so that a large
+** ingest is written in batches.  A file is never split across batches.
+*/
+static void ingest_file_done(int iArg, const char *zName){
+  ig.nBatchFile++;
+  stats.nFile++;
+  stats_progress(0);
+  if( (ig.mxBatchFile>0 && ig.nBatchFile>=ig.mxBatchFile)
+   || (ig.mxBatchByte>0 && ig.nBatchByte>=ig.mxBatchByte)
+  ){
+    resume_save(iArg, zName);
+    db_commit();
+    ig.nBatchFile = 0;
+    ig.nBatchByte = 0;
+  }
+}
+
+/*
+** Insert a JOB_SOLID: the block itself, then a sqlar row for each member
+** and a sqlar_solid row for each member that has content in the block.
+*/
+static void ingest_write_solid(IngestJob *p){
+  sqlite3_int64 iBlock = 0;
+  int i;
+  if( p->szOrig>0 ){
+    sqlite3_stmt *pIns;
+    db_create_solid_tables();
+    pIns = db_stmt(&pBlockIns,
+                   "INSERT INTO sqlar_block(sz,data) VALUES(?1,?2)");
+    sqlite3_bind_int64(pIns, 1, p->szOrig);
+    sqlite3_bind_blob(pIns, 2, p->pData, p->szCompr, SQLITE_STATIC);
+    if( sqlite3_step(pIns)!=SQLITE_DONE ){
+      errorMsg("Insert failed for %s: %s\n", p->zName, sqlite3_errmsg(db));
+    }
+    sqlite3_reset(pIns);
+    iBlock = sqlite3_last_insert_rowid(db);
+    if( ig.verboseFlag ){
+      char *zBlock = sqlite3_mprintf("block %lld", iBlock);
+      if( zBlock==0 ) errorMsg("Out of memory\n");
+      ingest_show(zBlock, p->szOrig, p->szCompr, p->pCodec, p->iLevel);
+      sqlite3_free(zBlock);
+    }
+  }
+  if( pStmt==0 ){
+    db_prepare("REPLACE INTO sqlar(name,mode,mtime,sz,data)"
+               " VALUES(?1,?2,?3,?4,?5)");
+  }
+  for(i=0; i<p->nMember; i++){
+    SolidMember *pM = &p->aMember[i];
+    const char *zName = pM->zName;
+    while( zName[0]=='/' ) zName++;
+    db_delete_chunks(zName);
+    sqlite3_bind_text(pStmt, 1, zName, -1, SQLITE_STATIC);
+    sqlite3_bind_int(pStmt, 2, pM->st.st_mode);
+    sqlite3_bind_int64(pStmt, 3, pM->st.st_mtime);
+    sqlite3_bind_int(pStmt, 4, pM->sz);
+    if( S_ISREG(pM->st.st_mode) && pM->sz==0 ){
+      sqlite3_bind_zeroblob(pStmt, 5, 0);
+    }else{
+      sqlite3_bind_null(pStmt, 5);
+    }
+    if( sqlite3_step(pStmt)!=SQLITE_DONE ){
+      errorMsg("Insert failed for %s: %s\n", pM->zName, sqlite3_errmsg(db));
+    }
+    sqlite3_reset(pStmt);
+    if( pM->sz>0 ){
+      sqlite3_stmt *pIns;
+      pIns = db_stmt(&pSolidIns, "INSERT INTO sqlar_solid(name,block,off)"
+                                 " VALUES(?1,?2,?3)");
+      sqlite3_bind_text(pIns, 1, zName, -1, SQLITE_STATIC);
+      sqlite3_bind_int64(pIns, 2, iBlock);
+      sqlite3_bind_int(pIns, 3, pM->iOfst);
+      if( sqlite3_step(pIns)!=SQLITE_DONE ){
+        errorMsg("Insert failed for %s: %s\n", pM->zName, sqlite3_errmsg(db));
+      }
+      sqlite3_reset(pIns);
+    }
+    if( ig.verboseFlag ) printf("  added: %s\n", pM->zName);
+    ingest_file_done(pM->iArg, pM->zName);
+    free(pM->zName);
+  }
+  free(p->aMember);
+  free(p->pData);
+  free(p->zName);
+  memset(p, 0, sizeof(*p));
+}
+
+/*
+** Insert a finished job into the archive and release its resources.
+*/
+static void ingest_insert(IngestJob *p){
   int rc;
-  FILE *out;
-  make_parent_directory(zFilename);
-  if( pCompr==0 ){
-    rc = mkdir(zFilename, iMode);
-    if( rc ) errorMsg("cannot make directory: %s\n", zFilename);
+  const char *zName;
+  int isLast = p->eType==JOB_FILE
+            || (p->eType==JOB_CHUNK && p->iOfst+p->szOrig>=p->st.st_size);
+  if( p->zErr ) errorMsg("%s", p->zErr);
+  ig.nBatchByte += p->szCompr;
+  if( p->isRaw ){
+    ig.nRaw++;
+    ig.szRaw += p->szOrig;
+  }else if( p->nsCompress ){
+    ig.szTried += p->szOrig;
+    ig.nsTried += p->nsCompress;
+    if( p->iClass>=0 ) rate_update(p);
+  }
+  if( p->eType==JOB_SOLID ){
+    ingest_write_solid(p);
+    return;
+  }
+  zName = p->zName;
+  while( zName[0]=='/' ) zName++;
+  if( p->eType==JOB_CHUNK ){
+    ingest_write_chunk(p, zName);
+    if( isLast ) ingest_file_done(p->iArg, p->zName);
+    free(p->pData);
+    free(p->zName);
+    memset(p, 0, sizeof(*p));
+    return;
+  }
+  if( pStmt==0 ){
+    db_prepare("REPLACE INTO sqlar(name,mode,mtime,sz,data)"
+               " VALUES(?1,?2,?3,?4,?5)");
+  }
+  db_delete_chunks(zName);
+  sqlite3_bind_text(pStmt, 1, zName, -1, SQLITE_STATIC);
+  sqlite3_bind_int(pStmt, 2, p->st.st_mode);
+  sqlite3_bind_int64(pStmt, 3, p->st.st_mtime);
+  if( p->eType==JOB_CHUNKED ){
+    db_create_chunk_table();
+    sqlite3_bind_int64(pStmt, 4, p->st.st_size);
+    sqlite3_bind_null(pStmt, 5);
+    ig.nChunkCompr = 0;
+  }else if( S_ISREG(p->st.st_mode) ){
+    sqlite3_bind_int64(pStmt, 4, p->szOrig);
+    if( p->pData ){
+      sqlite3_bind_blob(pStmt, 5, p->pData, p->szCompr, free);
+      p->pData = 0;
+    }else if( p->szOrig>STREAM_SIZE ){
+      sqlite3_bind_zeroblob(pStmt, 5, p->szCompr);
+    }else{
+      errorMsg("Out of memory\n");
+    }
+    if( ig.verboseFlag ){
+      ingest_show(p->zName, p->szOrig, p->szCompr, p->pCodec, p->iLevel);
+    }
+  }else{
+    sqlite3_bind_int(pStmt, 4, 0);
+    sqlite3_bind_null(pStmt, 5);
+    if( ig.verboseFlag ) printf("  added: %s\n", p->zName);
+  }
+  rc = sqlite3_step(pStmt);
+  if( rc!=SQLITE_DONE ){
+    errorMsg("Insert failed for %s: %s\n", p->zName, sqlite3_errmsg(db));
+  }
+  sqlite3_reset(pStmt);
+  if( p->eType==JOB_FILE && S_ISREG(p->st.st_mode) && p->szOrig>STREAM_SIZE ){
+    ingest_copy_blob(p);
+  }
+  if( isLast ) ingest_file_done(p->iArg, p->zName);
+  free(p->zName);
+  memset(p, 0, sizeof(*p));
+}
+
+/*
+** Add the times and sizes of a finished job to the --stats totals, then
+** insert it.  Batches committed while it is inserted count as commit
+** time, not insert time.
+*/
+static void ingest_write(IngestJob *p){
+  StageTimer t;
+  sqlite3_int64 nsCommit = stats.aWall[STAGE_COMMIT];
+  sqlite3_int64 nsCommitCpu = stats.aCpu[STAGE_COMMIT];
+  if( p->eType!=JOB_CHUNKED ){
+    stats.nIn += p->szOrig;
+    if( p->eType!=JOB_CHUNK || !ig.dedupFlag || p->isOwner ){
+      stats.nOut += p->szCompr;
+    }
+  }
+  if( !stats.statsFlag ){
+    ingest_insert(p);
+    return;
+  }
+  stats.aWall[STAGE_COMPRESS] += p->nsCompressWall;
+  stats.aCpu[STAGE_COMPRESS] += p->nsCompress;
+  stats.aWall[STAGE_READ] += p->nsWork - p->nsCompressWall;
+  stats.aCpu[STAGE_READ] += p->nsWorkCpu - p->nsCompress;
+  stats_begin(&t);
+  ingest_insert(p);
+  stats_end(&t, STAGE_INSERT);
+  stats.aWall[STAGE_INSERT] -= stats.aWall[STAGE_COMMIT] - nsCommit;
+  stats.aCpu[STAGE_INSERT] -= stats.aCpu[STAGE_COMMIT] - nsCommitCpu;
+}
+
+/*
+** Wait for the oldest job in the ring to finish, then insert it.
+*/
+static void ingest_write_next(void){
+  IngestJob *p;
+  pthread_mutex_lock(&ig.mutex);
+  p = &ig.aJob[ig.iWrite % ig.nJob];
+  while( p->eState!=JOB_DONE ){
+    pthread_cond_wait(&ig.cvDone, &ig.mutex);
+  }
+  pthread_mutex_unlock(&ig.mutex);
+  ingest_write(p);
+  ig.iWrite++;
+}
+
+/*
+** Hand a new job to the pipeline.  pNew->zName must be obtained from
+** malloc() and becomes the property of the pipeline.
+*/
+static void ingest_submit(IngestJob *pNew){
+  IngestJob *p;
+  pNew->iJob = ig.iAdd;
+  if( ig.nWorker==0 ){
+    ig.iAdd++;
+    ingest_process(pNew, &ig.enc);
+    ingest_write(pNew);
+    return;
+  }
+  if( ig.iAdd - ig.iWrite>=ig.nJob ) ingest_write_next();
+  pthread_mutex_lock(&ig.mutex);
+  p = &ig.aJob[ig.iAdd % ig.nJob];
+  *p = *pNew;
+  p->eState = JOB_NEW;
+  ig.iAdd++;
+  pthread_cond_signal(&ig.cvWork);
+  if( ig.pReader ) pthread_cond_signal(&ig.cvRead);
+  pthread_mutex_unlock(&ig.mutex);
+}
+
+/*
+** Insert all pending jobs and stop the worker threads.
+*/
+static void ingest_finish(void){
+  int i;
+  zlib_encoder_free(&ig.enc);
+  if( ig.nWorker==0 ) return;
+  while( ig.iWrite!=ig.iAdd ) ingest_write_next();
+  pthread_mutex_lock(&ig.mutex);
+  ig.shutdown = 1;
+  pthread_cond_broadcast(&ig.cvWork);
+  pthread_mutex_unlock(&ig.mutex);
+  for(i=0; i<ig.nWorker; i++) pthread_join(ig.aThread[i], 0);
+  ingest_finish_reader();
+  free(ig.aThread);
+  free(ig.aJob);
+  ig.nWorker = 0;
+}
+
+/*
+** For -v, report how much content was stored without compression because
+** it looked incompressible, and estimate the time that saved from the
+** speed at which the rest of the content was compressed.
+*/
+static void ingest_report(void){
+  int i;
+  if( !ig.verboseFlag ) return;
+  if( ig.nIoJob ){
+    printf("read %d files or chunks ahead with io_uring\n", ig.nIoJob);
+  }
+  if( ig.nRaw ){
+    printf("skipped compression of %d files or chunks, %lld bytes",
+           ig.nRaw, ig.szRaw);
+    if( ig.szTried>0 ){
+      printf(" (about %.2f seconds of CPU time)",
+             ig.szRaw*(ig.nsTried/1.0e9)/ig.szTried);
+    }
+    printf("\n");
+  }
+  for(i=0; i<ig.nClass; i++){
+    RateClass *pC = &ig.aClass[i];
+    int L = pC->iLevel;
+    printf("rate: %s files: %s level %d", pC->zExt[0] ? pC->zExt : "other",
+           pC->pCodec->zAlgo, L);
+    if( L<=MX_LEVEL && pC->aSpeed[L]>0.0 ){
+      printf(" (%.1f MB/s per thread, %d%%)",
+             pC->aSpeed[L], (int)(100.0 - 100.0*pC->aRatio[L]));
+    }
+    printf("\n");
+  }
+}
+
+/*
+** Free the content hash table
+*/
+static void ingest_free_content(void){
+  unsigned i;
+  ContentHash *p;
+  for(i=0; i<ig.nContent; i++){
+    while( (p = ig.aContent[i])!=0 ){
+      ig.aContent[i] = p->pNext;
+      free(p);
+    }
+  }
+  free(ig.aContent);
+  ig.aContent = 0;
+  ig.nContent = ig.nContentEntry = 0;
+}
+
+/*
+** For the -u option, the name, mode, mtime and size of every file that
+** was already in the archive before this run are loaded into a hash
+** table.  Files found by the directory walk that match an entry in this
+** table are unchanged and are skipped without being read.
+*/
+typedef struct OldFile OldFile;
+struct OldFile {
+  OldFile *pNext;        /* Next entry in the same hash bucket */
+  sqlite3_int64 mtime;   /* sqlar.mtime */
+  sqlite3_int64 sz;      /* sqlar.sz */
+  int mode;              /* sqlar.mode */
+  int seen;              /* True if found by the directory walk */
+  char zName[1];         /* sqlar.name.  Extra space allocated as needed */
+};
+static struct {
+  OldFile **aHash;       /* Hash table of all files in the archive */
+  unsigned nHash;        /* Number of buckets in aHash[] */
+} oldFiles;
+
+/*
+** Load the hash table of files that are already in the archive.
+*/
+static void update_load(void){
+  sqlite3_int64 n;
+  db_prepare("SELECT count(*) FROM sqlar");
+  sqlite3_step(pStmt);
+  n = sqlite3_column_int64(pStmt, 0);
+  oldFiles.nHash = (unsigned)(n + n/2 + 64);
+  oldFiles.aHash = sqlite3_malloc64( oldFiles.nHash*sizeof(OldFile*) );
+  if( oldFiles.aHash==0 ) errorMsg("Out of memory\n");
+  memset(oldFiles.aHash, 0, oldFiles.nHash*sizeof(OldFile*));
+  db_prepare("SELECT name, mode, mtime, sz FROM sqlar");
+  while( sqlite3_step(pStmt)==SQLITE_ROW ){
+    const char *zName = (const char*)sqlite3_column_text(pStmt, 0);
+    int nName = sqlite3_column_bytes(pStmt, 0);
+    unsigned h = name_hash(zName) % oldFiles.nHash;
+    OldFile *pOld = sqlite3_malloc( sizeof(*pOld) + nName );
+    if( pOld==0 ) errorMsg("Out of memory\n");
+    pOld->mode = sqlite3_column_int(pStmt, 1);
+    pOld->mtime = sqlite3_column_int64(pStmt, 2);
+    pOld->sz = sqlite3_column_int64(pStmt, 3);
+    pOld->seen = 0;
+    memcpy(pOld->zName, zName, nName+1);
+    pOld->pNext = oldFiles.aHash[h];
+    oldFiles.aHash[h] = pOld;
+  }
+  sqlite3_finalize(pStmt);
+  pStmt = 0;
+}
+
+/*
+** Return true if file zName is already in the archive with the same
+** mode, modification time and size that stat() reports for it now.
+*/
+static int update_unchanged(const char *zName, struct stat *pStat){
+  OldFile *pOld;
+  sqlite3_int64 sz;
+  if( oldFiles.aHash==0 ) return 0;
+  while( zName[0]=='/' ) zName++;
+  pOld = oldFiles.aHash[name_hash(zName) % oldFiles.nHash];
+  while( pOld && strcmp(pOld->zName, zName)!=0 ) pOld = pOld->pNext;
+  if( pOld==0 ) return 0;
+  pOld->seen = 1;
+  sz = S_ISREG(pStat->st_mode) ? pStat->st_size : 0;
+  return pOld->mode==(int)pStat->st_mode
+      && pOld->mtime==pStat->st_mtime
+      && pOld->sz==sz;
+}
+
+/*
+** If zName is a directory that is already in the archive as a directory,
+** change its mode and modification time in place and return true.
+** Rewriting the row with REPLACE would give the directory a rowid
+** larger than those of the files it already holds, and extraction
+** creates entries in rowid order.
+*/
+static int update_directory(const char *zName, struct stat *pStat){
+  sqlite3_stmt *p;
+  OldFile *pOld;
+  if( oldFiles.aHash==0 || !S_ISDIR(pStat->st_mode) ) return 0;
+  while( zName[0]=='/' ) zName++;
+  pOld = oldFiles.aHash[name_hash(zName) % oldFiles.nHash];
+  while( pOld && strcmp(pOld->zName, zName)!=0 ) pOld = pOld->pNext;
+  if( pOld==0 || !S_ISDIR(pOld->mode) ) return 0;
+  p = db_stmt(&pDirUpd, "UPDATE sqlar SET mode=?1, mtime=?2 WHERE name=?3");
+  sqlite3_bind_int(p, 1, pStat->st_mode);
+  sqlite3_bind_int64(p, 2, pStat->st_mtime);
+  sqlite3_bind_text(p, 3, zName, -1, SQLITE_STATIC);
+  if( sqlite3_step(p)!=SQLITE_DONE ){
+    errorMsg("Update failed for %s: %s\n", zName, sqlite3_errmsg(db));
+  }
+  sqlite3_reset(p);
+  return 1;
+}
+
+/*
+** Remove from the archive every file that is under one of the azFiles[]
+** arguments but that was not found by the directory walk.
+*/
+static void update_remove_missing(const char **azFiles, int nFiles){
+  unsigned h;
+  int i;
+  OldFile *pOld;
+  sqlite3_stmt *pDel = 0;
+  for(h=0; h<oldFiles.nHash; h++){
+    for(pOld=oldFiles.aHash[h]; pOld; pOld=pOld->pNext){
+      if( pOld->seen ) continue;
+      for(i=0; i<nFiles; i++){
+        const char *zArg = azFiles[i];
+        int n;
+        while( zArg[0]=='/' ) zArg++;
+        n = (int)strlen(zArg);
+        while( n>0 && zArg[n-1]=='/' ) n--;
+        if( strncmp(pOld->zName, zArg, n)==0
+         && (pOld->zName[n]==0 || pOld->zName[n]=='/') ){
+          break;
+        }
+      }
+      if( i>=nFiles || resume_skipped(i, pOld->zName) ) continue;
+      db_stmt(&pDel, "DELETE FROM sqlar WHERE name=?1");
+      sqlite3_bind_text(pDel, 1, pOld->zName, -1, SQLITE_STATIC);
+      sqlite3_step(pDel);
+      sqlite3_reset(pDel);
+      db_delete_chunks(pOld->zName);
+      if( ig.verboseFlag ) printf("  removed: %s\n", pOld->zName);
+    }
+  }
+  sqlite3_finalize(pDel);
+}
+
+/*
+** Add a rule for the --codec=[GLOB=]NAME[:LEVEL] option.  A rule with
+** no GLOB sets the codec for files that match no other rule.  NAME may
+** be "none" to store the matching files without compression.
+*/
+static void codec_rule_add(const char *zArg){
+  CodecRule r;
+  const char *zEq = strrchr(zArg, '=');
+  const char *zName = zEq ? &zEq[1] : zArg;
+  const char *zColon = strchr(zName, ':');
+  int nName = zColon ? (int)(zColon - zName) : (int)strlen(zName);
+  int i;
+
+  memset(&r, 0, sizeof(r));
+  if( nName!=4 || strncmp(zName, "none", 4)!=0 ){
+    for(i=0; i<N_CODEC; i++){
+      if( strncmp(aCodec[i].zName, zName, nName)==0
+       && aCodec[i].zName[nName]==0
+      ){
+        break;
+      }
+    }
+    if( i>=N_CODEC ) errorMsg("unknown codec: %.*s\n", nName, zName);
+    r.pCodec = &aCodec[i];
+    if( r.pCodec->xCompress==0 ){
+      errorMsg("the %s codec is not compiled in\n", r.pCodec->zName);
+    }
+    r.iLevel = r.pCodec->iDefault;
+    if( zColon ){
+      r.iLevel = atoi(&zColon[1]);
+      if( r.iLevel<r.pCodec->iMinLevel || r.iLevel>r.pCodec->iMaxLevel ){
+        errorMsg("%s compression level must be between %d and %d\n",
+                 r.pCodec->zName, r.pCodec->iMinLevel, r.pCodec->iMaxLevel);
+      }
+    }
+  }
+  if( zEq==0 ){
+    ig.dfltRule = r;
     return;
   }
-  out = fopen(zFilename, "wb");
-  if( out==0 ) errorMsg("cannot open for writing: %s\n", zFilename);
-  if( sz==nCompr ){
-    if( sz>0 && fwrite(pCompr, sz, 1, out)!=1 ){
-      errorMsg("failed to write: %s\n", zFilename);
-    }
-  }else{
-    pOut = sqlite3_malloc( sz+1 );
-    if( pOut==0 ) errorMsg("cannot allocate %d bytes\n", sz+1);
-    nOut = sz;
-    rc = uncompress((Bytef*)pOut, &nOut, (const Bytef*)pCompr, nCompr);
-    if( rc!=Z_OK ) errorMsg("uncompress failed for %s\n", zFilename);
-    if( nOut>0 && fwrite(pOut, nOut, 1, out)!=1 ){
-      errorMsg("failed to write: %s\n", zFilename);
+  r.zGlob = sqlite3_mprintf("%.*s", (int)(zEq - zArg), zArg);
+  ig.aRule = sqlite3_realloc64(ig.aRule, (ig.nRule+1)*sizeof(CodecRule));
+  if( r.zGlob==0 || ig.aRule==0 ) errorMsg("Out of memory\n");
+  ig.aRule[ig.nRule++] = r;
+}
+
+/*
+** Return the codec rule for file zFilename.  The first rule whose GLOB
+** matches wins.
+*/
+static const CodecRule *codec_rule(const char *zFilename){
+  int i;
+  for(i=0; i<ig.nRule; i++){
+    if( sqlite3_strglob(ig.aRule[i].zGlob, zFilename)==0 ){
+      return &ig.aRule[i];
     }
-    sqlite3_free(pOut);
   }
-  fclose(out);
-  rc = chmod(zFilename, iMode&0777);
-  if( rc ) errorMsg("cannot change mode to %03o: %s\n", iMode, zFilename);
+  return &ig.dfltRule;
 }
 
 /*
-** Error out if there are any issues with the given filename
+** Queue a new job for file zFilename
 */
-static void check_filename(const char *z){
-  if( strncmp(z, "../", 3)==0 || sqlite3_strglob("*/../*", z)==0 ){
-    errorMsg("Filename with '..' in its path: %s\n", z);
+static void add_job(
+  const char *zFilename,    /* Name of the file */
+  struct stat *pStat,       /* Result of stat() on the file */
+  int eType,                /* JOB_FILE, JOB_CHUNKED or JOB_CHUNK */
+  sqlite3_int64 iOfst,      /* Offset of a JOB_CHUNK */
+  sqlite3_int64 szOrig,     /* Size of a JOB_CHUNK */
+  const CodecRule *pRule    /* How to compress the file */
+){
+  IngestJob x;
+  memset(&x, 0, sizeof(x));
+  x.zName = strdup(zFilename);
+  if( x.zName==0 ) errorMsg("Out of memory\n");
+  x.st = *pStat;
+  x.eType = eType;
+  x.iOfst = iOfst;
+  x.szOrig = szOrig;
+  x.pCodec = pRule->pCodec;
+  x.iLevel = pRule->iLevel;
+  x.iClass = -1;
+  x.iArg = ig.iArg;
+  if( ig.mbps>0.0 && x.pCodec && S_ISREG(pStat->st_mode) ){
+    x.iClass = rate_class(zFilename, pRule);
+    x.iLevel = ig.aClass[x.iClass].iLevel;
   }
-  if( sqlite3_strglob("*\\*", z)==0 ){
-    errorMsg("Filename with '\\' in its name: %s\n", z);
+  ingest_submit(&x);
+}
+
+/*
+** Content-defined chunking for --cdc.
+**
+** With chunks of a fixed size, inserting or removing a few bytes near the
+** start of a file shifts every chunk after it, so that no chunk of the new
+** version of the file matches one of the old.  --cdc instead cuts a file
+** wherever a rolling "gear" hash of the last 64 bytes has its top bits
+** clear, as in FastCDC.  The cut points move with the content, so apart
+** from those around a change, all chunks of the new version are found
+** in the archive already and are not stored again.
+**
+** Chunks are between 1/4 and 4 times the average size ig.szChunk.  Below
+** the average a cut needs two more clear bits than above it, which keeps
+** most chunks close to the average.  Bytes before the smallest size are
+** not hashed at all.
+**
+** The cut points are found on the main thread as each file is queued.
+** Each chunk is then a JOB_CHUNK like any other, read again by a worker,
+** normally from the page cache, then hashed and compressed if new.
+*/
+#define CDC_BUFFER (1024*1024)
+static sqlite3_uint64 aGear[256];
+
+/*
+** Fill aGear[] with pseudo-random numbers.  These must never change, or
+** new versions of files would no longer be cut like the old ones.
+*/
+static void cdc_init(void){
+  sqlite3_uint64 x = 0x73716c6172636463ULL;
+  int i;
+  for(i=0; i<256; i++){
+    sqlite3_uint64 z = (x += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z>>30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z>>27)) * 0x94d049bb133111ebULL;
+    aGear[i] = z ^ (z>>31);
   }
 }
 
 /*
-** Add a file to the database.
+** Queue a JOB_CHUNK for each content-defined chunk of file zFilename
 */
-static void add_file(
-  const char *zFilename,     /* Name of file to add */
-  int verboseFlag,           /* If true, show each file added */
-  int noCompress             /* If true, always omit compression */
+static void cdc_add(
+  const char *zFilename,    /* Name of the file */
+  struct stat *pStat,       /* Result of stat() on the file */
+  const CodecRule *pRule    /* How to compress the file */
 ){
+  sqlite3_int64 szAvg = ig.szChunk;
+  sqlite3_int64 szMin = szAvg/4;
+  sqlite3_int64 szMax = szAvg*4;
+  sqlite3_int64 iStart = 0;      /* Start of the current chunk */
+  sqlite3_int64 iOfst;           /* Offset of a[0] in the file */
+  sqlite3_int64 len = 0;         /* Bytes in the current chunk so far */
+  sqlite3_uint64 h = 0;          /* The gear hash */
+  sqlite3_uint64 maskS, maskL;   /* Cut when h&mask is zero */
+  int nBit = 0;
+  int fd;
+  char *a;
+  StageTimer t;
+
+  if( szMax>MX_INLINE ) szMax = MX_INLINE;
+  while( ((sqlite3_int64)2<<nBit)<=szAvg ) nBit++;
+  maskS = ~(~(sqlite3_uint64)0 >> (nBit+2));
+  maskL = ~(~(sqlite3_uint64)0 >> (nBit-2));
+  fd = open(zFilename, O_RDONLY);
+  if( fd<0 ) errorMsg("cannot open \"%s\" for reading\n", zFilename);
+  a = malloc( CDC_BUFFER );
+  if( a==0 ) errorMsg("Out of memory\n");
+  for(iOfst=0; iOfst<pStat->st_size; iOfst+=CDC_BUFFER){
+    sqlite3_int64 n = pStat->st_size - iOfst;
+    int i;
+    if( n>CDC_BUFFER ) n = CDC_BUFFER;
+    stats_begin(&t);
+    if( read_fully(fd, a, n, iOfst)!=n ){
+      errorMsg("unable to read %lld bytes of file %s\n", n, zFilename);
+    }
+    stats_end(&t, STAGE_READ);
+    for(i=0; i<n; i++){
+      if( ++len<=szMin ) continue;
+      h = (h<<1) + aGear[(unsigned char)a[i]];
+      if( (h & (len<szAvg ? maskS : maskL))==0 || len>=szMax ){
+        add_job(zFilename, pStat, JOB_CHUNK, iStart, len, pRule);
+        iStart += len;
+        len = 0;
+        h = 0;
+      }
+    }
+  }
+  if( len>0 ) add_job(zFilename, pStat, JOB_CHUNK, iStart, len, pRule);
+  close(fd);
+  free(a);
+}
+
+/*
+** The directory walk.
+**
+** Directories are scanned by a pool of threads, each of which lists one
+** directory at a time with getdents64(), stat()s every entry relative to
+** the directory with fstatat(), and sorts the entries by name.  The main
+** thread then consumes the scanned directories in the same order as a
+** plain recursive walk and turns the entries into ingest jobs, so the
+** archive and the -v output do not depend on the number of threads.
+**
+** Every subdirectory found by a scan becomes a new scan task, pushed on
+** the deque of the thread that found it.  Each thread takes tasks from
+** the tail of its own deque, which tends to follow the order in which
+** the main thread needs them, and when that is empty it steals from the
+** head of some other deque, where the largest subtrees usually are.  If
+** the main thread needs a directory that no thread has started on, it
+** scans that directory itself.
+**
+** At most WALK_BUDGET scanned entries wait to be consumed.  The scan
+** threads stop taking new tasks until the main thread catches up.
+**
+** The scan threads must not call into SQLite nor call errorMsg().  An
+** entry that cannot be stat()ed is reported when the main thread gets
+** to it.
+*/
+#define WALK_BUDGET   (256*1024)
+
+typedef struct WalkDir WalkDir;
+typedef struct WalkEntry WalkEntry;
+struct WalkEntry {
+  char *zPath;           /* Full name of the entry.  From malloc() */
+  int isStat;            /* 1 if st is valid, -1 if fstatat() failed */
+  struct stat st;        /* Result of fstatat() */
+  WalkDir *pDir;         /* Scan task for this entry, if it is a directory */
+};
+struct WalkDir {
+  WalkDir *pNextAll;     /* Next in the list of all WalkDir objects */
+  char *zPath;           /* Name of the directory.  From malloc() */
+  int iArg;              /* Index of the FILES argument being walked */
+  int eState;            /* One of the WALK_NEW... values below */
+  int nEntry;            /* Number of entries in aEntry[] */
+  WalkEntry *aEntry;     /* Entries of the directory */
+  int nOrder;            /* Number of entries in aOrder[] */
+  int *aOrder;           /* Visiting order.  See walk_order() */
+  sqlite3_int64 szFile;  /* Total size of the files in aEntry[] */
+  sqlite3_int64 nsWall;  /* Elapsed time of the scan, for --stats */
+  sqlite3_int64 nsCpu;   /* CPU time of the scan, for --stats */
+};
+
+/* Allowed values for WalkDir.eState */
+#define WALK_NEW   0     /* Not yet scanned */
+#define WALK_BUSY  1     /* A thread is scanning this directory */
+#define WALK_DONE  2     /* aEntry[] is ready */
+
+typedef struct WalkDeque WalkDeque;
+struct WalkDeque {
+  WalkDir **a;           /* Circular buffer of scan tasks */
+  unsigned nAlloc;       /* Slots in a[].  Always a power of two */
+  unsigned iHead;        /* Steal from here */
+  unsigned iTail;        /* Push and pop here */
+};
+
+static struct Walk {
+  int nThread;              /* Number of scan threads */
+  pthread_t *aThread;       /* The scan threads */
+  pthread_mutex_t mutex;    /* Protects all fields that follow */
+  pthread_cond_t cvWork;    /* New tasks, space in the budget, or shutdown */
+  pthread_cond_t cvDone;    /* Signaled when a scan finishes */
+  WalkDeque *aDeque;        /* One deque per scan thread, plus the main one */
+  WalkDir *pAll;            /* All WalkDir objects, for cleanup */
+  int nBuffered;            /* Scanned entries not yet consumed */
+  int nUnscanned;           /* Directories found but not yet scanned */
+  sqlite3_int64 szFound;    /* Total size of the files found so far */
+  int isLastArg;            /* The last FILES argument is being walked */
+  int shutdown;             /* Tell the scan threads to exit */
+} wk;
+
+/*
+** Lock and unlock wk.mutex, if there are scan threads
+*/
+static void walk_lock(void){
+  if( wk.nThread ) pthread_mutex_lock(&wk.mutex);
+}
+static void walk_unlock(void){
+  if( wk.nThread ) pthread_mutex_unlock(&wk.mutex);
+}
+
+/*
+** Return a new scan task for directory zPath, or NULL if out of memory.
+*/
+static WalkDir *walk_new_dir(const char *zPath, int iArg){
+  WalkDir *p = calloc(1, sizeof(*p));
+  if( p==0 ) return 0;
+  p->zPath = strdup(zPath);
+  if( p->zPath==0 ){
+    free(p);
+    return 0;
+  }
+  p->iArg = iArg;
+  return p;
+}
+
+
+/*
+** Add an entry named zName to directory p, and stat() it relative to
+** the open directory fd.  Return non-zero if out of memory.
+*/
+static int walk_add_entry(WalkDir *p, int fd, const char *zName){
+  WalkEntry *pE;
+  size_t nDir = strlen(p->zPath);
+  size_t nName = strlen(zName);
+  if( (p->nEntry & (p->nEntry-1))==0 ){
+    WalkEntry *aNew = realloc(p->aEntry,
+                          (p->nEntry ? 2*p->nEntry : 1)*sizeof(WalkEntry));
+    if( aNew==0 ) return 1;
+    p->aEntry = aNew;
+  }
+  pE = &p->aEntry[p->nEntry];
+  memset(pE, 0, sizeof(*pE));
+  pE->zPath = malloc( nDir + nName + 2 );
+  if( pE->zPath==0 ) return 1;
+  memcpy(pE->zPath, p->zPath, nDir);
+  pE->zPath[nDir] = '/';
+  memcpy(&pE->zPath[nDir+1], zName, nName+1);
+  p->nEntry++;
+  if( resume_check(p->iArg, pE->zPath)==RESUME_SKIP ){
+    /* Already in the archive.  No need to stat() it */
+    return 0;
+  }
+  pE->isStat = fstatat(fd, zName, &pE->st, 0)==0 ? 1 : -1;
+  if( pE->isStat>0 && S_ISREG(pE->st.st_mode) ) p->szFile += pE->st.st_size;
+  if( pE->isStat>0 && S_ISDIR(pE->st.st_mode) ){
+    pE->pDir = walk_new_dir(pE->zPath, p->iArg);
+    if( pE->pDir==0 ) return 1;
+  }
+  return 0;
+}
+
+/*
+** Entries are added to the archive in the order of the bytes of their
+** names, which is the order of the index on sqlar.name.  Each insert then
+** goes at the end of the index, so no index page is ever split, and
+** --resume only needs to remember the last name committed.
+**
+** A plain depth-first walk does not quite give that order, because the
+** content of directory "a" has names that begin with "a/" and these sort
+** after a sibling such as "a-b" or "a.c".  So each directory is visited
+** twice: once for its own entry, and once for its content, which sorts as
+** if it were the name of the directory followed by "/".  The visits are
+** recorded in WalkDir.aOrder[] as 2*i for aEntry[i] and 2*i+1 for the
+** content of aEntry[i].
+*/
+typedef struct WalkKey WalkKey;
+struct WalkKey {
+  const char *zPath;     /* Name of the entry */
+  int iVisit;            /* Value for WalkDir.aOrder[] */
+};
+
+/*
+** qsort() comparison function for WalkKey objects
+*/
+static int walk_key_cmp(const void *pA, const void *pB){
+  const WalkKey *pX = (const WalkKey*)pA;
+  const WalkKey *pY = (const WalkKey*)pB;
+  const unsigned char *x = (const unsigned char*)pX->zPath;
+  const unsigned char *y = (const unsigned char*)pY->zPath;
+  int cx, cy;
+  while( x[0] && x[0]==y[0] ){ x++; y++; }
+  cx = x[0] ? x[0] : (pX->iVisit & 1) ? '/' : 0;
+  cy = y[0] ? y[0] : (pY->iVisit & 1) ? '/' : 0;
+  if( cx!=cy ) return cx - cy;
+  return (pX->iVisit & 1) - (pY->iVisit & 1);
+}
+
+/*
+** Fill in p->aOrder[].  Return non-zero if out of memory.
+*/
+static int walk_order(WalkDir *p){
+  WalkKey *aKey;
+  int i;
+  int n = 0;
+  aKey = malloc( 2*p->nEntry*sizeof(WalkKey) + 1 );
+  p->aOrder = malloc( 2*p->nEntry*sizeof(int) + 1 );
+  if( aKey==0 || p->aOrder==0 ){
+    free(aKey);
+    return 1;
+  }
+  for(i=0; i<p->nEntry; i++){
+    aKey[n].zPath = p->aEntry[i].zPath;
+    aKey[n++].iVisit = 2*i;
+    if( p->aEntry[i].pDir ){
+      aKey[n].zPath = p->aEntry[i].zPath;
+      aKey[n++].iVisit = 2*i + 1;
+    }
+  }
+  qsort(aKey, n, sizeof(WalkKey), walk_key_cmp);
+  for(i=0; i<n; i++) p->aOrder[i] = aKey[i].iVisit;
+  p->nOrder = n;
+  free(aKey);
+  return 0;
+}
+
+/*
+** List and stat() all entries of directory p.  A directory that cannot
+** be opened is treated as empty.  Returns non-zero if out of memory.
+*/
+static int walk_list(WalkDir *p){
+  int fd = open(p->zPath, O_RDONLY|O_DIRECTORY);
+  int rc = 0;
+  if( fd<0 ) return 0;
+#if defined(__linux__) && defined(SYS_getdents64)
+  {
+    static const int nBuf = 64*1024;
+    char *aBuf = malloc( nBuf );
+    long n;
+    if( aBuf==0 ){
+      close(fd);
+      return 1;
+    }
+    while( rc==0 && (n = syscall(SYS_getdents64, fd, aBuf, nBuf))>0 ){
+      long i;
+      for(i=0; i<n && rc==0; ){
+        /* Layout of struct linux_dirent64 */
+        unsigned short nRec;
+        unsigned char eType;
+        const char *zName;
+        memcpy(&nRec, &aBuf[i+16], sizeof(nRec));
+        eType = (unsigned char)aBuf[i+18];
+        zName = &aBuf[i+19];
+        i += nRec;
+        if( eType==DT_DIR && zName[0]=='.'
+         && (zName[1]==0 || (zName[1]=='.' && zName[2]==0)) ){
+          continue;
+        }
+        rc = walk_add_entry(p, fd, zName);
+      }
+    }
+    free(aBuf);
+    close(fd);
+  }
+#else
+  {
+    DIR *d = fdopendir(fd);
+    struct dirent *pEntry;
+    if( d==0 ){
+      close(fd);
+      return 0;
+    }
+    while( rc==0 && (pEntry = readdir(d))!=0 ){
+      if( strcmp(pEntry->d_name,".")==0 || strcmp(pEntry->d_name,"..")==0 ){
+        continue;
+      }
+      rc = walk_add_entry(p, dirfd(d), pEntry->d_name);
+    }
+    closedir(d);
+  }
+#endif
+  if( rc==0 ) rc = walk_order(p);
+  return rc;
+}
+
+/*
+** Run walk_list() on directory p, and time it for --stats
+*/
+static int walk_scan(WalkDir *p){
+  sqlite3_int64 tWall = 0, tCpu = 0;
   int rc;
-  struct stat x;
-  int szOrig;
-  int szCompr;
-  const char *zName;
+  if( stats.statsFlag ){
+    tWall = wall_ns();
+    tCpu = thread_ns();
+  }
+  rc = walk_list(p);
+  if( stats.statsFlag ){
+    p->nsWall = wall_ns() - tWall;
+    p->nsCpu = thread_ns() - tCpu;
+  }
+  return rc;
+}
 
-  check_filename(zFilename);
-  rc = stat(zFilename, &x);
-  if( rc ) errorMsg("no such file or directory: %s\n", zFilename);
-  if( x.st_size>1000000000 ){
-    errorMsg("file too big: %s\n", zFilename);
+/*
+** Once the last FILES argument has been reached and no directory is left
+** to scan, the total size of the files to be added is known, and
+** --progress can show the time left.  Call with wk.mutex held.
+*/
+static void walk_total(void){
+  if( wk.isLastArg && wk.nUnscanned==0 ) stats.nTotal = wk.szFound;
+}
+
+/*
+** Push scan task p on the tail of deque pQ.  Return non-zero if out of
+** memory.
+*/
+static int walk_push(WalkDeque *pQ, WalkDir *p){
+  if( pQ->iTail - pQ->iHead>=pQ->nAlloc ){
+    unsigned nNew = pQ->nAlloc ? 2*pQ->nAlloc : 64;
+    WalkDir **aNew = malloc( nNew*sizeof(WalkDir*) );
+    unsigned i;
+    if( aNew==0 ) return 1;
+    for(i=pQ->iHead; i!=pQ->iTail; i++){
+      aNew[i & (nNew-1)] = pQ->a[i & (pQ->nAlloc-1)];
+    }
+    free(pQ->a);
+    pQ->a = aNew;
+    pQ->nAlloc = nNew;
   }
-  if( pStmt==0 ){
-    db_prepare("REPLACE INTO sqlar(name,mode,mtime,sz,data)"
-               " VALUES(?1,?2,?3,?4,?5)");
+  pQ->a[(pQ->iTail++) & (pQ->nAlloc-1)] = p;
+  return 0;
+}
+
+/*
+** Mark directory p as scanned.  Queue its subdirectories on deque iQ,
+** last first, so that popping from the tail visits them in order.
+** Call with wk.mutex held.  Return non-zero if out of memory.
+*/
+static int walk_publish(WalkDir *p, int iQ){
+  int i;
+  int rc = 0;
+  for(i=p->nOrder-1; i>=0; i--){
+    WalkDir *pSub;
+    if( (p->aOrder[i] & 1)==0 ) continue;
+    pSub = p->aEntry[p->aOrder[i]/2].pDir;
+    pSub->pNextAll = wk.pAll;
+    wk.pAll = pSub;
+    wk.nUnscanned++;
+    if( wk.nThread && rc==0 ) rc = walk_push(&wk.aDeque[iQ], pSub);
   }
-  zName = zFilename;
-  while( zName[0]=='/' ) zName++;
-  sqlite3_bind_text(pStmt, 1, zName, -1, SQLITE_STATIC);
-  sqlite3_bind_int(pStmt, 2, x.st_mode);
-  sqlite3_bind_int64(pStmt, 3, x.st_mtime);
-  if( S_ISREG(x.st_mode) ){
-    char *zContent = read_file(zFilename, &szOrig, &szCompr, noCompress);
-    sqlite3_bind_int(pStmt, 4, szOrig);
-    sqlite3_bind_blob(pStmt, 5, zContent, szCompr, sqlite3_free);
-    if( verboseFlag ){
-      if( szCompr<szOrig ){
-        int pct = szOrig ? (100*(sqlite3_int64)szCompr)/szOrig : 0;
-        printf("  added: %s (deflate %d%%)\n", zFilename, 100-pct);
-      }else{
-        printf("  added: %s\n", zFilename);
+  wk.nUnscanned--;
+  wk.szFound += p->szFile;
+  p->eState = WALK_DONE;
+  wk.nBuffered += p->nEntry;
+  if( wk.nThread ){
+    pthread_cond_broadcast(&wk.cvDone);
+    pthread_cond_broadcast(&wk.cvWork);
+  }
+  return rc;
+}
+
+/*
+** Take a scan task for thread iMe, from its own deque if possible or
+** else from some other deque.  Return NULL if there is nothing to do.
+** Tasks that the main thread has already scanned are discarded.
+*/
+static WalkDir *walk_take(int iMe){
+  int i;
+  WalkDeque *pQ = &wk.aDeque[iMe];
+  while( pQ->iTail!=pQ->iHead ){
+    WalkDir *p = pQ->a[(--pQ->iTail) & (pQ->nAlloc-1)];
+    if( p->eState==WALK_NEW ) return p;
+  }
+  for(i=1; i<=wk.nThread; i++){
+    pQ = &wk.aDeque[(iMe+i) % (wk.nThread+1)];
+    while( pQ->iTail!=pQ->iHead ){
+      WalkDir *p = pQ->a[(pQ->iHead++) & (pQ->nAlloc-1)];
+      if( p->eState==WALK_NEW ) return p;
+    }
+  }
+  return 0;
+}
+
+/*
+** Main routine for the scan threads
+*/
+static void *walk_worker(void *pArg){
+  int iMe = (int)(size_t)pArg;
+  int rc = 0;
+  WalkDir *p = 0;
+  pthread_mutex_lock(&wk.mutex);
+  while( rc==0 ){
+    while( !wk.shutdown
+        && (wk.nBuffered>=WALK_BUDGET || (p = walk_take(iMe))==0) ){
+      pthread_cond_wait(&wk.cvWork, &wk.mutex);
+    }
+    if( wk.shutdown ) break;
+    p->eState = WALK_BUSY;
+    pthread_mutex_unlock(&wk.mutex);
+    rc = walk_scan(p);
+    pthread_mutex_lock(&wk.mutex);
+    rc |= walk_publish(p, iMe);
+  }
+  pthread_mutex_unlock(&wk.mutex);
+  if( rc ){
+    fprintf(stderr, "Out of memory\n");
+    exit(1);
+  }
+  return 0;
+}
+
+/*
+** Start nThread directory scan threads.
+*/
+static void walk_start(int nThread){
+  int i;
+  if( nThread<=1 ) return;
+  wk.nThread = nThread;
+  wk.aThread = calloc(nThread, sizeof(pthread_t));
+  wk.aDeque = calloc(nThread+1, sizeof(WalkDeque));
+  if( wk.aThread==0 || wk.aDeque==0 ) errorMsg("Out of memory\n");
+  pthread_mutex_init(&wk.mutex, 0);
+  pthread_cond_init(&wk.cvWork, 0);
+  pthread_cond_init(&wk.cvDone, 0);
+  for(i=0; i<nThread; i++){
+    if( pthread_create(&wk.aThread[i], 0, walk_worker, (void*)(size_t)i) ){
+      errorMsg("cannot start directory scan thread\n");
+    }
+  }
+}
+
+/*
+** Stop the scan threads and free all memory used by the walk.
+*/
+static void walk_finish(void){
+  int i;
+  if( wk.nThread ){
+    pthread_mutex_lock(&wk.mutex);
+    wk.shutdown = 1;
+    pthread_cond_broadcast(&wk.cvWork);
+    pthread_mutex_unlock(&wk.mutex);
+    for(i=0; i<wk.nThread; i++) pthread_join(wk.aThread[i], 0);
+    for(i=0; i<=wk.nThread; i++) free(wk.aDeque[i].a);
+    free(wk.aDeque);
+    free(wk.aThread);
+    wk.nThread = 0;
+  }
+  while( wk.pAll ){
+    WalkDir *p = wk.pAll;
+    wk.pAll = p->pNextAll;
+    free(p->zPath);
+    free(p);
+  }
+}
+
+/*
+** Hand the JOB_SOLID that is being filled to the pipeline, if it has any
+** entries.
+*/
+static void solid_flush(void){
+  IngestJob x = ig.solid;
+  if( x.nMember==0 ) return;
+  memset(&ig.solid, 0, sizeof(ig.solid));
+  x.zName = strdup(x.aMember[0].zName);
+  if( x.zName==0 ) errorMsg("Out of memory\n");
+  x.eType = JOB_SOLID;
+  x.pCodec = ig.dfltRule.pCodec;
+  x.iLevel = ig.dfltRule.iLevel;
+  x.iClass = -1;
+  x.iArg = x.aMember[0].iArg;
+  ingest_submit(&x);
+}
+
+/*
+** Add an entry to the JOB_SOLID that is being filled.  Entries without
+** content go into the same job, so that all entries are still inserted
+** in the order in which they were found.
+*/
+static void solid_add(const char *zFilename, struct stat *pStat){
+  IngestJob *p = &ig.solid;
+  SolidMember *pM;
+  if( (p->nMember & (p->nMember-1))==0 ){
+    SolidMember *aNew = realloc(p->aMember,
+                        (p->nMember ? 2*p->nMember : 1)*sizeof(SolidMember));
+    if( aNew==0 ) errorMsg("Out of memory\n");
+    p->aMember = aNew;
+  }
+  pM = &p->aMember[p->nMember++];
+  memset(pM, 0, sizeof(*pM));
+  pM->zName = strdup(zFilename);
+  if( pM->zName==0 ) errorMsg("Out of memory\n");
+  pM->st = *pStat;
+  pM->iArg = ig.iArg;
+  if( S_ISREG(pStat->st_mode) ) p->szOrig += pStat->st_size;
+  if( p->szOrig>=ig.szSolid || p->nMember>=SOLID_MEMBERS ) solid_flush();
+}
+
+/*
+** Add a single file or directory, without its content, to the archive.
+** pStat is the result of stat() on the file.
+*/
+static void add_entry(const char *zFilename, struct stat *pStat){
+  struct stat x = *pStat;
+  sqlite3_int64 szChunk;
+  const CodecRule *pRule;
+
+  pRule = codec_rule(zFilename);
+  szChunk = ig.szChunk;
+  if( szChunk==0 && x.st_size>MX_INLINE ) szChunk = CHUNK_SIZE;
+  if( szChunk==0 && x.st_size>STREAM_SIZE
+   && ((pRule->pCodec && pRule->pCodec!=&aCodec[0]) || withoutRowid)
+  ){
+    /* Only zlib can compress a large file incrementally, and only into
+    ** a table that has a rowid */
+    szChunk = CHUNK_SIZE;
+  }
+  if( update_unchanged(zFilename, &x) ){
+    /* Already in the archive.  Nothing to do. */
+    if( S_ISREG(x.st_mode) ) stats.nSkip += x.st_size;
+  }else if( update_directory(zFilename, &x) ){
+    /* Mode or mtime changed in place */
+  }else if( ig.szSolid>0 && pRule==&ig.dfltRule && pRule->pCodec
+         && (!S_ISREG(x.st_mode) || x.st_size<=ig.szSolid/16) ){
+    solid_add(zFilename, &x);
+  }else if( S_ISREG(x.st_mode) && szChunk>0
+         && (x.st_size>szChunk || (ig.dedupFlag && x.st_size>0)) ){
+    sqlite3_int64 iOfst;
+    solid_flush();
+    add_job(zFilename, &x, JOB_CHUNKED, 0, 0, pRule);
+    if( ig.cdcFlag ){
+      cdc_add(zFilename, &x, pRule);
+    }else{
+      for(iOfst=0; iOfst<x.st_size; iOfst+=szChunk){
+        sqlite3_int64 n = x.st_size - iOfst;
+        add_job(zFilename, &x, JOB_CHUNK, iOfst, n<szChunk ? n : szChunk,
+                pRule);
       }
     }
   }else{
-    sqlite3_bind_int(pStmt, 4, 0);
-    sqlite3_bind_null(pStmt, 5);
-    if( verboseFlag ) printf("  added: %s\n", zFilename);
+    solid_flush();
+    add_job(zFilename, &x, JOB_FILE, 0, 0, pRule);
   }
-  rc = sqlite3_step(pStmt);
-  if( rc!=SQLITE_DONE ){
-    errorMsg("Insert failed for %s: %s\n", zFilename, sqlite3_errmsg(db));
+}
+
+/*
+** Add the content of directory p, which might not have been scanned yet,
+** and all of its subdirectories.
+*/
+static void walk_dir(WalkDir *p){
+  int i;
+  walk_lock();
+  if( p->eState==WALK_NEW ){
+    p->eState = WALK_BUSY;
+    walk_unlock();
+    if( walk_scan(p) ) errorMsg("Out of memory\n");
+    walk_lock();
+    if( walk_publish(p, wk.nThread) ) errorMsg("Out of memory\n");
   }
-  sqlite3_reset(pStmt);
-  if( S_ISDIR(x.st_mode) ){
-    DIR *d;
-    struct dirent *pEntry;
-    char *zSubpath;
-    d = opendir(zFilename);
-    if( d ){
-      while( (pEntry = readdir(d))!=0 ){
-        if( strcmp(pEntry->d_name,".")==0 || strcmp(pEntry->d_name,"..")==0 ){
-          continue;
-        }
-        zSubpath = sqlite3_mprintf("%s/%s", zFilename, pEntry->d_name);
-        add_file(zSubpath, verboseFlag, noCompress);
-        sqlite3_free(zSubpath);
+  while( p->eState!=WALK_DONE ){
+    pthread_cond_wait(&wk.cvDone, &wk.mutex);
+  }
+  walk_total();
+  walk_unlock();
+  stats.aWall[STAGE_STAT] += p->nsWall;
+  stats.aCpu[STAGE_STAT] += p->nsCpu;
+  for(i=0; i<p->nOrder; i++){
+    WalkEntry *pE = &p->aEntry[p->aOrder[i]/2];
+    int eResume;
+    if( p->aOrder[i] & 1 ){
+      walk_dir(pE->pDir);
+      continue;
+    }
+    check_filename(pE->zPath);
+    eResume = resume_check(p->iArg, pE->zPath);
+    if( eResume!=RESUME_SKIP ){
+      if( pE->isStat<0 ){
+        errorMsg("no such file or directory: %s\n", pE->zPath);
       }
-      closedir(d);
+      if( eResume==RESUME_ADD ) add_entry(pE->zPath, &pE->st);
     }
   }
+  for(i=0; i<p->nEntry; i++) free(p->aEntry[i].zPath);
+  free(p->aEntry);
+  free(p->aOrder);
+  p->aEntry = 0;
+  p->aOrder = 0;
+  walk_lock();
+  wk.nBuffered -= p->nEntry;
+  if( wk.nThread ) pthread_cond_broadcast(&wk.cvWork);
+  walk_unlock();
+}
+
+/*
+** Add a file to the database.  If the file is a directory, add all of
+** its content too.
+*/
+static void add_file(const char *zFilename){
+  int rc;
+  struct stat x;
+  int eResume;
+  StageTimer t;
+
+  check_filename(zFilename);
+  eResume = resume_check(ig.iArg, zFilename);
+  if( eResume==RESUME_SKIP ) return;
+  stats_begin(&t);
+  rc = stat(zFilename, &x);
+  stats_end(&t, STAGE_STAT);
+  if( rc ) errorMsg("no such file or directory: %s\n", zFilename);
+  walk_lock();
+  if( S_ISREG(x.st_mode) ) wk.szFound += x.st_size;
+  if( S_ISDIR(x.st_mode) ) wk.nUnscanned++;
+  walk_total();
+  walk_unlock();
+  if( eResume==RESUME_ADD ) add_entry(zFilename, &x);
+  if( S_ISDIR(x.st_mode) ){
+    WalkDir *p = walk_new_dir(zFilename, ig.iArg);
+    if( p==0 ) errorMsg("Out of memory\n");
+    walk_lock();
+    p->pNextAll = wk.pAll;
+    wk.pAll = p;
+    walk_unlock();
+    walk_dir(p);
+  }
+}
+
+/*
+** Return the argument of a command-line option that takes a value, as
+** either "-jN" or "-j N".  On entry, argv[*pi][*pj] is the option letter.
+** On exit, *pi and *pj are moved to the last character of the value.
+*/
+static const char *option_value(int argc, char **argv, int *pi, int *pj){
+  int i = *pi;
+  const char *z = &argv[i][*pj+1];
+  if( z[0]==0 ){
+    if( i+1>=argc ) showHelp(argv[0]);
+    z = argv[++i];
+  }
+  *pi = i;
+  *pj = (int)strlen(argv[i]) - 1;
+  return z;
+}
+
+/*
+** Interpret a size argument such as "4096", "64K", or "16M".
+*/
+static sqlite3_int64 size_value(const char *z){
+  char *zEnd;
+  sqlite3_int64 n = strtoll(z, &zEnd, 10);
+  switch( zEnd[0] ){
+    case 'k':  case 'K':  n *= 1024;              break;
+    case 'm':  case 'M':  n *= 1024*1024;         break;
+    case 'g':  case 'G':  n *= 1024*1024*1024;    break;
+  }
+  return n;
 }
 
 int main(int argc, char **argv){
@@ -523,13 +5987,80 @@ int main(int argc, char **argv){
   int noCompress = 0;
   int seeFlag = 0;
   int deleteFlag = 0;
+  int nWorker = 0;
+  int updateFlag = 0;
+  int dedupFlag = 0;
+  sqlite3_int64 szChunk = 0;
+  int iLevel = -1;
+  int resumeFlag = 0;
+  int dictFlag = 0;
+  int nDict = 0;
   int i, j;
 
   if( sqlite3_strglob("*/unsqlar", argv[0])==0 ){
     extractFlag = 1;
   }
+  codec_rule_add(aCodec[0].zName);
+  ig.nIoDepth = IO_DEPTH;
   for(i=1; i<argc; i++){
-    if( argv[i][0]=='-' ){
+    if( argv[i][0]=='-' && argv[i][1]=='-' && argv[i][2] ){
+      const char *z = &argv[i][2];
+      if( strcmp(z, "dedup")==0 ){
+        dedupFlag = 1;
+      }else if( strcmp(z, "cdc")==0 ){
+        dedupFlag = 1;
+        ig.cdcFlag = 1;
+        cdc_init();
+      }else if( strcmp(z, "dict")==0 ){
+        dictFlag = 1;
+      }else if( strcmp(z, "solid")==0 ){
+        ig.szSolid = SOLID_BLOCK;
+      }else if( strncmp(z, "solid=", 6)==0 ){
+        sqlite3_int64 sz = size_value(&z[6]);
+        if( sz<4096 || sz>STREAM_SIZE*16 ){
+          errorMsg("block size must be between 4K and %dM\n",
+                   STREAM_SIZE*16/(1024*1024));
+        }
+        ig.szSolid = (int)sz;
+      }else if( strncmp(z, "codec=", 6)==0 ){
+        codec_rule_add(&z[6]);
+      }else if( strcmp(z, "compress-all")==0 ){
+        compressAll = 1;
+      }else if( strcmp(z, "bulk")==0 ){
+        bulkFlag = 1;
+      }else if( strcmp(z, "resume")==0 ){
+        resumeFlag = 1;
+      }else if( strcmp(z, "without-rowid")==0 ){
+        withoutRowid = 1;
+      }else if( strcmp(z, "stats")==0 ){
+        stats.statsFlag = 1;
+      }else if( strncmp(z, "stats=", 6)==0 ){
+        stats.statsFlag = 1;
+        stats.zJson = &z[6];
+      }else if( strcmp(z, "progress")==0 ){
+        stats.progressFlag = 1;
+      }else if( strcmp(z, "pwrite")==0 ){
+        pwriteFlag = 1;
+      }else if( strcmp(z, "mmap")==0 ){
+        mmapSize = MMAP_SIZE;
+      }else if( strncmp(z, "mmap=", 5)==0 ){
+        mmapSize = size_value(&z[5]);
+      }else if( strncmp(z, "io-depth=", 9)==0 ){
+        ig.nIoDepth = atoi(&z[9]);
+        if( ig.nIoDepth<0 || ig.nIoDepth>4096 ){
+          errorMsg("io-depth must be between 0 and 4096\n");
+        }
+      }else if( strncmp(z, "commit=", 7)==0 ){
+        ig.mxBatchFile = atoi(&z[7]);
+      }else if( strncmp(z, "commit-size=", 12)==0 ){
+        ig.mxBatchByte = size_value(&z[12]);
+      }else if( strncmp(z, "rate=", 5)==0 ){
+        ig.mbps = atof(&z[5]);
+        if( ig.mbps<=0.0 ) errorMsg("bad --rate: %s\n", &z[5]);
+      }else{
+        showHelp(argv[0]);
+      }
+    }else if( argv[i][0]=='-' ){
       for(j=1; argv[i][j]; j++){
         switch( argv[i][j] ){
           case 'l':   listFlag = 1;    break;
@@ -538,6 +6069,15 @@ int main(int argc, char **argv){
           case 'x':   extractFlag = 1; break;
           case 'e':   seeFlag++;       break;
           case 'd':   deleteFlag = 1;  break;
+          case 'u':   updateFlag++;    break;
+          case 'j':   nWorker = atoi(option_value(argc, argv, &i, &j));
+                      break;
+          case 'c':   szChunk = size_value(option_value(argc, argv, &i, &j));
+                      break;
+          case '0':  case '1':  case '2':  case '3':  case '4':
+          case '5':  case '6':  case '7':  case '8':  case '9':
+                      iLevel = argv[i][j] - '0';
+                      break;
           case '-':   break;
           default:    showHelp(argv[0]);
         }
@@ -551,70 +6091,185 @@ int main(int argc, char **argv){
     }
   }
   if( zArchive==0 ) showHelp(argv[0]);
+  if( szChunk!=0 && (szChunk<1024 || szChunk>MX_INLINE) ){
+    errorMsg("chunk size must be between 1K and %d bytes\n", MX_INLINE);
+  }
+  if( (bulkFlag || resumeFlag) && ig.mxBatchFile==0 && ig.mxBatchByte==0 ){
+    ig.mxBatchFile = BATCH_FILES;
+    ig.mxBatchByte = BATCH_BYTES;
+  }
+  if( iLevel>=0 && ig.dfltRule.pCodec ){
+    const Codec *pCodec = ig.dfltRule.pCodec;
+    if( iLevel<pCodec->iMinLevel || iLevel>pCodec->iMaxLevel ){
+      errorMsg("%s compression level must be between %d and %d\n",
+               pCodec->zName, pCodec->iMinLevel, pCodec->iMaxLevel);
+    }
+    ig.dfltRule.iLevel = iLevel;
+  }
   if( listFlag || deleteFlag ){
     if( deleteFlag && nFiles==0 ){
       errorMsg("Specify one or more files to delete on the command-line");
     }
     db_open(zArchive, deleteFlag, seeFlag, azFiles, nFiles);
     if( verboseFlag ){
-      db_prepare(
-          "SELECT name, sz, length(data), mode, datetime(mtime,'unixepoch')"
-          " FROM sqlar WHERE name_on_list(name) ORDER BY name"
-      );
+      /* The stored size of a member of a --solid block is its share of
+      ** the compressed block. */
+      char *zSql = sqlite3_mprintf(
+          "SELECT name, sz, coalesce(length(data)%s%s, NULL),"
+          " mode, datetime(mtime,'unixepoch'), substr(data,1,2)"
+          " FROM sqlar WHERE %s ORDER BY name",
+          hasChunks ?
+            ", (SELECT sum(coalesce(length(c.data),"
+            "     (SELECT length(t.data) FROM sqlar_content t"
+            "       WHERE t.hash=c.hash)))"
+            "    FROM sqlar_chunk c WHERE c.name=sqlar.name)" : "",
+          hasSolid ?
+            ", (SELECT sqlar.sz*length(b.data)/b.sz"
+            "    FROM sqlar_solid s, sqlar_block b"
+            "   WHERE s.name=sqlar.name AND b.id=s.block)" : "",
+          zNameWhere);
+      if( zSql==0 ) errorMsg("Out of memory\n");
+      db_prepare(zSql);
+      sqlite3_free(zSql);
       while( sqlite3_step(pStmt)==SQLITE_ROW ){
+        const unsigned char *a = sqlite3_column_blob(pStmt, 5);
         if( deleteFlag ) printf("DELETE ");
-        printf("%10d %10d %03o %s %s\n", 
-               sqlite3_column_int(pStmt, 1),
-               sqlite3_column_int(pStmt, 2),
+        printf("%10lld %10lld %03o %s %s\n", 
+               sqlite3_column_int64(pStmt, 1),
+               sqlite3_column_int64(pStmt, 2),
                sqlite3_column_int(pStmt, 3)&0777,
                sqlite3_column_text(pStmt, 4),
                sqlite3_column_text(pStmt, 0));
+        /* Count zlib content with the FDICT flag */
+        if( sqlite3_column_int64(pStmt, 1)!=sqlite3_column_int64(pStmt, 2)
+         && sqlite3_column_bytes(pStmt, 5)==2
+         && codec_detect((const char*)a, 2)==&aCodec[0] && (a[1]&0x20)!=0
+        ){
+          nDict++;
+        }
+      }
+      if( zlibDict && !deleteFlag ){
+        printf("dictionary: %d bytes, used by %d files\n",
+               (int)nZlibDict, nDict);
       }
     }else{
-      db_prepare(
-          "SELECT name FROM sqlar WHERE name_on_list(name) ORDER BY name"
-      );
+      char *zSql = name_sql("SELECT name FROM sqlar WHERE %s ORDER BY name");
+      db_prepare(zSql);
+      sqlite3_free(zSql);
       while( sqlite3_step(pStmt)==SQLITE_ROW ){
         if( deleteFlag ) printf("DELETE ");
         printf("%s\n", sqlite3_column_text(pStmt,0));
       }
     }
     if( deleteFlag ){
-      sqlite3_exec(db, "DELETE FROM sqlar WHERE name_on_list(name)", 0, 0, 0);
+      char *zSql;
+      if( hasChunks ){
+        zSql = name_sql("DELETE FROM sqlar_chunk WHERE name IN"
+                        " (SELECT name FROM sqlar WHERE %s)");
+        sqlite3_exec(db, zSql, 0, 0, 0);
+        sqlite3_free(zSql);
+      }
+      if( hasSolid ){
+        zSql = name_sql("DELETE FROM sqlar_solid WHERE name IN"
+                        " (SELECT name FROM sqlar WHERE %s)");
+        sqlite3_exec(db, zSql, 0, 0, 0);
+        sqlite3_free(zSql);
+      }
+      zSql = name_sql("DELETE FROM sqlar WHERE %s");
+      sqlite3_exec(db, zSql, 0, 0, 0);
+      sqlite3_free(zSql);
+      db_gc_content();
     }
     db_close(1);
   }else if( extractFlag ){
-    const char *zSql;
+    char *zSql;
     db_open(zArchive, 0, seeFlag, azFiles, nFiles);
-    zSql = "SELECT name, mode, mtime, sz, data FROM sqlar"
-           " WHERE name_on_list(name)";
+    /* BLOBs larger than STREAM_SIZE are not loaded by the query.  They
+    ** are read incrementally by write_blob() instead, except from a
+    ** WITHOUT ROWID table. */
+    if( withoutRowid ){
+      zSql = name_sql("SELECT name, mode, mtime, sz, length(data), data, 0"
+                      " FROM sqlar WHERE %s");
+    }else{
+      zSql = name_sql("SELECT name, mode, mtime, sz, length(data),"
+                      " CASE WHEN length(data)<=?1 THEN data END,"
+                      " rowid FROM sqlar WHERE %s");
+    }
+    stats_start(1);
+    if( stats.progressFlag ){
+      char *zTotal = name_sql("SELECT total(sz) FROM sqlar WHERE %s");
+      db_prepare(zTotal);
+      sqlite3_free(zTotal);
+      if( sqlite3_step(pStmt)==SQLITE_ROW ){
+        stats.nTotal = sqlite3_column_int64(pStmt, 0);
+      }
+    }
     db_prepare(zSql);
-    while( sqlite3_step(pStmt)==SQLITE_ROW ){
-      const char *zFN = (const char*)sqlite3_column_text(pStmt, 0);
+    sqlite3_free(zSql);
+    sqlite3_bind_int(pStmt, 1, STREAM_SIZE);
+    extract_start(nWorker);
+    while( 1 ){
+      const char *zFN;
+      sqlite3_int64 sz;
+      int nCompr = -1;
+      StageTimer t;
+      int rc;
+      stats_begin(&t);
+      rc = sqlite3_step(pStmt);
+      stats_end(&t, STAGE_QUERY);
+      if( rc!=SQLITE_ROW ) break;
+      zFN = (const char*)sqlite3_column_text(pStmt, 0);
+      sz = sqlite3_column_int64(pStmt, 3);
+      if( sqlite3_column_type(pStmt,4)!=SQLITE_NULL ){
+        nCompr = sqlite3_column_int(pStmt, 4);
+        stats.nIn += nCompr;
+      }
       check_filename(zFN);
       if( zFN[0]=='/' ){
         errorMsg("absolute pathname: %s\n", zFN);
       }
-      if( sqlite3_column_type(pStmt,4)==SQLITE_BLOB && access(zFN, F_OK)==0 ){
+      if( (nCompr>=0 || sz>0) && access(zFN, F_OK)==0 ){
         errorMsg("file already exists: %s\n", zFN);
       }
       if( verboseFlag ) printf("%s\n", zFN);
-      write_file(zFN, sqlite3_column_int(pStmt,1),
+      (ex.nWorker ? extract_file : write_file)(zFN,
+                 sqlite3_column_int(pStmt,1),
                  sqlite3_column_int64(pStmt,2),
-                 sqlite3_column_int(pStmt,3),
-                 sqlite3_column_blob(pStmt,4),
-                 sqlite3_column_bytes(pStmt,4));
+                 sz, sqlite3_column_blob(pStmt,5), nCompr,
+                 sqlite3_column_int64(pStmt,6));
+      stats.nFile++;
+      stats.nOut += sz;
+      stats_progress(0);
     }
+    extract_finish();
     db_close(1);
+    stats_report();
   }else{
     if( azFiles==0 ){
       errorMsg("Specify one or more files to add on the command-line");
     }
     db_open(zArchive, 1, seeFlag, 0, 0);
+    if( dictFlag && !noCompress ) dict_create(azFiles, nFiles, verboseFlag);
+    if( updateFlag ) update_load();
+    stats_start(0);
+    ingest_start(nWorker, verboseFlag, noCompress, dedupFlag, szChunk);
+    resume_load(azFiles, nFiles, resumeFlag);
+    walk_start(nWorker);
     for(i=0; i<nFiles; i++){
-      add_file(azFiles[i], verboseFlag, noCompress);
+      ig.iArg = i;
+      wk.isLastArg = i==nFiles-1;
+      add_file(azFiles[i]);
     }
+    solid_flush();
+    walk_finish();
+    ingest_finish();
+    ingest_report();
+    ingest_free_content();
+    if( updateFlag>1 ) update_remove_missing(azFiles, nFiles);
+    if( nChunkDeleted ) db_gc_content();
+    resume_done();
     db_close(1);
+    stats_report();
   }
   return 0;
 }
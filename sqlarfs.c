@@ -19,6 +19,7 @@
 #include <sys/types.h>
 #include <assert.h>
 #include <ctype.h>
+#include "compress.h"
 
 /*
 ** Global state information about the archive
@@ -29,9 +30,21 @@ struct sGlobal {
   sqlite3_stmt *pFList;  /* Prepared statement to list all files */
   sqlite3_stmt *pExists; /* Prepared statement to check if a file exists */
   sqlite3_stmt *pRead;   /* Prepared statement to get file content */
+  sqlite3_stmt *pChunk;  /* Prepared statement to get one chunk of a file */
+  sqlite3_stmt *pSolid;  /* Prepared statement to find the block of a file */
+  sqlite3_stmt *pBlock;  /* Prepared statement to read a --solid block */
   char *zCacheName;      /* Cached file */
-  unsigned long int szCache; /* Size of the cached file */
-  char *zCacheData;      /* Content of the cached files */
+  sqlite3_int64 szFile;  /* Total size of the cached file */
+  sqlite3_int64 iCacheOfst;  /* Offset of zCacheData within the file */
+  unsigned long int szCache; /* Number of bytes in zCacheData */
+  char *zCacheData;      /* Cached content, the whole file or one chunk */
+  struct {               /* Recently used --solid blocks, decompressed */
+    sqlite3_int64 iBlock;    /* Id of the block */
+    unsigned long int sz;    /* Size of a[] in bytes */
+    char *a;                 /* Content of the block */
+    unsigned iUsed;          /* When this entry was last used */
+  } aBlock[4];
+  unsigned iBlockClock;  /* Incremented each time a block is used */
   pid_t uid;             /* User ID for all content files */
   gid_t gid;             /* Group ID for all content files */
 } g;
@@ -138,16 +151,141 @@ static int sqlarfs_open(const char *path, struct fuse_file_info *fi){
 
 
 /*
-** Load the file named path[] into the cache, if it is not there already.
+** Install the zlib dictionary of the archive, if it has one.  Small
+** files that were added with "sqlar --dict" cannot be read without it.
+*/
+static void loadDict(void){
+  sqlite3_stmt *p = 0;
+  if( sqlite3_prepare_v2(g.db, "SELECT data FROM sqlar_dict", -1, &p, 0)
+        ==SQLITE_OK
+   && sqlite3_step(p)==SQLITE_ROW
+  ){
+    int n = sqlite3_column_bytes(p, 0);
+    char *a = sqlite3_malloc( n+1 );
+    if( a ){
+      memcpy(a, sqlite3_column_blob(p, 0), n);
+      zlib_set_dict(a, n);
+    }
+  }
+  sqlite3_finalize(p);
+}
+
+/*
+** Decompress nIn bytes of content zIn, which expands to sz bytes, into
+** the cache.  The content is not compressed if nIn==sz.  Otherwise the
+** codec is recognized from the content.
+**
+** Return 0 on success or -EIO if anything goes wrong.
+*/
+static int fillCache(const char *zIn, unsigned long int nIn,
+                     unsigned long int sz){
+  const Codec *pCodec = 0;
+  size_t nOut = sz;
+  if( nIn!=sz ){
+    pCodec = codec_detect(zIn, nIn);
+    if( pCodec==0 || pCodec->xUncompress==0 ) return -EIO;
+  }
+  g.zCacheData = sqlite3_malloc64( sz+1 );
+  if( g.zCacheData==0 ) return -EIO;
+  g.szCache = sz;
+  if( pCodec==0 ){
+    memcpy(g.zCacheData, zIn, sz);
+  }else if( pCodec->xUncompress(zIn, nIn, g.zCacheData, &nOut) || nOut!=sz ){
+    sqlite3_free(g.zCacheData);
+    g.zCacheData = 0;
+    return -EIO;
+  }
+  return 0;
+}
+
+/*
+** If the file named path[], of g.szFile bytes, is a member of a --solid
+** block, copy its content into the cache and return 0.  The block is
+** decompressed once and kept in g.aBlock[], so that reading the other
+** small files of the same block, as "cp -r" or "grep -r" would, does not
+** decompress it again.
+**
+** Return 1 if the file is not a member of a block.  Return -EIO if
+** anything goes wrong.
+*/
+static int loadSolid(const char *path){
+  int i, rc = 1;
+  if( g.pSolid==0 ){
+    sqlite3_prepare_v2(g.db,
+               "SELECT block, off FROM sqlar_solid WHERE name=?1",
+               -1, &g.pSolid, 0);
+    if( g.pSolid==0 ) return 1;
+  }
+  sqlite3_bind_text(g.pSolid, 1, path, -1, SQLITE_STATIC);
+  if( sqlite3_step(g.pSolid)==SQLITE_ROW ){
+    sqlite3_int64 iBlock = sqlite3_column_int64(g.pSolid, 0);
+    sqlite3_int64 iOff = sqlite3_column_int64(g.pSolid, 1);
+    int iB = 0;
+    rc = 0;
+    for(i=0; i<4; i++){
+      if( g.aBlock[i].a && g.aBlock[i].iBlock==iBlock ){ iB = i; break; }
+      if( g.aBlock[i].iUsed<g.aBlock[iB].iUsed ) iB = i;
+    }
+    if( i>=4 ){
+      if( g.pBlock==0 ){
+        sqlite3_prepare_v2(g.db,
+               "SELECT sz, data FROM sqlar_block WHERE id=?1",
+               -1, &g.pBlock, 0);
+      }
+      rc = -EIO;
+      if( g.pBlock ){
+        sqlite3_bind_int64(g.pBlock, 1, iBlock);
+        if( sqlite3_step(g.pBlock)==SQLITE_ROW ){
+          rc = fillCache((const char*)sqlite3_column_blob(g.pBlock, 1),
+                         (unsigned long int)sqlite3_column_bytes(g.pBlock, 1),
+                         (unsigned long int)sqlite3_column_int64(g.pBlock, 0));
+        }
+        sqlite3_reset(g.pBlock);
+      }
+      if( rc==0 ){
+        sqlite3_free(g.aBlock[iB].a);
+        g.aBlock[iB].iBlock = iBlock;
+        g.aBlock[iB].sz = g.szCache;
+        g.aBlock[iB].a = g.zCacheData;
+        g.zCacheData = 0;
+      }
+    }
+    if( rc==0 ){
+      g.aBlock[iB].iUsed = ++g.iBlockClock;
+      if( iOff<0 || iOff+g.szFile>g.aBlock[iB].sz ){
+        rc = -EIO;
+      }else{
+        g.zCacheData = sqlite3_malloc64( g.szFile+1 );
+        if( g.zCacheData==0 ){
+          rc = -EIO;
+        }else{
+          memcpy(g.zCacheData, g.aBlock[iB].a+iOff, g.szFile);
+          g.szCache = g.szFile;
+        }
+      }
+    }
+  }
+  sqlite3_reset(g.pSolid);
+  return rc;
+}
+
+/*
+** Load the part of the file named path[] that contains byte iOfst into
+** the cache, if it is not there already.  For an ordinary file, that is
+** the whole file.  For a file stored in the sqlar_chunk table, only the
+** one chunk that contains iOfst is decompressed.  Chunk content might be
+** stored in the sqlar_content table, if the archive was built with --dedup.
+** A member of a --solid block is loaded whole by loadSolid().
 **
 ** Return 0 on success.  Return an error code if the file could not be loaded.
 */
-static int loadCache(const char *path){
-  unsigned long int nIn;
-  const char *zIn;
+static int loadCache(const char *path, sqlite3_int64 iOfst){
   int rc;
   if( g.zCacheName ){
-    if( strcmp(path, g.zCacheName)==0 ) return 0;
+    if( strcmp(path, g.zCacheName)==0 ){
+      sqlite3_int64 iEnd = g.iCacheOfst + g.szCache;
+      if( iOfst>=g.iCacheOfst && (iOfst<iEnd || iEnd==g.szFile) ) return 0;
+    }
     sqlite3_free(g.zCacheName); g.zCacheName = 0;
     sqlite3_free(g.zCacheData); g.zCacheData = 0;
   }
@@ -159,20 +297,37 @@ static int loadCache(const char *path){
       return -EIO;
     }
   }
+  rc = -ENOENT;
   sqlite3_bind_text(g.pRead, 1, path, -1, SQLITE_STATIC);
   if( sqlite3_step(g.pRead)==SQLITE_ROW ){
-    g.szCache = sqlite3_column_int64(g.pRead, 0);
-    zIn = (const char*)sqlite3_column_blob(g.pRead, 1);
-    nIn = (unsigned long int)sqlite3_column_bytes(g.pRead, 1);
-    g.zCacheData = sqlite3_malloc( g.szCache );
-    if( g.zCacheData==0 ){
-      rc = -EIO;
+    g.szFile = sqlite3_column_int64(g.pRead, 0);
+    g.iCacheOfst = 0;
+    if( sqlite3_column_type(g.pRead, 1)!=SQLITE_NULL || g.szFile==0 ){
+      rc = fillCache((const char*)sqlite3_column_blob(g.pRead, 1),
+                     (unsigned long int)sqlite3_column_bytes(g.pRead, 1),
+                     (unsigned long int)g.szFile);
+    }else if( (rc = loadSolid(path))!=1 ){
+      /* A member of a --solid block */
     }else{
-      rc = uncompress((Bytef*)g.zCacheData, &g.szCache, (const Bytef*)zIn, nIn);
-      if( rc!=Z_OK ){
-        sqlite3_free(g.zCacheData);
-        g.zCacheData = 0;
-        rc = -EIO;
+      if( g.pChunk==0 ){
+        sqlite3_prepare_v2(g.db,
+               "SELECT c.off, c.sz, coalesce(c.data, t.data)"
+               "  FROM sqlar_chunk c LEFT JOIN sqlar_content t"
+               "    ON t.hash=c.hash"
+               " WHERE c.name=?1 AND c.off<=?2 ORDER BY c.off DESC LIMIT 1",
+               -1, &g.pChunk, 0);
+      }
+      rc = -EIO;
+      if( g.pChunk ){
+        sqlite3_bind_text(g.pChunk, 1, path, -1, SQLITE_STATIC);
+        sqlite3_bind_int64(g.pChunk, 2, iOfst);
+        if( sqlite3_step(g.pChunk)==SQLITE_ROW ){
+          g.iCacheOfst = sqlite3_column_int64(g.pChunk, 0);
+          rc = fillCache((const char*)sqlite3_column_blob(g.pChunk, 2),
+                         (unsigned long int)sqlite3_column_bytes(g.pChunk, 2),
+                         (unsigned long int)sqlite3_column_int64(g.pChunk, 1));
+        }
+        sqlite3_reset(g.pChunk);
       }
     }
     if( g.zCacheData ){
@@ -199,18 +354,23 @@ static int sqlarfs_read(
   struct fuse_file_info *fi
 ){
   int rc;
+  int nRead = 0;
 
-  rc = loadCache(&path[1]);
-  if( rc==0 ){
-    if( offset>=g.szCache ){
-      return 0;
-    }
-    if( offset+size>g.szCache ) size = g.szCache - offset;
-    memcpy(buf, g.zCacheData + offset, size);
-    return size;
-  }else{
-    return rc;
+  while( size>0 ){
+    sqlite3_int64 iEnd;
+    size_t n;
+    rc = loadCache(&path[1], offset);
+    if( rc ) return nRead ? nRead : rc;
+    iEnd = g.iCacheOfst + g.szCache;
+    if( offset>=iEnd ) break;
+    n = iEnd - offset;
+    if( n>size ) n = size;
+    memcpy(buf + nRead, g.zCacheData + (offset - g.iCacheOfst), n);
+    nRead += n;
+    offset += n;
+    size -= n;
   }
+  return nRead;
 }  
 
 static struct fuse_operations sqlarfs_methods = {
@@ -381,6 +541,7 @@ int main(int argc, char **argv){
     fprintf(stderr, "File [%s] is not an SQLite archive\n", argv[1]);
     exit(1);
   }
+  loadDict();
   g.uid = getuid();
   g.gid = getgid();
   azNewArg[0] = argv[0];
@@ -393,6 +554,10 @@ int main(int argc, char **argv){
   sqlite3_finalize(g.pFList);
   sqlite3_finalize(g.pExists);
   sqlite3_finalize(g.pRead);
+  sqlite3_finalize(g.pChunk);
+  sqlite3_finalize(g.pSolid);
+  sqlite3_finalize(g.pBlock);
+  for(i=0; i<4; i++) sqlite3_free(g.aBlock[i].a);
   sqlite3_free(g.zCacheName);
   sqlite3_free(g.zCacheData);
   sqlite3_close(g.db);